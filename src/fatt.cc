@@ -14,15 +14,38 @@
 #include <ctime>
 #include <cctype>
 #include <iomanip>
+#include <sstream>
 #include <map>
+#include <unordered_map>
 #include <set>
+#include <queue>
+#include <deque>
 #include <cstdlib>
 #include <algorithm>
+#include <cmath>
 #include <numeric>
+#include <random>
 #include <getopt.h>
+#include <regex.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include "sqdb.h"
 //#include <stackdump.h>
 //#include <debug.h>
@@ -57,6 +80,28 @@ static ostream& operator << (ostream& os, const CSVEscape& c)
 	return os;
 }
 
+struct JSONEscape
+{
+	const char* p;
+	JSONEscape(const char* p) : p(p) {}
+};
+
+static ostream& operator << (ostream& os, const JSONEscape& e)
+{
+	for(const char* p = e.p; *p; ++p) {
+		if(*p == '"' || *p == '\\') {
+			os << '\\' << *p;
+		} else if(0 <= *p && *p < 0x20) {
+			char buf[8];
+			sprintf(buf, "\\u%04x", *p);
+			os << buf;
+		} else {
+			os << *p;
+		}
+	}
+	return os;
+}
+
 static ostream& operator << (ostream& os, const vector<char>& v)
 {
     for(size_t i = 0; i < v.size(); i++) {
@@ -78,19 +123,42 @@ static string sep_comma(size_t val)
     return retval;
 }
 
-static size_t strlen_without_n(const char * p)
-{
-    size_t retval = 0;
-    for(; *p; p++){ if(!(*p == 'N' || *p == 'n')) retval++; }
-    return retval;
-}
-
 static void output_read_name(const char* header)
 {
 	if(*header++ == '\0') return;
 	while(*header != '\0' && *header != ' ') cout << *header++;
 }
 
+static bool read_fully(int fd, char* buf, size_t size)
+{
+    while(0 < size) {
+        const ssize_t ret = read(fd, buf, size);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return false;
+        buf += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const char* buf, size_t size)
+{
+    while(0 < size) {
+        const ssize_t ret = write(fd, buf, size);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return false;
+        buf += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static size_t find_end_of_line(const char* data, size_t size, size_t pos)
+{
+    const void* p = memchr(data + pos, '\n', size - pos);
+    return p == NULL ? size : static_cast<const char*>(p) - data;
+}
+
 static string get_index_file_name(const char* fastq_file_name)
 {
     string index_file_name = fastq_file_name;
@@ -140,29 +208,182 @@ public:
     }
 };
 
+// Process-wide pool of I/O and line buffers. Reader objects borrow buffers
+// from it and give them back when they die, so that processing thousands of
+// small files (or running several phases over the same file) does not
+// allocate and free the same large buffers again and again.
+// Buffers of HUGE_PAGE_SIZE or more are mmapped and, if enabled, backed by
+// transparent huge pages.
+class BufferPool
+{
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024u * 1024u;
+    static const size_t MAX_RETAINED_BYTES = 256 * 1024u * 1024u;
+    static const size_t MAX_OVERSIZE_RATIO = 4; // a pooled buffer is not lent for a request smaller than 1/4 of it
+    typedef multimap<size_t, char*> FreeList;
+    FreeList freeBuffers;
+    size_t retainedBytes;
+    bool useHugePages;
+    std::mutex mutex;
+
+    BufferPool() : retainedBytes(0), useHugePages(false) {}
+    ~BufferPool() {
+        for(FreeList::iterator it = freeBuffers.begin(); it != freeBuffers.end(); ++it) deallocate(it->second, it->first);
+    }
+    static size_t roundUp(size_t size) {
+        if(size < HUGE_PAGE_SIZE) return size;
+        return (size + HUGE_PAGE_SIZE - 1u) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+    char* allocate(size_t size) {
+        if(size < HUGE_PAGE_SIZE) return new char[size]; // not value-initialized on purpose
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        if(useHugePages) madvise(p, size, MADV_HUGEPAGE);
+#endif
+        return static_cast<char*>(p);
+    }
+    static void deallocate(char* p, size_t size) {
+        if(size < HUGE_PAGE_SIZE) delete[] p;
+        else munmap(p, size);
+    }
+
+public:
+    static BufferPool& instance() {
+        static BufferPool pool;
+        return pool;
+    }
+    void setUseHugePages(bool flag) { useHugePages = flag; }
+    // Returns a buffer of at least minimum_size bytes; its actual size is stored in size.
+    // The smallest pooled buffer that fits is reused unless it is more than
+    // MAX_OVERSIZE_RATIO times the (rounded) request, so that a small reader
+    // does not hold on to a huge buffer.
+    char* borrow(size_t minimum_size, size_t& size) {
+        const size_t rounded_size = roundUp(minimum_size);
+        const size_t maximum_size = rounded_size <= SIZE_MAX / MAX_OVERSIZE_RATIO ? rounded_size * MAX_OVERSIZE_RATIO : SIZE_MAX;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const FreeList::iterator it = freeBuffers.lower_bound(minimum_size);
+            if(it != freeBuffers.end() && it->first <= maximum_size) {
+                size = it->first;
+                char* p = it->second;
+                freeBuffers.erase(it);
+                retainedBytes -= size;
+                return p;
+            }
+        }
+        size = rounded_size;
+        return allocate(size);
+    }
+    void giveBack(char* p, size_t size) {
+        if(p == NULL) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(retainedBytes + size <= MAX_RETAINED_BYTES) {
+                freeBuffers.insert(FreeList::value_type(size, p));
+                retainedBytes += size;
+                return;
+            }
+        }
+        deallocate(p, size);
+    }
+};
+
+// Output buffer for cout. It starts small and doubles every time it fills up,
+// so that short runs do not pay for a large buffer that they never use.
+class GrowingStdoutBuffer : public streambuf
+{
+    static const size_t INITIAL_BUFFER_SIZE = 64 * 1024u;
+    char* buffer;
+    size_t bufferSize;
+    size_t maxBufferSize;
+
+    bool flushBuffer() {
+        const size_t size = pptr() - pbase();
+        if(size == 0) return true;
+        setp(pbase(), epptr());
+        return write_fully(STDOUT_FILENO, buffer, size);
+    }
+    void grow() {
+        const size_t nextBufferSize = bufferSize == 0 ? INITIAL_BUFFER_SIZE : std::min(bufferSize * 2u, maxBufferSize);
+        if(nextBufferSize <= bufferSize) return;
+        BufferPool::instance().giveBack(buffer, bufferSize);
+        buffer = BufferPool::instance().borrow(nextBufferSize, bufferSize);
+        setp(buffer, buffer + bufferSize);
+    }
+
+protected:
+    int_type overflow(int_type c) {
+        const bool wasFull = pptr() == epptr();
+        if(!flushBuffer()) return traits_type::eof();
+        if(wasFull) grow();
+        if(!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    streamsize xsputn(const char* s, streamsize n) {
+        if(epptr() - pptr() < n && bufferSize == maxBufferSize) {
+            // The buffer cannot hold it anyway; bypass it.
+            if(!flushBuffer() || !write_fully(STDOUT_FILENO, s, n)) return 0;
+            return n;
+        }
+        return streambuf::xsputn(s, n);
+    }
+    int sync() {
+        return flushBuffer() ? 0 : -1;
+    }
+
+public:
+    GrowingStdoutBuffer(size_t maxBufferSize) : buffer(NULL), bufferSize(0), maxBufferSize(maxBufferSize) {
+        setp(NULL, NULL);
+    }
+    ~GrowingStdoutBuffer() {
+        flushBuffer();
+        BufferPool::instance().giveBack(buffer, bufferSize);
+    }
+    void setMaxBufferSize(size_t size) { maxBufferSize = std::max(size, bufferSize); }
+};
+
 class CoutBuffering
 {
-    vector<char> buffer;
+    GrowingStdoutBuffer* buffer;
+    streambuf* originalBuffer;
 public:
-    CoutBuffering(bool) {}
+    CoutBuffering(bool) : buffer(NULL), originalBuffer(NULL) {}
+    // The buffer grows on demand up to size bytes.
     void setBufferSize(size_t size = 256 * 1024u * 1024u) {
         if(isatty(fileno(stdin))) return; // No buffering if TTY.
-        buffer.resize(size);
-        cout.rdbuf()->pubsetbuf(&*buffer.begin(), buffer.size());
+        if(buffer != NULL) {
+            buffer->setMaxBufferSize(size);
+            return;
+        }
+        cout.flush();
+        buffer = new GrowingStdoutBuffer(size);
+        originalBuffer = cout.rdbuf(buffer);
         std::ios_base::sync_with_stdio(false);
     }
-    CoutBuffering(size_t size = 256 * 1024u * 1024u) {
+    CoutBuffering(size_t size = 256 * 1024u * 1024u) : buffer(NULL), originalBuffer(NULL) {
         setBufferSize(size);
     }
+    ~CoutBuffering() {
+        if(buffer == NULL) return;
+        cout.flush();
+        cout.rdbuf(originalBuffer);
+        delete buffer;
+    }
 };
 
 class FileLineBufferWithAutoExpansion
 {
     ifstream ist;
-    bool is_first_open;
-    vector<char> bufferForIFStream;
+    bool is_open;
+    char* bufferForIFStream;
+    size_t bufferForIFStreamSize;
+    size_t maxStreamBufferSize;
     string fileName;
     static const size_t INITIAL_BUFFER_SIZE = 8 * 1024u;
+    static const size_t MIN_STREAM_BUFFER_SIZE = 64 * 1024u;
     static const size_t STREAM_BUFFER_SIZE = 16 * 1024u * 1024u;
     size_t currentBufferSize;
     size_t bufferOffsetToBeFill;
@@ -178,10 +399,10 @@ public:
 
 private:
     void expandBufferDouble() {
-        const size_t nextBufferSize = currentBufferSize * 2u;
-        char* newb = new char[nextBufferSize];
+        size_t nextBufferSize;
+        char* newb = BufferPool::instance().borrow(currentBufferSize * 2u, nextBufferSize);
         memcpy(newb, b, bufferOffsetToBeFill);
-        delete[] b;
+        BufferPool::instance().giveBack(b, currentBufferSize);
         b = newb;
         currentBufferSize = nextBufferSize;
         isFASTAMode = false;
@@ -193,30 +414,46 @@ private:
         if(ret != 0) return false;
         return S_ISDIR(s.st_mode);
     }
+    // The stream buffer is no larger than the file, and it is allocated
+    // without being zero-filled.
+    void prepareStreamBuffer(const char* fname) {
+        size_t size = maxStreamBufferSize;
+        struct stat s;
+        if(stat(fname, &s) == 0 && S_ISREG(s.st_mode) && static_cast<size_t>(s.st_size) < size) {
+            size = std::max<size_t>(MIN_STREAM_BUFFER_SIZE, s.st_size + 1u);
+        }
+        if(bufferForIFStreamSize < size) {
+            BufferPool::instance().giveBack(bufferForIFStream, bufferForIFStreamSize);
+            bufferForIFStream = BufferPool::instance().borrow(size, bufferForIFStreamSize);
+        }
+        ist.rdbuf()->pubsetbuf(bufferForIFStream, size);
+    }
 
 public:
     FileLineBufferWithAutoExpansion() {
-        b = new char[INITIAL_BUFFER_SIZE];
-        currentBufferSize = INITIAL_BUFFER_SIZE;
+        b = BufferPool::instance().borrow(INITIAL_BUFFER_SIZE, currentBufferSize);
         line_count = 0; // Just for safety
         off_count = 0;
         headerID.reserve(INITIAL_BUFFER_SIZE);
-        bufferForIFStream.resize(STREAM_BUFFER_SIZE);
-        is_first_open = true;
+        bufferForIFStream = NULL;
+        bufferForIFStreamSize = 0;
+        maxStreamBufferSize = STREAM_BUFFER_SIZE;
+        is_open = false;
     }
     ~FileLineBufferWithAutoExpansion() {
-        if(!is_first_open) close();
-        delete[] b;
+        if(is_open) close();
+        BufferPool::instance().giveBack(b, currentBufferSize);
+        BufferPool::instance().giveBack(bufferForIFStream, bufferForIFStreamSize);
     }
+    // A large stream buffer makes sequential reading fast, but every seekg()
+    // refills it. Callers that seek a lot should call this before open().
+    void setRandomAccessMode() { maxStreamBufferSize = MIN_STREAM_BUFFER_SIZE; }
     bool open(const char* file_name) {
         if(isDirectory(file_name)) { return false; }
-        if(is_first_open) {
-            is_first_open = false;
-            ist.rdbuf()->pubsetbuf(&*bufferForIFStream.begin(), bufferForIFStream.size());
-        } else {
-            close();
-        }
+        if(is_open) close();
+        prepareStreamBuffer(file_name);
         ist.open(file_name, ios::binary);
+        is_open = true;
         line_count = 0;
         off_count = 0;
         fileName = file_name;
@@ -224,6 +461,8 @@ public:
     }
     void close() {
         ist.close();
+        ist.clear();
+        is_open = false;
     }
     bool getline() {
         bufferOffsetToBeFill = 0u;
@@ -308,11 +547,615 @@ public:
     }
 };
 
+// A FASTA/FASTQ record as read by FastxRecordReader.
+struct FastxRecord
+{
+    string text;     ///< the whole record as it is in the file, with newlines
+    string header;   ///< the header line, including '>' or '@'
+    string sequence; ///< the sequence lines concatenated
+    string qv;       ///< the QV lines concatenated (FASTQ only)
+    off_t offset;    ///< the offset of the header line in the file
+
+    const char* name(size_t& length) const {
+        if(header.empty()) {
+            length = 0;
+            return header.c_str();
+        }
+        const char* start = header.c_str() + 1;
+        const char* end = start;
+        while(*end != '\0' && *end != ' ') ++end;
+        length = end - start;
+        return start;
+    }
+    void clear() {
+        text.clear();
+        header.clear();
+        sequence.clear();
+        qv.clear();
+        offset = 0;
+    }
+};
+
+// Reads a file record by record. The records are split in the same way as
+// the line-by-line loops elsewhere in this file do, so text reproduces the
+// input byte by byte.
+class FastxRecordReader
+{
+    FileLineBufferWithAutoExpansion& f;
+    bool started;
+    bool reachedEOF;
+    bool isFASTQ;
+
+    void appendLine(string& s) {
+        s.append(f.b, f.len());
+        s += '\n';
+    }
+
+public:
+    FastxRecordReader(FileLineBufferWithAutoExpansion& f) : f(f), started(false), reachedEOF(false), isFASTQ(false) {}
+    bool looksLikeFASTQ() const { return isFASTQ; }
+    bool next(FastxRecord& r) {
+        if(!started) {
+            started = true;
+            if(!f.getline()) reachedEOF = true;
+            else isFASTQ = f.looksLikeFASTQHeader();
+        }
+        if(reachedEOF) return false;
+        r.clear();
+        r.offset = f.get_offset() - static_cast<off_t>(f.len()) - 1;
+        r.header.assign(f.b, f.len());
+        appendLine(r.text);
+        if(isFASTQ) {
+            f.registerHeaderLine();
+            while(true) {
+                if(!f.getline()) {
+                    reachedEOF = true;
+                    return true;
+                }
+                if(f.looksLikeFASTQSeparator()) break;
+                r.sequence.append(f.b, f.len());
+                appendLine(r.text);
+            }
+            appendLine(r.text);
+            long long n = r.sequence.size();
+            while(f.getline()) {
+                const size_t number_of_qvchars_in_line = f.len();
+                n -= number_of_qvchars_in_line;
+                r.qv.append(f.b, number_of_qvchars_in_line);
+                appendLine(r.text);
+                if(n <= 0) break;
+            }
+            f.expectHeaderOfEOF();
+            if(!f.getline()) reachedEOF = true;
+        } else {
+            while(true) {
+                if(!f.getline()) {
+                    reachedEOF = true;
+                    break;
+                }
+                if(f.looksLikeFASTAHeader()) break;
+                r.sequence.append(f.b, f.len());
+                appendLine(r.text);
+            }
+        }
+        return true;
+    }
+};
+
+// A batch of consecutive records of one file for ParallelRecordScanner.
+// Workers leave per-record results in values and text in output.
+struct RecordBatch
+{
+    vector<FastxRecord> records;
+    size_t numberOfRecords;      ///< records[0, numberOfRecords) are valid
+    uint64_t firstRecordNumber;  ///< 0-origin, counted over all the files
+    size_t fileIndex;
+    vector<uint64_t> values;
+    string output;
+    size_t sequenceNumber;       ///< the order of the batch
+};
+
+// Reads records on the calling thread, calls process() for each batch on
+// worker threads, and then consume() for each batch on the calling thread
+// in input order. Only a few batches per thread are in flight, so memory
+// does not depend on the input size. With one thread, everything is done on
+// the calling thread.
+class ParallelRecordScanner
+{
+public:
+    typedef std::function<void(RecordBatch&)> BatchFunction;
+
+private:
+    int numberOfThreads;
+    size_t recordsPerBatch;
+    std::mutex mtx;
+    std::condition_variable cv;
+    deque<RecordBatch*> waiting;
+    map<size_t, RecordBatch*> processed;
+    bool noMoreBatches;
+    std::atomic<bool> stopRequested;
+
+    void work(const BatchFunction* process) {
+        while(true) {
+            RecordBatch* batch;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                while(waiting.empty() && !noMoreBatches) cv.wait(lock);
+                if(waiting.empty()) return;
+                batch = waiting.front();
+                waiting.pop_front();
+            }
+            (*process)(*batch);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                processed[batch->sequenceNumber] = batch;
+            }
+            cv.notify_all();
+        }
+    }
+    // Waits for the next batch in order and returns it after consume().
+    RecordBatch* consumeNext(size_t sequenceNumber, const BatchFunction& consume) {
+        RecordBatch* batch;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            while(processed.find(sequenceNumber) == processed.end()) cv.wait(lock);
+            batch = processed[sequenceNumber];
+            processed.erase(sequenceNumber);
+        }
+        consume(*batch);
+        return batch;
+    }
+    bool fillBatch(FastxRecordReader& reader, RecordBatch& batch) {
+        batch.numberOfRecords = 0;
+        batch.values.clear();
+        batch.output.clear();
+        if(stopRequested) return false;
+        if(batch.records.size() < recordsPerBatch) batch.records.resize(recordsPerBatch);
+        while(batch.numberOfRecords < recordsPerBatch && reader.next(batch.records[batch.numberOfRecords])) batch.numberOfRecords++;
+        return 0 < batch.numberOfRecords;
+    }
+
+public:
+    ParallelRecordScanner(int numberOfThreads, size_t recordsPerBatch = 4096u)
+        : numberOfThreads(numberOfThreads), recordsPerBatch(recordsPerBatch), noMoreBatches(false), stopRequested(false) {}
+    // Stops reading; the batches already read are still processed and consumed.
+    // consume() may call this, e.g. on an error.
+    void stop() { stopRequested = true; }
+    // Returns false if any of the files cannot be opened (the others are still read).
+    bool run(const vector<const char*>& file_names, const BatchFunction& process, const BatchFunction& consume) {
+        bool succeeded = true;
+        uint64_t recordNumber = 0;
+        stopRequested = false;
+        if(numberOfThreads <= 1) {
+            RecordBatch batch;
+            for(size_t i = 0; i < file_names.size() && !stopRequested; ++i) {
+                FileLineBufferWithAutoExpansion f;
+                if(!f.open(file_names[i])) {
+                    cerr << "Cannot open '" << file_names[i] << "'" << endl;
+                    succeeded = false;
+                    continue;
+                }
+                FastxRecordReader reader(f);
+                while(fillBatch(reader, batch)) {
+                    batch.firstRecordNumber = recordNumber;
+                    batch.fileIndex = i;
+                    batch.sequenceNumber = 0;
+                    recordNumber += batch.numberOfRecords;
+                    process(batch);
+                    consume(batch);
+                }
+            }
+            return succeeded;
+        }
+        noMoreBatches = false;
+        vector<RecordBatch> batches(numberOfThreads * 3u);
+        vector<RecordBatch*> freeBatches;
+        for(size_t i = 0; i < batches.size(); ++i) freeBatches.push_back(&batches[i]);
+        vector<std::thread> workers;
+        for(int i = 0; i < numberOfThreads; ++i) workers.push_back(std::thread(&ParallelRecordScanner::work, this, &process));
+        size_t nextToRead = 0;
+        size_t nextToConsume = 0;
+        for(size_t i = 0; i < file_names.size() && !stopRequested; ++i) {
+            FileLineBufferWithAutoExpansion f;
+            if(!f.open(file_names[i])) {
+                cerr << "Cannot open '" << file_names[i] << "'" << endl;
+                succeeded = false;
+                continue;
+            }
+            FastxRecordReader reader(f);
+            while(true) {
+                if(freeBatches.empty()) freeBatches.push_back(consumeNext(nextToConsume++, consume));
+                RecordBatch* batch = freeBatches.back();
+                if(!fillBatch(reader, *batch)) break;
+                freeBatches.pop_back();
+                batch->firstRecordNumber = recordNumber;
+                batch->fileIndex = i;
+                batch->sequenceNumber = nextToRead++;
+                recordNumber += batch->numberOfRecords;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    waiting.push_back(batch);
+                }
+                cv.notify_all();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            noMoreBatches = true;
+        }
+        cv.notify_all();
+        while(nextToConsume < nextToRead) consumeNext(nextToConsume++, consume);
+        for(size_t i = 0; i < workers.size(); ++i) workers[i].join();
+        return succeeded;
+    }
+};
+
+// Accumulators for the process function of ParallelRecordScanner: a batch takes
+// one that no other thread is using and gives it back, so there are at most as
+// many as threads, and they are merged after the scan.
+template<class Accumulator>
+class AccumulatorPool
+{
+    std::mutex mtx;
+    vector<Accumulator*> all;
+    vector<Accumulator*> available;
+    std::function<Accumulator*()> create;
+
+    AccumulatorPool(const AccumulatorPool&);
+    AccumulatorPool& operator=(const AccumulatorPool&);
+
+public:
+    AccumulatorPool(const std::function<Accumulator*()>& create) : create(create) {}
+    ~AccumulatorPool() {
+        for(size_t i = 0; i < all.size(); ++i) delete all[i];
+    }
+    Accumulator* take() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(available.empty()) {
+            all.push_back(create());
+            return all.back();
+        }
+        Accumulator* accumulator = available.back();
+        available.pop_back();
+        return accumulator;
+    }
+    void giveBack(Accumulator* accumulator) {
+        std::lock_guard<std::mutex> lock(mtx);
+        available.push_back(accumulator);
+    }
+    const vector<Accumulator*>& accumulators() const { return all; }
+};
+
+// Reads the records of a file on a thread of its own, a batch ahead of the
+// caller, so that reading two files in lockstep overlaps their I/O and parsing.
+class ReadAheadRecordReader
+{
+    static const size_t RECORDS_PER_BATCH = 1024u;
+    static const size_t NUMBER_OF_BATCHES = 4u;
+    FileLineBufferWithAutoExpansion f;
+    RecordBatch batches[NUMBER_OF_BATCHES];
+    std::mutex mtx;
+    std::condition_variable cv;
+    deque<RecordBatch*> filled;
+    vector<RecordBatch*> emptied;
+    bool reachedEOF;
+    bool stopping;
+    std::thread producer;
+    RecordBatch* current;
+    size_t positionInCurrent;
+
+    ReadAheadRecordReader(const ReadAheadRecordReader&);
+    ReadAheadRecordReader& operator=(const ReadAheadRecordReader&);
+
+    void produce() {
+        FastxRecordReader reader(f);
+        while(true) {
+            RecordBatch* batch;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                while(emptied.empty() && !stopping) cv.wait(lock);
+                if(stopping) return;
+                batch = emptied.back();
+                emptied.pop_back();
+            }
+            if(batch->records.size() < RECORDS_PER_BATCH) batch->records.resize(RECORDS_PER_BATCH);
+            batch->numberOfRecords = 0;
+            while(batch->numberOfRecords < RECORDS_PER_BATCH && reader.next(batch->records[batch->numberOfRecords])) batch->numberOfRecords++;
+            // A short batch means the end of file.
+            const bool is_last = batch->numberOfRecords < RECORDS_PER_BATCH;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if(batch->numberOfRecords == 0) emptied.push_back(batch);
+                else filled.push_back(batch);
+                if(is_last) reachedEOF = true;
+            }
+            cv.notify_all();
+            if(is_last) return;
+        }
+    }
+
+public:
+    ReadAheadRecordReader() : reachedEOF(false), stopping(false), current(NULL), positionInCurrent(0) {}
+    ~ReadAheadRecordReader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        if(producer.joinable()) producer.join();
+    }
+    bool open(const char* file_name) {
+        if(!f.open(file_name)) return false;
+        for(size_t i = 0; i < NUMBER_OF_BATCHES; ++i) emptied.push_back(&batches[i]);
+        producer = std::thread(&ReadAheadRecordReader::produce, this);
+        return true;
+    }
+    // Returns NULL at the end of file. The record is valid until the next call.
+    const FastxRecord* next() {
+        if(current != NULL && positionInCurrent < current->numberOfRecords) return &current->records[positionInCurrent++];
+        std::unique_lock<std::mutex> lock(mtx);
+        if(current != NULL) {
+            emptied.push_back(current);
+            current = NULL;
+            cv.notify_all();
+        }
+        while(filled.empty() && !reachedEOF) cv.wait(lock);
+        if(filled.empty()) return NULL;
+        current = filled.front();
+        filled.pop_front();
+        positionInCurrent = 1;
+        return &current->records[0];
+    }
+};
+
+// The numbers of A, C, G, T and N (case-insensitive), of the other characters,
+// and of lowercase letters (soft-masked bases), in a span of sequence.
+struct NucleotideClassCounts
+{
+    size_t a, c, g, t, n, other, lowercase;
+
+    NucleotideClassCounts() { clear(); }
+    void clear() { a = c = g = t = n = other = lowercase = 0; }
+    size_t gc() const { return g + c; }
+};
+
+// Classifies the characters in p[0, length) in one pass, 16 bytes at a time with SSE2,
+// adding to counts. If n_run_boundaries is not NULL, the positions at which an N run
+// starts or ends (a character is N and the one before it is not, or vice versa) are
+// appended to it, taking the character before p[0] to be N if previous_is_n.
+// Returns whether the last character is N (or previous_is_n if length is 0).
+static bool classify_nucleotides(const char* p, size_t length, NucleotideClassCounts& counts,
+                                 vector<size_t>* n_run_boundaries = NULL, bool previous_is_n = false)
+{
+    size_t i = 0;
+    unsigned int carry = previous_is_n ? 1 : 0;
+    size_t a = 0, c = 0, g = 0, t = 0, n = 0, lowercase = 0;
+#ifdef __SSE2__
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i va = _mm_set1_epi8('a');
+    const __m128i vc = _mm_set1_epi8('c');
+    const __m128i vg = _mm_set1_epi8('g');
+    const __m128i vt = _mm_set1_epi8('t');
+    const __m128i vn = _mm_set1_epi8('n');
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i zero = _mm_setzero_si128();
+    // Each byte lane of the accumulators counts up to 255 blocks; then they are summed by PSADBW.
+    // The last partial block is copied into a zero-filled one; zeros are not counted in any
+    // class (so they are in "other", which is computed from the length), and are never N.
+    while(i < length) {
+        __m128i acc_a = zero, acc_c = zero, acc_g = zero, acc_t = zero, acc_n = zero, acc_lower = zero;
+        const size_t end = min(length, i + 255u * 16u);
+        for(; i < end; i += 16u) {
+            __m128i block;
+            unsigned int valid = 0xFFFFu;
+            if(i + 16u <= length) {
+                block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            } else {
+                char tail[16] = {0};
+                memcpy(tail, p + i, length - i);
+                block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+                valid = (1u << (length - i)) - 1u;
+            }
+            const __m128i folded = _mm_or_si128(block, lower);
+            const __m128i is_n = _mm_cmpeq_epi8(folded, vn);
+            acc_a = _mm_sub_epi8(acc_a, _mm_cmpeq_epi8(folded, va));
+            acc_c = _mm_sub_epi8(acc_c, _mm_cmpeq_epi8(folded, vc));
+            acc_g = _mm_sub_epi8(acc_g, _mm_cmpeq_epi8(folded, vg));
+            acc_t = _mm_sub_epi8(acc_t, _mm_cmpeq_epi8(folded, vt));
+            acc_n = _mm_sub_epi8(acc_n, is_n);
+            acc_lower = _mm_sub_epi8(acc_lower, _mm_and_si128(_mm_cmpgt_epi8(block, before_a), _mm_cmplt_epi8(block, after_z)));
+            if(n_run_boundaries != NULL) {
+                const unsigned int n_mask = _mm_movemask_epi8(is_n);
+                unsigned int toggles = (n_mask ^ ((n_mask << 1) | carry)) & valid;
+                while(toggles != 0) {
+                    n_run_boundaries->push_back(i + __builtin_ctz(toggles));
+                    toggles &= toggles - 1;
+                }
+                carry = n_mask >> 15;
+            }
+        }
+        uint64_t lanes[2];
+#define SUM_BYTE_LANES(acc, total) _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_sad_epu8(acc, zero)); total += lanes[0] + lanes[1];
+        SUM_BYTE_LANES(acc_a, a);
+        SUM_BYTE_LANES(acc_c, c);
+        SUM_BYTE_LANES(acc_g, g);
+        SUM_BYTE_LANES(acc_t, t);
+        SUM_BYTE_LANES(acc_n, n);
+        SUM_BYTE_LANES(acc_lower, lowercase);
+#undef SUM_BYTE_LANES
+    }
+#endif
+    for(; i < length; ++i) {
+        const char ch = p[i];
+        unsigned int is_n = 0;
+        switch(ch | 0x20) {
+        case 'a': a++; break;
+        case 'c': c++; break;
+        case 'g': g++; break;
+        case 't': t++; break;
+        case 'n': n++; is_n = 1; break;
+        }
+        if('a' <= ch && ch <= 'z') lowercase++;
+        if(n_run_boundaries != NULL && is_n != carry) n_run_boundaries->push_back(i);
+        carry = is_n;
+    }
+    counts.a += a;
+    counts.c += c;
+    counts.g += g;
+    counts.t += t;
+    counts.n += n;
+    counts.other += length - (a + c + g + t + n);
+    counts.lowercase += lowercase;
+    return 0 < length ? isN(p[length - 1]) : previous_is_n;
+}
+
+static size_t count_n(const char* p, size_t length)
+{
+    NucleotideClassCounts counts;
+    classify_nucleotides(p, length, counts);
+    return counts.n;
+}
+
+// An exact histogram of sequence lengths, from which N50 etc. are computed
+// without keeping (or sorting) one entry per sequence.
+// The counts of lengths below SMALL_LENGTH_LIMIT are in an array that grows up to the
+// longest such length seen, and longer ones are in a map, so the memory is proportional
+// to the number of distinct lengths rather than the number of sequences.
+class LengthHistogram
+{
+    static const size_t SMALL_LENGTH_LIMIT = 1u << 20;
+    vector<uint64_t> smallLengthCounts;
+    map<size_t, uint64_t> largeLengthCounts;
+    uint64_t numberOfSequences;
+    unsigned long long totalLength;
+
+public:
+    typedef pair<size_t, uint64_t> LengthAndCount;
+
+    LengthHistogram() : numberOfSequences(0), totalLength(0) {}
+    void add(size_t length, uint64_t count = 1) {
+        if(length < SMALL_LENGTH_LIMIT) {
+            if(smallLengthCounts.size() <= length) smallLengthCounts.resize(max(length + 1, smallLengthCounts.size() * 2));
+            smallLengthCounts[length] += count;
+        } else {
+            largeLengthCounts[length] += count;
+        }
+        numberOfSequences += count;
+        totalLength += static_cast<unsigned long long>(length) * count;
+    }
+    void merge(const LengthHistogram& other) {
+        vector<LengthAndCount> entries;
+        other.getLengthsInDescendingOrder(entries);
+        for(size_t i = 0; i < entries.size(); ++i) add(entries[i].first, entries[i].second);
+    }
+    uint64_t size() const { return numberOfSequences; }
+    unsigned long long total() const { return totalLength; }
+    // Nxx is the length of the sequence at which the sum of the lengths, the longest first,
+    // reaches xx% of the total, and numbers[i] is how many sequences it takes.
+    // Within a run of sequences of the same length, the number needed is computed by a division.
+    // fractions must be in ascending order, and the histogram must not be empty.
+    void getNx(const double* fractions, int number_of_fractions, size_t* lengths, uint64_t* numbers) const {
+        vector<LengthAndCount> length_and_counts;
+        getLengthsInDescendingOrder(length_and_counts);
+        size_t entry_index = 0;
+        unsigned long long sum = 0;
+        uint64_t sequence_index = 0;
+        for(int i = 0; i < number_of_fractions; ++i) {
+            const unsigned long long nx_total_length = (size_t)((totalLength + 1ull) * fractions[i]);
+            while(entry_index < length_and_counts.size()) {
+                const size_t length = length_and_counts[entry_index].first;
+                const uint64_t count = length_and_counts[entry_index].second;
+                if(nx_total_length <= sum + length * count) break;
+                sum += length * count;
+                sequence_index += count;
+                entry_index++;
+            }
+            if(entry_index < length_and_counts.size()) {
+                const size_t length = length_and_counts[entry_index].first;
+                lengths[i] = length;
+                numbers[i] = sequence_index + (nx_total_length - sum + length - 1) / length;
+            } else {
+                lengths[i] = length_and_counts.back().first;
+                numbers[i] = sequence_index;
+            }
+        }
+    }
+    size_t minLength() const {
+        for(size_t length = 0; length < smallLengthCounts.size(); ++length) {
+            if(0 < smallLengthCounts[length]) return length;
+        }
+        return largeLengthCounts.empty() ? 0 : largeLengthCounts.begin()->first;
+    }
+    size_t maxLength() const {
+        if(!largeLengthCounts.empty()) return largeLengthCounts.rbegin()->first;
+        for(size_t length = smallLengthCounts.size(); 0 < length--; ) {
+            if(0 < smallLengthCounts[length]) return length;
+        }
+        return 0;
+    }
+    // The distinct lengths (with their counts), the longest first.
+    void getLengthsInDescendingOrder(vector<LengthAndCount>& entries) const {
+        entries.clear();
+        for(map<size_t, uint64_t>::const_reverse_iterator it = largeLengthCounts.rbegin(); it != largeLengthCounts.rend(); ++it) {
+            entries.push_back(*it);
+        }
+        for(size_t length = smallLengthCounts.size(); 0 < length--; ) {
+            if(0 < smallLengthCounts[length]) entries.push_back(LengthAndCount(length, smallLengthCounts[length]));
+        }
+    }
+};
+
+// The number of G/C and of each QV character, collected by calculate_n50_statistics if asked.
+// (The number of N is the difference of the total lengths of the scaffolds with and without gaps.)
+struct BaseComposition
+{
+    uint64_t gcCount;
+    uint64_t qvCharCounts[256];
+
+    BaseComposition() : gcCount(0) { fill(qvCharCounts, qvCharCounts + 256, 0ull); }
+    void addSequence(const NucleotideClassCounts& counts) {
+        gcCount += counts.gc();
+    }
+    void addQVs(const char* p, size_t length) {
+        for(size_t i = 0; i < length; ++i) qvCharCounts[static_cast<unsigned char>(p[i])]++;
+    }
+    void merge(const BaseComposition& other) {
+        gcCount += other.gcCount;
+        for(int i = 0; i < 256; ++i) qvCharCounts[i] += other.qvCharCounts[i];
+    }
+};
+
+// Splits a line of sequence at N runs: adds the non-N bases before the first N run to
+// the contig being extended (length_as_contigs), and the contigs that end in this line to
+// length_of_contigs. Returns the number of non-N bases in the line.
+static size_t add_contigs_in_line(const char* line, size_t length, size_t& length_as_contigs, LengthHistogram& length_of_contigs,
+                                  BaseComposition* composition, vector<size_t>& n_run_boundaries)
+{
+    NucleotideClassCounts counts;
+    n_run_boundaries.clear();
+    classify_nucleotides(line, length, counts, &n_run_boundaries);
+    if(composition != NULL) composition->addSequence(counts);
+    // The boundaries alternate between the start and the end of an N run, starting with a start.
+    size_t start = 0;
+    for(size_t i = 0; i < n_run_boundaries.size(); i += 2) {
+        length_as_contigs += n_run_boundaries[i] - start;
+        if(0 < length_as_contigs) {
+            length_of_contigs.add(length_as_contigs);
+            length_as_contigs = 0;
+        }
+        start = i + 1 < n_run_boundaries.size() ? n_run_boundaries[i + 1] : length;
+    }
+    length_as_contigs += length - start;
+    return length - counts.n;
+}
+
 // returns true if succeeded.
 bool calculate_n50_statistics(const char* fname,
-                              vector<size_t>& length_of_scaffolds_wgap,
-                              vector<size_t>& length_of_scaffolds_wogap,
-                              vector<size_t>& length_of_contigs)
+                              LengthHistogram& length_of_scaffolds_wgap,
+                              LengthHistogram& length_of_scaffolds_wogap,
+                              LengthHistogram& length_of_contigs,
+                              BaseComposition* composition = NULL)
 {
     FileLineBufferWithAutoExpansion f;
     if(!f.open(fname)) {
@@ -323,37 +1166,28 @@ bool calculate_n50_statistics(const char* fname,
         size_t length_as_scaffolds_wgap = 0;
         size_t length_as_scaffolds_wogap = 0;
         size_t length_as_contigs = 0;
+        vector<size_t> n_run_boundaries;
         if(!f.looksLikeFASTQHeader()) { 
 			// This should be FASTA
             while(f.getline()) {
                 if(f.looksLikeFASTAHeader()) {
-                    length_of_scaffolds_wgap.push_back(length_as_scaffolds_wgap);
-                    length_of_scaffolds_wogap.push_back(length_as_scaffolds_wogap);
+                    length_of_scaffolds_wgap.add(length_as_scaffolds_wgap);
+                    length_of_scaffolds_wogap.add(length_as_scaffolds_wogap);
                     length_as_scaffolds_wgap = 0;
                     length_as_scaffolds_wogap = 0;
                     if(0 < length_as_contigs) {
-                        length_of_contigs.push_back(length_as_contigs);
+                        length_of_contigs.add(length_as_contigs);
                         length_as_contigs = 0;
                     }
                 } else {
                     length_as_scaffolds_wgap += f.len();
-                    length_as_scaffolds_wogap += strlen_without_n(f.b);
-                    for(const char* p = f.b; *p != '\0'; p++) {
-                        if(*p == 'N' || *p == 'n') {
-                            if(0 < length_as_contigs) {
-                                length_of_contigs.push_back(length_as_contigs);
-                                length_as_contigs = 0;
-                            }
-                        } else {
-                            length_as_contigs++;
-                        }
-                    }
+                    length_as_scaffolds_wogap += add_contigs_in_line(f.b, f.len(), length_as_contigs, length_of_contigs, composition, n_run_boundaries);
                 }
 			}
-            length_of_scaffolds_wgap.push_back(length_as_scaffolds_wgap);
-            length_of_scaffolds_wogap.push_back(length_as_scaffolds_wogap);
+            length_of_scaffolds_wgap.add(length_as_scaffolds_wgap);
+            length_of_scaffolds_wogap.add(length_as_scaffolds_wogap);
             if(0 < length_as_contigs) {
-                length_of_contigs.push_back(length_as_contigs);
+                length_of_contigs.add(length_as_contigs);
             }
 		} else {
             while(f.getline()) {
@@ -362,39 +1196,30 @@ bool calculate_n50_statistics(const char* fname,
                     while(f.getline()) {
                         const size_t number_of_qvchars_in_line = f.len();
                         n -= number_of_qvchars_in_line;
+                        if(composition != NULL) composition->addQVs(f.b, number_of_qvchars_in_line);
                         if(n <= 0) break;
                     }
                     f.expectHeaderOfEOF();
                     if(!f.getline()) break;
                     f.registerHeaderLine();
-                    length_of_scaffolds_wgap.push_back(length_as_scaffolds_wgap);
-                    length_of_scaffolds_wogap.push_back(length_as_scaffolds_wogap);
+                    length_of_scaffolds_wgap.add(length_as_scaffolds_wgap);
+                    length_of_scaffolds_wogap.add(length_as_scaffolds_wogap);
                     length_as_scaffolds_wgap = 0;
                     length_as_scaffolds_wogap = 0;
                     if(0 < length_as_contigs) {
-                        length_of_contigs.push_back(length_as_contigs);
+                        length_of_contigs.add(length_as_contigs);
                         length_as_contigs = 0;
                     }
                 } else {
                     const size_t number_of_nucleotides_in_line = f.len();
                     length_as_scaffolds_wgap += number_of_nucleotides_in_line;
-                    length_as_scaffolds_wogap += strlen_without_n(f.b);
-                    for(const char* p = f.b; *p != '\0'; p++) {
-                        if(*p == 'N' || *p == 'n') {
-                            if(0 < length_as_contigs) {
-                                length_of_contigs.push_back(length_as_contigs);
-                                length_as_contigs = 0;
-                            }
-                        } else {
-                            length_as_contigs++;
-                        }
-                    }
+                    length_as_scaffolds_wogap += add_contigs_in_line(f.b, number_of_nucleotides_in_line, length_as_contigs, length_of_contigs, composition, n_run_boundaries);
                 }
             }
-            length_of_scaffolds_wgap.push_back(length_as_scaffolds_wgap);
-            length_of_scaffolds_wogap.push_back(length_as_scaffolds_wogap);
+            length_of_scaffolds_wgap.add(length_as_scaffolds_wgap);
+            length_of_scaffolds_wogap.add(length_as_scaffolds_wogap);
             if(0 < length_as_contigs) {
-                length_of_contigs.push_back(length_as_contigs);
+                length_of_contigs.add(length_as_contigs);
             }
 		}
 	}
@@ -521,32 +1346,797 @@ static string get_read_name_from_header(const char* header)
     return rv;
 }
 
-static void add_read_name_and_show_error_if_duplicates(map<string, int>& readName2fileIndex, char** argv, char* headerLine, int fileIndex, bool doNotShowFileName)
+// Returns the read name in a header line as a view (pointer and length)
+// into the line, without copying it.
+static const char* find_read_name_in_header(const char* header, size_t& length)
 {
-	if(*headerLine++ == '\0') return;
-    char* start = headerLine;
-    char* end = start;
+    if(*header == '\0') {
+        length = 0;
+        return header;
+    }
+    const char* start = header + 1;
+    const char* end = start;
     while(*end != '\0' && *end != ' ') ++end;
-    const char saved_char = *end; *end = '\0';
-    string readName = start;
-    const map<string, int>::const_iterator cit = readName2fileIndex.find(readName);
-    if(cit == readName2fileIndex.end()) {
-        readName2fileIndex[readName] = fileIndex;
-    } else {
-        cerr << start;
-        if(!doNotShowFileName)
-            cerr << '\t' << argv[cit->second];
-        cerr << '\n';
+    length = end - start;
+    return start;
+}
+
+static inline uint64_t hash_bytes(const char* p, size_t length, uint64_t seed = 0)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ seed ^ (length * 0xC2B2AE3D27D4EB4Full);
+    while(8 <= length) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        p += 8;
+        length -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, length);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// A 128-bit hash of sequences (or any bytes) for content-based deduplication.
+// It accumulates 32-byte stripes into four 64-bit lanes with 32x32->64-bit
+// multiplications in the manner of XXH3, which SSE2 can do two lanes at a
+// time. The scalar version computes the same values.
+static void hash_sequence_128(const char* p, size_t length, uint64_t* out)
+{
+    static const uint64_t keys[4] = { 0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull };
+    static const uint64_t PRIME32 = 0x9E3779B1u;
+    static const size_t STRIPE = 32;
+    static const size_t STRIPES_PER_SCRAMBLE = 16;
+    uint64_t acc[4] = { 0xC2B2AE3Du, 0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B1u };
+    char last_stripe[STRIPE];
+    const size_t number_of_stripes = (length + STRIPE - 1u) / STRIPE;
+#ifdef __SSE2__
+    __m128i acc0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc));
+    __m128i acc1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + 2));
+    const __m128i key0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    const __m128i key1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 2));
+    const __m128i prime = _mm_set1_epi32(PRIME32);
+#endif
+    for(size_t s = 0; s < number_of_stripes; ++s) {
+        const char* stripe = p + s * STRIPE;
+        if(length < (s + 1u) * STRIPE) {
+            memset(last_stripe, 0, STRIPE);
+            memcpy(last_stripe, stripe, length - s * STRIPE);
+            stripe = last_stripe;
+        }
+#ifdef __SSE2__
+        const __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe));
+        const __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe + 16));
+        const __m128i dk0 = _mm_xor_si128(d0, key0);
+        const __m128i dk1 = _mm_xor_si128(d1, key1);
+        acc0 = _mm_add_epi64(acc0, _mm_add_epi64(_mm_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)), _mm_mul_epu32(dk0, _mm_srli_epi64(dk0, 32))));
+        acc1 = _mm_add_epi64(acc1, _mm_add_epi64(_mm_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)), _mm_mul_epu32(dk1, _mm_srli_epi64(dk1, 32))));
+        if((s + 1u) % STRIPES_PER_SCRAMBLE == 0) {
+            __m128i a0 = _mm_xor_si128(_mm_xor_si128(acc0, _mm_srli_epi64(acc0, 47)), key0);
+            __m128i a1 = _mm_xor_si128(_mm_xor_si128(acc1, _mm_srli_epi64(acc1, 47)), key1);
+            acc0 = _mm_add_epi64(_mm_mul_epu32(a0, prime), _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a0, 32), prime), 32));
+            acc1 = _mm_add_epi64(_mm_mul_epu32(a1, prime), _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a1, 32), prime), 32));
+        }
+#else
+        uint64_t d[4];
+        memcpy(d, stripe, STRIPE);
+        for(size_t i = 0; i < 4; ++i) {
+            const uint64_t dk = d[i] ^ keys[i];
+            acc[i] += d[i ^ 1u] + (dk & 0xFFFFFFFFu) * (dk >> 32);
+        }
+        if((s + 1u) % STRIPES_PER_SCRAMBLE == 0) {
+            for(size_t i = 0; i < 4; ++i) acc[i] = (acc[i] ^ (acc[i] >> 47) ^ keys[i]) * PRIME32;
+        }
+#endif
     }
-    *end = saved_char;
+#ifdef __SSE2__
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), acc0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + 2), acc1);
+#endif
+    const uint64_t l = length * 0x9E3779B97F4A7C15ull;
+    out[0] = mix64(mix64(acc[0] ^ l) + mix64(acc[1] ^ keys[2]) + acc[2] * 3u + acc[3]);
+    out[1] = mix64(mix64(acc[2] ^ keys[0]) + mix64(acc[3] ^ l) + acc[0] * 5u + acc[1]);
 }
 
-void do_check_same_names(int argc, char** argv)
+// A Bloom filter whose probes touch a single 64-byte block (one cache line).
+// Each key sets one bit in each of the eight 64-bit words of its block.
+class BlockedBloomFilter
 {
-    static struct option long_options[] = {
-        {"read", no_argument , 0, 'r'},
-        {0, 0, 0, 0} // end of long options
-    };
+    static const size_t WORDS_PER_BLOCK = 8;
+    uint64_t* blocks;
+    size_t numberOfBlocks;
+
+    BlockedBloomFilter(const BlockedBloomFilter&);
+    BlockedBloomFilter& operator=(const BlockedBloomFilter&);
+
+    const uint64_t* blockOf(uint64_t h) const {
+        return blocks + (((h >> 32) * numberOfBlocks) >> 32) * WORDS_PER_BLOCK;
+    }
+    static uint64_t bitInWord(uint64_t h, size_t i) {
+        static const uint64_t salts[WORDS_PER_BLOCK] = {
+            0x47b6137b44974d91ull, 0x8824ad5ba2b7289dull, 0x705495c72df1424bull, 0x9efc49475c6bfb31ull,
+            0x2ca6e5d5c1bf6f71ull, 0x5e27b45a1a1a9a5bull, 0xd6f1cc4bdf1ab6e5ull, 0xa3b0f1f5e1d6c7b9ull
+        };
+        const uint64_t g = (h ^ (h >> 29)) * 0xBF58476D1CE4E5B9ull;
+        return 1ull << ((g * salts[i]) >> 58);
+    }
+
+public:
+    BlockedBloomFilter(size_t size_in_bytes) {
+        numberOfBlocks = std::max<size_t>(1u, std::min<size_t>(size_in_bytes / (WORDS_PER_BLOCK * sizeof(uint64_t)), 0xFFFFFFFFu));
+        void* p = NULL;
+        if(posix_memalign(&p, 64, numberOfBlocks * WORDS_PER_BLOCK * sizeof(uint64_t)) != 0) throw std::bad_alloc();
+        blocks = static_cast<uint64_t*>(p);
+        memset(blocks, 0, numberOfBlocks * WORDS_PER_BLOCK * sizeof(uint64_t));
+    }
+    ~BlockedBloomFilter() { free(blocks); }
+    size_t sizeInBytes() const { return numberOfBlocks * WORDS_PER_BLOCK * sizeof(uint64_t); }
+    void add(uint64_t h) {
+        uint64_t* block = const_cast<uint64_t*>(blockOf(h));
+        for(size_t i = 0; i < WORDS_PER_BLOCK; ++i) block[i] |= bitInWord(h, i);
+    }
+    bool mayContain(uint64_t h) const {
+        const uint64_t* block = blockOf(h);
+        uint64_t missing = 0;
+        for(size_t i = 0; i < WORDS_PER_BLOCK; ++i) missing |= bitInWord(h, i) & ~block[i];
+        return missing == 0;
+    }
+};
+
+// A set of read names for extract. Names are interned into an arena of
+// large blocks (NUL-terminated, so they can be passed to SQLite as they are)
+// and looked up in an open-addressing table with linear probing.
+// Lookups take a pointer and a length, so a header line can be probed
+// without building a string.
+class ReadNameSet
+{
+    struct Slot {
+        const char* name; // NULL if empty
+        uint32_t length;
+        uint32_t hashTag;
+    };
+    static const size_t ARENA_BLOCK_SIZE = 4 * 1024u * 1024u;
+    vector<char*> arenaBlocks;
+    size_t arenaBlockOffset;
+    size_t arenaBlockSize;
+    vector<Slot> slots;
+    size_t mask;
+    size_t numberOfNames;
+    // Optional prefilter that answers most negative lookups from one cache line.
+    BlockedBloomFilter* prefilter;
+    mutable size_t prefilterProbes;
+    mutable size_t prefilterRejections;
+    mutable size_t prefilterFalsePositives;
+
+    ReadNameSet(const ReadNameSet&);
+    ReadNameSet& operator=(const ReadNameSet&);
+
+    const char* intern(const char* p, size_t length) {
+        if(arenaBlocks.empty() || arenaBlockSize < arenaBlockOffset + length + 1u) {
+            arenaBlockSize = std::max(ARENA_BLOCK_SIZE, length + 1u);
+            arenaBlocks.push_back(new char[arenaBlockSize]);
+            arenaBlockOffset = 0;
+        }
+        char* dest = arenaBlocks.back() + arenaBlockOffset;
+        memcpy(dest, p, length);
+        dest[length] = '\0';
+        arenaBlockOffset += length + 1u;
+        return dest;
+    }
+    // Returns the slot of the name, or the empty slot where it would go.
+    size_t findSlot(const char* p, size_t length, uint64_t h) const {
+        const uint32_t tag = static_cast<uint32_t>(h >> 32);
+        size_t i = h & mask;
+        while(true) {
+            const Slot& slot = slots[i];
+            if(slot.name == NULL) return i;
+            if(slot.hashTag == tag && slot.length == length && memcmp(slot.name, p, length) == 0) return i;
+            i = (i + 1u) & mask;
+        }
+    }
+    void rehash(size_t new_capacity) {
+        vector<Slot> old_slots(new_capacity);
+        old_slots.swap(slots);
+        mask = new_capacity - 1u;
+        for(size_t i = 0; i < old_slots.size(); ++i) {
+            const Slot& slot = old_slots[i];
+            if(slot.name == NULL) continue;
+            const uint64_t h = hash_bytes(slot.name, slot.length);
+            slots[findSlot(slot.name, slot.length, h)] = slot;
+        }
+    }
+
+public:
+    ReadNameSet() : arenaBlockOffset(0), arenaBlockSize(0), mask(0), numberOfNames(0),
+                    prefilter(NULL), prefilterProbes(0), prefilterRejections(0), prefilterFalsePositives(0) {
+        rehash(1024u);
+    }
+    ~ReadNameSet() {
+        for(size_t i = 0; i < arenaBlocks.size(); ++i) delete[] arenaBlocks[i];
+        delete prefilter;
+    }
+    void enablePrefilter(size_t size_in_bytes) {
+        delete prefilter;
+        prefilter = new BlockedBloomFilter(size_in_bytes);
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(slots[i].name != NULL) prefilter->add(hash_bytes(slots[i].name, slots[i].length));
+        }
+    }
+    void reportPrefilterStatistics(ostream& os) const {
+        if(prefilter == NULL) return;
+        const size_t negatives = prefilterRejections + prefilterFalsePositives;
+        os << "Bloom filter: " << sep_comma(prefilter->sizeInBytes()) << " bytes for " << sep_comma(numberOfNames) << " names, ";
+        os << sep_comma(prefilterProbes) << " lookups, " << sep_comma(prefilterRejections) << " rejected by the filter, ";
+        os << sep_comma(prefilterFalsePositives) << " false positives";
+        if(0 < negatives) os << " (false positive rate " << (100.0 * prefilterFalsePositives / negatives) << "%)";
+        os << "\n";
+    }
+    size_t size() const { return numberOfNames; }
+    bool empty() const { return numberOfNames == 0; }
+    size_t memoryUsage() const { return slots.size() * sizeof(Slot) + arenaBlocks.size() * ARENA_BLOCK_SIZE; }
+    // Returns true if the name was not in the set.
+    bool insert(const char* p, size_t length) {
+        // Keep the load factor at or below 1/2.
+        if(slots.size() <= (numberOfNames + 1u) * 2u) rehash(slots.size() * 2u);
+        const uint64_t h = hash_bytes(p, length);
+        Slot& slot = slots[findSlot(p, length, h)];
+        if(slot.name != NULL) return false;
+        slot.name = intern(p, length);
+        slot.length = static_cast<uint32_t>(length);
+        slot.hashTag = static_cast<uint32_t>(h >> 32);
+        numberOfNames++;
+        if(prefilter != NULL) prefilter->add(h);
+        return true;
+    }
+    bool insert(const string& name) { return insert(name.data(), name.size()); }
+    bool contains(const char* p, size_t length) const {
+        const uint64_t h = hash_bytes(p, length);
+        if(prefilter == NULL) return slots[findSlot(p, length, h)].name != NULL;
+        prefilterProbes++;
+        if(!prefilter->mayContain(h)) {
+            prefilterRejections++;
+            return false;
+        }
+        const bool found = slots[findSlot(p, length, h)].name != NULL;
+        if(!found) prefilterFalsePositives++;
+        return found;
+    }
+    bool containsNameInHeader(const char* header) const {
+        size_t length;
+        const char* p = find_read_name_in_header(header, length);
+        return contains(p, length);
+    }
+    bool insertNameInHeader(const char* header) {
+        size_t length;
+        const char* p = find_read_name_in_header(header, length);
+        return insert(p, length);
+    }
+    // Returns the names in the order of std::set<string>.
+    void getSortedNames(vector<const char*>& names) const {
+        names.clear();
+        names.reserve(numberOfNames);
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(slots[i].name != NULL) names.push_back(slots[i].name);
+        }
+        sort(names.begin(), names.end(), compareNames);
+    }
+
+private:
+    static bool compareNames(const char* a, const char* b) {
+        return strcmp(a, b) < 0;
+    }
+};
+
+// Adds each line in the file to names. Regular files are read through mmap.
+static bool load_read_names_from_file(const char* file_name, ReadNameSet& names)
+{
+    const int fd = open(file_name, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat s;
+    const bool is_mappable = fstat(fd, &s) == 0 && S_ISREG(s.st_mode) && 0 < s.st_size;
+    if(!is_mappable) {
+        close(fd);
+        ifstream ist(file_name);
+        if(!ist) return false;
+        string line;
+        while(getline(ist, line)) names.insert(line);
+        return true;
+    }
+    const size_t size = s.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char* data = static_cast<const char*>(mapped);
+    size_t pos = 0;
+    while(pos < size) {
+        const size_t eol = find_end_of_line(data, size, pos);
+        names.insert(data + pos, eol - pos);
+        pos = eol + 1u;
+    }
+    munmap(mapped, size);
+    return true;
+}
+
+// A set of read-name fingerprints (64 or 128-bit hashes) for 'extract --unique'.
+// It takes 8 or 16 bytes per slot instead of the names themselves, so it needs
+// far less memory than ReadNameSet on inputs with billions of reads. Two
+// different names with the same fingerprint would be taken as duplicates;
+// with verification, each slot also keeps where the name was seen first, and
+// a fingerprint match is confirmed by reading that header back from the file.
+class ReadNameFingerprintSet
+{
+    static const size_t MAX_FILES = 1u << 16;
+    static const uint64_t OFFSET_MASK = (1ull << 48) - 1u;
+    size_t fingerprintWords;
+    size_t wordsPerSlot;
+    bool verify;
+    vector<uint64_t> table;
+    size_t capacity;
+    size_t numberOfNames;
+    size_t numberOfCollisions;
+    vector<int> fds; // for verification; indexed by the file number in the location word
+    string nameBuffer;
+
+    ReadNameFingerprintSet(const ReadNameFingerprintSet&);
+    ReadNameFingerprintSet& operator=(const ReadNameFingerprintSet&);
+
+    // The slot is chosen by the upper bits of the first word, so the table
+    // need not be a power of two and can grow by 1.5x.
+    size_t homeSlot(uint64_t h) const {
+        return static_cast<size_t>((static_cast<unsigned __int128>(h) * capacity) >> 64);
+    }
+    bool isEmpty(const uint64_t* slot) const { return slot[0] == 0; }
+    bool sameFingerprint(const uint64_t* slot, const uint64_t* fp) const {
+        for(size_t i = 0; i < fingerprintWords; ++i) if(slot[i] != fp[i]) return false;
+        return true;
+    }
+    void rehash(size_t new_capacity) {
+        vector<uint64_t> old_table(new_capacity * wordsPerSlot, 0u);
+        old_table.swap(table);
+        capacity = new_capacity;
+        for(size_t i = 0; i < old_table.size(); i += wordsPerSlot) {
+            if(old_table[i] == 0) continue;
+            size_t j = homeSlot(old_table[i]);
+            while(!isEmpty(&table[j * wordsPerSlot])) if(++j == capacity) j = 0;
+            copy(old_table.begin() + i, old_table.begin() + i + wordsPerSlot, table.begin() + j * wordsPerSlot);
+        }
+    }
+    // Reads the name in the header line at the location back into nameBuffer.
+    bool readNameAt(uint64_t location) {
+        const size_t file_number = location >> 48;
+        off_t offset = location & OFFSET_MASK;
+        if(fds.size() <= file_number || fds[file_number] < 0) {
+            errno = EBADF;
+            return false;
+        }
+        nameBuffer.clear();
+        char buf[256];
+        bool is_first_char = true;
+        while(true) {
+            const ssize_t n = pread(fds[file_number], buf, sizeof(buf), offset);
+            if(n <= 0) return n == 0;
+            for(ssize_t i = 0; i < n; ++i) {
+                if(is_first_char) {
+                    is_first_char = false; // '>' or '@'
+                    continue;
+                }
+                if(buf[i] == ' ' || buf[i] == '\n' || buf[i] == '\0') return true;
+                nameBuffer += buf[i];
+            }
+            offset += n;
+        }
+    }
+
+public:
+    ReadNameFingerprintSet(size_t bits, bool verify)
+        : fingerprintWords(bits / 64u), wordsPerSlot(bits / 64u + (verify ? 1u : 0u)), verify(verify),
+          capacity(0), numberOfNames(0), numberOfCollisions(0) {
+        rehash(1024u);
+    }
+    ~ReadNameFingerprintSet() {
+        for(size_t i = 0; i < fds.size(); ++i) if(0 <= fds[i]) ::close(fds[i]);
+    }
+    static void computeFingerprint(const char* p, size_t length, size_t words, uint64_t* fp) {
+        fp[0] = hash_bytes(p, length);
+        if(fp[0] == 0) fp[0] = 1; // 0 marks an empty slot
+        if(1 < words) fp[1] = hash_bytes(p, length, 0x243F6A8885A308D3ull);
+    }
+    size_t getFingerprintWords() const { return fingerprintWords; }
+    size_t size() const { return numberOfNames; }
+    size_t collisions() const { return numberOfCollisions; }
+    size_t memoryUsage() const { return table.size() * sizeof(uint64_t); }
+    // Bytes per name that the table takes on average at its load factor.
+    static double bytesPerName(size_t bits, bool verify) {
+        return (bits / 64u + (verify ? 1u : 0u)) * sizeof(uint64_t) / 0.65;
+    }
+    // Must be called before the names in the file are inserted with verification.
+    bool beginFile(const char* file_name) {
+        if(!verify) return true;
+        if(MAX_FILES <= fds.size()) return false;
+        const int fd = ::open(file_name, O_RDONLY);
+        fds.push_back(fd);
+        return 0 <= fd;
+    }
+    // Returns true if the fingerprint was not in the set. The name and the
+    // offset of its header line are used only with verification.
+    bool insert(const uint64_t* fp, const char* name, size_t length, off_t offset) {
+        // Keep the load factor at or below 0.8, and grow by 1.5x.
+        if(capacity * 4u <= (numberOfNames + 1u) * 5u) rehash(capacity + capacity / 2u);
+        size_t i = homeSlot(fp[0]);
+        while(true) {
+            uint64_t* slot = &table[i * wordsPerSlot];
+            if(isEmpty(slot)) {
+                copy(fp, fp + fingerprintWords, slot);
+                if(verify) slot[fingerprintWords] = (static_cast<uint64_t>(fds.size() - 1u) << 48) | (static_cast<uint64_t>(offset) & OFFSET_MASK);
+                numberOfNames++;
+                return true;
+            }
+            if(sameFingerprint(slot, fp)) {
+                if(!verify) return false;
+                // Taking an unreadable name as the same one would drop the read unverified.
+                if(!readNameAt(slot[fingerprintWords])) {
+                    cerr << "ERROR: cannot read back a read name to verify it. " << strerror(errno) << endl;
+                    exit(1);
+                }
+                if(nameBuffer.size() == length && memcmp(nameBuffer.data(), name, length) == 0) return false;
+                // Two different names with the same fingerprint; keep probing.
+                numberOfCollisions++;
+            }
+            if(++i == capacity) i = 0;
+        }
+    }
+};
+
+// Removes a temporary file as soon as it is created, so that it disappears
+// however the program exits.
+static FILE* create_anonymous_temporary_file(const string& directory)
+{
+    string path = directory + "/fatt.XXXXXX";
+    vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    const int fd = mkstemp(&name[0]);
+    if(fd < 0) return NULL;
+    unlink(&name[0]);
+    return fdopen(fd, "w+b");
+}
+
+static string get_temporary_directory()
+{
+    const char* tmpdir = getenv("TMPDIR");
+    return tmpdir != NULL && *tmpdir != '\0' ? tmpdir : "/tmp";
+}
+
+// Copies the records in the files to stdout except those whose read numbers
+// (0-origin, counted over all the files) are in the lists. Each list is a
+// temporary file of uint64_t in increasing order; the lists are merged.
+static bool copy_records_skipping_read_numbers(const vector<const char*>& file_names, const vector<FILE*>& sorted_lists, uint64_t& number_of_reads)
+{
+    typedef pair<uint64_t, size_t> ReadNumberAndList;
+    priority_queue<ReadNumberAndList, vector<ReadNumberAndList>, greater<ReadNumberAndList> > next_read_numbers;
+    for(size_t i = 0; i < sorted_lists.size(); ++i) {
+        uint64_t n;
+        if(fflush(sorted_lists[i]) != 0 || fseek(sorted_lists[i], 0, SEEK_SET) != 0) return false;
+        if(fread(&n, sizeof(n), 1u, sorted_lists[i]) == 1u) next_read_numbers.push(make_pair(n, i));
+    }
+    uint64_t read_number = 0;
+    FastxRecord r;
+    for(size_t i = 0; i < file_names.size(); ++i) {
+        FileLineBufferWithAutoExpansion f;
+        if(!f.open(file_names[i])) {
+            cerr << "Cannot open '" << file_names[i] << "'" << endl;
+            continue;
+        }
+        FastxRecordReader reader(f);
+        while(reader.next(r)) {
+            if(!next_read_numbers.empty() && next_read_numbers.top().first == read_number) {
+                const size_t list = next_read_numbers.top().second;
+                next_read_numbers.pop();
+                uint64_t n;
+                if(fread(&n, sizeof(n), 1u, sorted_lists[list]) == 1u) next_read_numbers.push(make_pair(n, list));
+            } else {
+                cout << r.text;
+            }
+            read_number++;
+        }
+    }
+    number_of_reads = read_number;
+    return true;
+}
+
+// 'extract --unique' on read-name fingerprints. Reads that have the same
+// name as an earlier read (in any of the files) are removed.
+// With a memory budget too small for the whole table, the fingerprints are
+// spilled to disk in partitions first: pass 1 writes (fingerprint, read number)
+// to the partition chosen by the fingerprint, pass 2 finds the duplicates in
+// each partition in turn, and pass 3 copies the input skipping them.
+static bool extract_unique_by_fingerprint(const vector<const char*>& file_names, size_t bits, bool verify, long long memory_budget_mib, const string& temporary_directory)
+{
+    const size_t words = bits / 64u;
+    size_t number_of_partitions = 1;
+    if(0 < memory_budget_mib) {
+        // Assume at least 32 bytes per read, which is on the safe side for FASTQ.
+        unsigned long long total_size = 0;
+        for(size_t i = 0; i < file_names.size(); ++i) {
+            struct stat s;
+            if(stat(file_names[i], &s) == 0) total_size += s.st_size;
+        }
+        const double estimated_bytes = total_size / 32.0 * (ReadNameFingerprintSet::bytesPerName(bits, false) + (words + 1u) * sizeof(uint64_t));
+        const double budget = memory_budget_mib * 1024.0 * 1024.0;
+        if(budget < estimated_bytes) {
+            number_of_partitions = std::min<size_t>(256u, static_cast<size_t>(ceil(estimated_bytes / budget)));
+        }
+    }
+    if(number_of_partitions == 1) {
+        ReadNameFingerprintSet fingerprints(bits, verify);
+        FastxRecord r;
+        uint64_t fp[2];
+        for(size_t i = 0; i < file_names.size(); ++i) {
+            FileLineBufferWithAutoExpansion f;
+            if(!f.open(file_names[i])) {
+                cerr << "Cannot open '" << file_names[i] << "'" << endl;
+                continue;
+            }
+            if(!fingerprints.beginFile(file_names[i])) {
+                cerr << "ERROR: cannot verify fingerprints in '" << file_names[i] << "'" << endl;
+                return false;
+            }
+            FastxRecordReader reader(f);
+            while(reader.next(r)) {
+                size_t length;
+                const char* name = r.name(length);
+                ReadNameFingerprintSet::computeFingerprint(name, length, words, fp);
+                if(fingerprints.insert(fp, name, length, r.offset)) cout << r.text;
+            }
+        }
+        cerr << sep_comma(fingerprints.size()) << " unique names in " << sep_comma(fingerprints.memoryUsage()) << " bytes";
+        if(verify) cerr << ", " << sep_comma(fingerprints.collisions()) << " fingerprint collisions resolved";
+        cerr << "\n";
+        return true;
+    }
+    if(verify) {
+        cerr << "ERROR: verification is not available when fingerprints are spilled to disk. Use 128-bit fingerprints instead." << endl;
+        return false;
+    }
+    vector<FILE*> partitions;
+    vector<FILE*> duplicates;
+    bool succeeded = true;
+    for(size_t i = 0; i < number_of_partitions && succeeded; ++i) {
+        partitions.push_back(create_anonymous_temporary_file(temporary_directory));
+        duplicates.push_back(create_anonymous_temporary_file(temporary_directory));
+        if(partitions.back() == NULL || duplicates.back() == NULL) {
+            cerr << "ERROR: cannot create a temporary file in '" << temporary_directory << "'" << endl;
+            succeeded = false;
+        }
+    }
+    // Pass 1: spill (fingerprint, read number).
+    uint64_t read_number = 0;
+    FastxRecord r;
+    for(size_t i = 0; i < file_names.size() && succeeded; ++i) {
+        FileLineBufferWithAutoExpansion f;
+        if(!f.open(file_names[i])) continue;
+        FastxRecordReader reader(f);
+        while(reader.next(r)) {
+            size_t length;
+            const char* name = r.name(length);
+            uint64_t entry[3];
+            ReadNameFingerprintSet::computeFingerprint(name, length, words, entry);
+            entry[words] = read_number++;
+            // The table uses the upper bits of the fingerprint, so partition by the lower bits.
+            const size_t partition = ((entry[0] & 0xFFFFFFFFu) * number_of_partitions) >> 32;
+            if(fwrite(entry, sizeof(uint64_t), words + 1u, partitions[partition]) != words + 1u) {
+                cerr << "ERROR: cannot write to a temporary file in '" << temporary_directory << "'" << endl;
+                succeeded = false;
+                break;
+            }
+        }
+    }
+    // Pass 2: the read numbers in a partition are in increasing order, so are
+    // the read numbers of the duplicates written for it.
+    size_t number_of_duplicates = 0;
+    size_t max_memory_usage = 0;
+    for(size_t i = 0; i < number_of_partitions && succeeded; ++i) {
+        FILE* fp = partitions[i];
+        if(fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) != 0) {
+            succeeded = false;
+            break;
+        }
+        ReadNameFingerprintSet fingerprints(bits, false);
+        uint64_t entry[3];
+        while(fread(entry, sizeof(uint64_t), words + 1u, fp) == words + 1u) {
+            if(fingerprints.insert(entry, NULL, 0, 0)) continue;
+            number_of_duplicates++;
+            if(fwrite(&entry[words], sizeof(uint64_t), 1u, duplicates[i]) != 1u) {
+                cerr << "ERROR: cannot write to a temporary file in '" << temporary_directory << "'" << endl;
+                succeeded = false;
+                break;
+            }
+        }
+        max_memory_usage = std::max(max_memory_usage, fingerprints.memoryUsage());
+        fclose(fp);
+        partitions[i] = NULL;
+    }
+    // Pass 3: merge the sorted lists of duplicates and copy the rest.
+    if(succeeded) {
+        succeeded = copy_records_skipping_read_numbers(file_names, duplicates, read_number);
+        cerr << sep_comma(read_number - number_of_duplicates) << " unique names; fingerprints were spilled into ";
+        cerr << number_of_partitions << " partitions of at most " << sep_comma(max_memory_usage) << " bytes in memory\n";
+    }
+    for(size_t i = 0; i < number_of_partitions; ++i) {
+        if(i < partitions.size() && partitions[i] != NULL) fclose(partitions[i]);
+        if(i < duplicates.size() && duplicates[i] != NULL) fclose(duplicates[i]);
+    }
+    return succeeded;
+}
+
+// Compares names in byte order, which is the order of 'LC_ALL=C sort'.
+static int compare_names(const char* a, size_t a_length, const char* b, size_t b_length)
+{
+    const int c = memcmp(a, b, std::min(a_length, b_length));
+    if(c != 0) return c;
+    return a_length < b_length ? -1 : (a_length == b_length ? 0 : 1);
+}
+
+// 'extract --sorted': when both the name list and the reads (the files taken
+// as one stream) are sorted by name, they are walked in lockstep like a merge
+// join, so neither of them is held in memory. It stops with an error as soon
+// as either of them turns out not to be sorted.
+static bool extract_by_sorted_name_list(istream& names, const string& names_source, const vector<const char*>& file_names, bool reverse)
+{
+    string name;
+    bool has_name = static_cast<bool>(getline(names, name));
+    size_t name_line = 1;
+    string previous_name;
+    string previous_read_name;
+    size_t read_number = 0;
+    FastxRecord r;
+    for(size_t i = 0; i < file_names.size(); ++i) {
+        FileLineBufferWithAutoExpansion f;
+        if(!f.open(file_names[i])) {
+            cerr << "Cannot open '" << file_names[i] << "'" << endl;
+            continue;
+        }
+        FastxRecordReader reader(f);
+        while(reader.next(r)) {
+            read_number++;
+            size_t length;
+            const char* read_name = r.name(length);
+            if(1 < read_number && compare_names(read_name, length, previous_read_name.data(), previous_read_name.size()) < 0) {
+                cerr << "ERROR: the reads are not sorted by name. '" << string(read_name, length) << "' (read " << read_number << " in " << file_names[i];
+                cerr << ") comes after '" << previous_read_name << "'. Sort them with 'LC_ALL=C sort' order." << endl;
+                return false;
+            }
+            previous_read_name.assign(read_name, length);
+            while(has_name && compare_names(name.data(), name.size(), read_name, length) < 0) {
+                previous_name.swap(name);
+                has_name = static_cast<bool>(getline(names, name));
+                if(!has_name) break;
+                name_line++;
+                if(name < previous_name) {
+                    cerr << "ERROR: the name list is not sorted. '" << name << "' (line " << name_line << " in " << names_source;
+                    cerr << ") comes after '" << previous_name << "'. Sort it with 'LC_ALL=C sort'." << endl;
+                    return false;
+                }
+            }
+            const bool is_listed = has_name && compare_names(name.data(), name.size(), read_name, length) == 0;
+            if(is_listed ^ reverse) cout << r.text;
+        }
+    }
+    return true;
+}
+
+// The name of a pair: the read name without a trailing "/1" or "/2".
+static size_t get_pair_name_length(const char* name, size_t length)
+{
+    if(2 <= length && name[length - 2] == '/' && (name[length - 1] == '1' || name[length - 1] == '2')) return length - 2;
+    return length;
+}
+
+// 'extract --paired' and 'extract --interleaved': reads both mates in lockstep
+// and decides once per pair, so that the outputs stay paired. A pair is
+// listed if the name of either mate, or the pair name, is in names.
+// With file_name2 == NULL, the mates are consecutive records of file_name1.
+// Both mates go to out1 if out2 is NULL.
+static bool extract_pairs(const char* file_name1, const char* file_name2, ReadNameSet& names, bool reverse, bool unique,
+                          long long start, long long end, ostream& out1, ostream* out2)
+{
+    ReadAheadRecordReader reader1;
+    ReadAheadRecordReader reader2;
+    if(!reader1.open(file_name1)) {
+        cerr << "Cannot open '" << file_name1 << "'" << endl;
+        return false;
+    }
+    if(file_name2 != NULL && !reader2.open(file_name2)) {
+        cerr << "Cannot open '" << file_name2 << "'" << endl;
+        return false;
+    }
+    ReadAheadRecordReader& mate_reader = file_name2 == NULL ? reader1 : reader2;
+    long long pair_index = 0;
+    FastxRecord first_mate;
+    while(true) {
+        const FastxRecord* r1 = reader1.next();
+        if(r1 == NULL) {
+            if(file_name2 != NULL && reader2.next() != NULL) {
+                cerr << "ERROR: " << file_name2 << " has more reads than " << file_name1 << endl;
+                return false;
+            }
+            break;
+        }
+        if(file_name2 == NULL) {
+            // The next record overwrites r1 if it is in another batch.
+            first_mate = *r1;
+            r1 = &first_mate;
+        }
+        const FastxRecord* r2 = mate_reader.next();
+        if(r2 == NULL) {
+            if(file_name2 == NULL) cerr << "ERROR: " << file_name1 << " has an odd number of reads" << endl;
+            else cerr << "ERROR: " << file_name1 << " has more reads than " << file_name2 << endl;
+            return false;
+        }
+        size_t length1, length2;
+        const char* name1 = r1->name(length1);
+        const char* name2 = r2->name(length2);
+        const size_t pair_name_length = get_pair_name_length(name1, length1);
+        if(pair_name_length != get_pair_name_length(name2, length2) || memcmp(name1, name2, pair_name_length) != 0) {
+            cerr << "ERROR: the mates are out of sync at pair " << pair_index << " ('" << string(name1, length1) << "' and '" << string(name2, length2) << "')" << endl;
+            return false;
+        }
+        bool taken;
+        if(start == -1) {
+            taken = (names.contains(name1, length1) || names.contains(name2, length2) || names.contains(name1, pair_name_length)) ^ reverse;
+            if(unique) names.insert(name1, pair_name_length);
+        } else {
+            taken = start <= pair_index && (end < 0 || pair_index < end);
+        }
+        if(taken) {
+            out1 << r1->text;
+            (out2 == NULL ? out1 : *out2) << r2->text;
+        }
+        pair_index++;
+    }
+    return true;
+}
+
+static void add_read_name_and_show_error_if_duplicates(map<string, int>& readName2fileIndex, char** argv, char* headerLine, int fileIndex, bool doNotShowFileName)
+{
+	if(*headerLine++ == '\0') return;
+    char* start = headerLine;
+    char* end = start;
+    while(*end != '\0' && *end != ' ') ++end;
+    const char saved_char = *end; *end = '\0';
+    string readName = start;
+    const map<string, int>::const_iterator cit = readName2fileIndex.find(readName);
+    if(cit == readName2fileIndex.end()) {
+        readName2fileIndex[readName] = fileIndex;
+    } else {
+        cerr << start;
+        if(!doNotShowFileName)
+            cerr << '\t' << argv[cit->second];
+        cerr << '\n';
+    }
+    *end = saved_char;
+}
+
+void do_check_same_names(int argc, char** argv)
+{
+    static struct option long_options[] = {
+        {"read", no_argument , 0, 'r'},
+        {0, 0, 0, 0} // end of long options
+    };
     bool flag_do_not_show_file_name = false;
     while(true) {
 		int option_index = 0;
@@ -642,8 +2232,10 @@ void create_index(const char* fname, bool flag_force)
     try {
 		DeleteOnFailure dof(index_file_name);
     	sqdb::Db db(index_file_name.c_str());
-    	db.MakeItFasterAndDangerous();
-    	db.Do("create table seqpos(name text primary key, pos integer, readindex integer)");
+    	db.UseBuildProfile();
+    	// The primary key is the only index on names we need, so the table is
+    	// clustered on it instead of keeping a separate rowid B-tree.
+    	db.Do("create table seqpos(name text primary key, pos integer, readindex integer) without rowid");
     	db.Do("begin");
     	cerr << "." << flush;
         sqdb::Statement stmt = db.Query("insert into seqpos values(?, ?, ?)");
@@ -699,8 +2291,6 @@ void create_index(const char* fname, bool flag_force)
         }
     	db.Do("end");
     	cerr << "." << flush;
-    	db.Do("create index seqpos_name_index on seqpos(name);");
-    	cerr << "." << flush;
     	db.Do("create index read_index_index on seqpos(readindex);");
     	cerr << endl;
 		dof.doNotDelete();
@@ -711,10 +2301,59 @@ void create_index(const char* fname, bool flag_force)
 	}
 }
 
+bool emit_partial_statistics(const vector<const char*>& files, const string& file_name);
+void output_grouped_statistics(const vector<const char*>& file_names, const string& group_by, int threads, bool flag_json, int qv_base);
+
 void do_count(int argc, char** argv)
 {
+    string param_emit_partial;
+    string param_group_by;
+    bool flag_json = false;
+    int param_threads = 1;
+    int param_qv_base = 33;
+    static struct option long_options[] = {
+        {"emit-partial", required_argument, 0, 'E'},
+        {"group-by", required_argument, 0, 'G'},
+        {"json", no_argument, 0, 'j'},
+        {"threads", required_argument, 0, 't'},
+        {"qvbase", required_argument, 0, 'q'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'E':
+			param_emit_partial = optarg;
+			break;
+		case 'G':
+			param_group_by = optarg;
+			break;
+		case 'j':
+			flag_json = true;
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		case 'q':
+			param_qv_base = atoi(optarg);
+			break;
+		}
+	}
+    if(!param_emit_partial.empty()) {
+        emit_partial_statistics(vector<const char*>(argv + optind + 1, argv + argc), param_emit_partial);
+        return;
+    }
+    if(!param_group_by.empty()) {
+        output_grouped_statistics(vector<const char*>(argv + optind + 1, argv + argc), param_group_by, param_threads, flag_json, param_qv_base);
+        return;
+    }
 	cout << "FILE\tNUM_READS\tNUM_NUCLS\tAVG_READ_LEN\tMIN_READ_LEN\tMAX_READ_LEN\n";
-	for(int i = 2; i < argc; ++i) {
+	for(int i = optind + 1; i < argc; ++i) {
 		count_number_of_reads_in_file(argv[i]);
 	}
 }
@@ -751,10 +2390,9 @@ void do_len(int argc, char** argv)
 	}
 }
 
-void print_n50(vector<size_t>& lengths, const bool flag_html, const bool flag_json, const char * contig_or_scaff = "scaffold")
+void print_n50(const LengthHistogram& lengths, const bool flag_html, const bool flag_json, const char * contig_or_scaff = "scaffold")
 {
-    sort(lengths.rbegin(), lengths.rend());
-    const size_t total_length = accumulate(lengths.begin(), lengths.end(), 0ull);
+    const size_t total_length = lengths.total();
     size_t n50_sequence_index = 0;
     size_t n50_length = 0;
     size_t n70_sequence_index = 0;
@@ -767,27 +2405,20 @@ void print_n50(vector<size_t>& lengths, const bool flag_html, const bool flag_js
     size_t min_length = 0;
     size_t avg_length = 0;
     if(total_length > 0){
-        size_t sequence_index;
-        size_t sum = 0;
-        const size_t n50_total_length = (size_t)((total_length + 1ull) * 0.5);
-        for(sequence_index = 0; sum < n50_total_length && sequence_index < lengths.size(); sequence_index++) sum += lengths[sequence_index];
-        n50_length = lengths[sequence_index - 1];
-        n50_sequence_index = sequence_index;
-        const size_t n70_total_length = (size_t)((total_length + 1ull) * 0.7); 
-        for(; sum < n70_total_length && sequence_index < lengths.size(); sequence_index++) sum += lengths[sequence_index];
-        n70_length = lengths[sequence_index - 1];
-        n70_sequence_index = sequence_index;
-        const size_t n80_total_length = (size_t)((total_length + 1ull) * 0.8); 
-        for(; sum < n80_total_length && sequence_index < lengths.size(); sequence_index++) sum += lengths[sequence_index];
-        n80_length = lengths[sequence_index - 1];
-        n80_sequence_index = sequence_index;
-        const size_t n90_total_length = (size_t)((total_length + 1ull) * 0.9);
-        for(; sum < n90_total_length && sequence_index < lengths.size(); sequence_index++) sum += lengths[sequence_index];
-        n90_length = lengths[sequence_index - 1];
-        n90_sequence_index = sequence_index;
-
-        min_length = lengths.back();
-        max_length = lengths.front();
+        const double fractions[] = {0.5, 0.7, 0.8, 0.9};
+        size_t nx_lengths[4];
+        uint64_t nx_sequence_indices[4];
+        lengths.getNx(fractions, 4, nx_lengths, nx_sequence_indices);
+        n50_length = nx_lengths[0];
+        n50_sequence_index = nx_sequence_indices[0];
+        n70_length = nx_lengths[1];
+        n70_sequence_index = nx_sequence_indices[1];
+        n80_length = nx_lengths[2];
+        n80_sequence_index = nx_sequence_indices[2];
+        n90_length = nx_lengths[3];
+        n90_sequence_index = nx_sequence_indices[3];
+        min_length = lengths.minLength();
+        max_length = lengths.maxLength();
         avg_length = (total_length + lengths.size() / 2) / lengths.size();
     }
     if(flag_html) {
@@ -825,65 +2456,148 @@ void print_n50(vector<size_t>& lengths, const bool flag_html, const bool flag_js
     }
 }
 
-void do_stat(int argc, char** argv)
+// A summary of sequence files that stat --emit-partial (or count --emit-partial) writes,
+// and merge-stats adds up, so that files on different machines can be reported together.
+// It is "FATTSTA1" followed by unsigned LEB128 numbers: for each of the three length
+// histograms, the number of distinct lengths and then (length, count) pairs in ascending
+// order of length, the length coded as the difference from the previous one;
+// then the G/C count and the counts of the 256 QV characters.
+struct PartialStatistics
 {
-    bool flag_html = false;
-    bool flag_json = false;
-    bool flag_contig = false;
-    bool flag_scaffold = false;
-    bool flag_all = true;
-    static struct option long_options[] = {
-        {"html", no_argument, 0, 'h'},
-        {"json", no_argument, 0, 'j'},
-        {"contig", no_argument, 0, 'c'},
-        {"scaffold", no_argument, 0, 's'},
-        {0, 0, 0, 0} // end of long options
-    };
-    while(true) {
-    	int option_index = 0;
-    	int c = getopt_long(argc, argv, "", long_options, &option_index);
-    	if(c == -1) break;
-    	switch(c) {
-            case 0:
-           // you can see long_options[option_index].name/flag and optarg (null if no argument).
-                break;
-            case 'h':
-                flag_html = true;
-                break;
-            case 'j':
-                flag_json = true;
-                break;
-            case 'c':
-                flag_contig = true;
-                flag_all = false;
-                break;
-            case 's':
-                flag_scaffold = true;
-                flag_all = false;
-                break;
+    LengthHistogram scaffoldsWithGap;
+    LengthHistogram scaffoldsWithoutGap;
+    LengthHistogram contigs;
+    BaseComposition composition;
+
+    static void writeNumber(string& buffer, uint64_t value) {
+        while(0x80 <= value) {
+            buffer += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
         }
+        buffer += static_cast<char>(value);
+    }
+    static bool readNumber(istream& is, uint64_t& value) {
+        value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            const int c = is.get();
+            if(c == EOF) return false;
+            value |= static_cast<uint64_t>(c & 0x7f) << shift;
+            if((c & 0x80) == 0) return true;
+        }
+        return false;
     }
-    if(flag_html && flag_json) {
-        cerr << "ERROR: You can use either --html or --json\n";
-        return;
+    static void writeHistogram(string& buffer, const LengthHistogram& histogram) {
+        vector<LengthHistogram::LengthAndCount> entries;
+        histogram.getLengthsInDescendingOrder(entries);
+        writeNumber(buffer, entries.size());
+        size_t previous_length = 0;
+        for(size_t i = entries.size(); 0 < i--; ) {
+            writeNumber(buffer, entries[i].first - previous_length);
+            writeNumber(buffer, entries[i].second);
+            previous_length = entries[i].first;
+        }
     }
-    vector<size_t> length_of_scaffolds_wgap;
-    vector<size_t> length_of_scaffolds_wogap;
-    vector<size_t> length_of_contigs;
-    int number_of_successfully_processed_files = 0;
-    for(int i = optind + 1; i < argc; ++i) {
-    	if(calculate_n50_statistics(argv[i], length_of_scaffolds_wgap, length_of_scaffolds_wogap, length_of_contigs)) {
-            number_of_successfully_processed_files++;
+    static bool readHistogram(istream& is, LengthHistogram& histogram) {
+        uint64_t number_of_entries;
+        if(!readNumber(is, number_of_entries)) return false;
+        size_t length = 0;
+        for(uint64_t i = 0; i < number_of_entries; ++i) {
+            uint64_t delta, count;
+            if(!readNumber(is, delta) || !readNumber(is, count)) return false;
+            length += delta;
+            histogram.add(length, count);
         }
+        return true;
     }
-    if(number_of_successfully_processed_files <= 0) {
-        cerr << "ERROR: All file(s) could not be opened." << endl;
-        return;
+    bool write(ostream& os) const {
+        string buffer = "FATTSTA1";
+        writeHistogram(buffer, scaffoldsWithGap);
+        writeHistogram(buffer, scaffoldsWithoutGap);
+        writeHistogram(buffer, contigs);
+        writeNumber(buffer, composition.gcCount);
+        for(int i = 0; i < 256; ++i) writeNumber(buffer, composition.qvCharCounts[i]);
+        os.write(buffer.data(), buffer.size());
+        return !os.fail();
+    }
+    // Adds the summary read from is to this.
+    bool read(istream& is) {
+        char magic[8];
+        if(!is.read(magic, sizeof(magic)) || memcmp(magic, "FATTSTA1", sizeof(magic)) != 0) return false;
+        PartialStatistics other;
+        if(!readHistogram(is, other.scaffoldsWithGap)) return false;
+        if(!readHistogram(is, other.scaffoldsWithoutGap)) return false;
+        if(!readHistogram(is, other.contigs)) return false;
+        if(!readNumber(is, other.composition.gcCount)) return false;
+        for(int i = 0; i < 256; ++i) {
+            if(!readNumber(is, other.composition.qvCharCounts[i])) return false;
+        }
+        scaffoldsWithGap.merge(other.scaffoldsWithGap);
+        scaffoldsWithoutGap.merge(other.scaffoldsWithoutGap);
+        contigs.merge(other.contigs);
+        composition.merge(other.composition);
+        return true;
     }
-    if(!(length_of_scaffolds_wgap.size() == length_of_scaffolds_wogap.size())) {
-        cerr << "Assertion failed. Maybe you found a bug! Please report to the author.\n";
-        return;
+};
+
+// Computes the summary of the files for --emit-partial, and writes it to file_name ("-" for stdout).
+bool emit_partial_statistics(const vector<const char*>& files, const string& file_name)
+{
+    PartialStatistics stats;
+    for(size_t i = 0; i < files.size(); ++i) {
+        if(!calculate_n50_statistics(files[i], stats.scaffoldsWithGap, stats.scaffoldsWithoutGap, stats.contigs, &stats.composition)) return false;
+    }
+    if(file_name == "-") return stats.write(cout);
+    ofstream ofs(file_name.c_str(), ios::binary);
+    if(!ofs || !stats.write(ofs)) {
+        cerr << "ERROR: Cannot write '" << file_name << "'" << endl;
+        return false;
+    }
+    return true;
+}
+
+void print_base_composition(const BaseComposition& composition, const unsigned long long total_length, const unsigned long long n_count, const bool flag_html, const bool flag_json, const int qv_base)
+{
+    unsigned long long number_of_qvs = 0;
+    unsigned long long sum_of_qvs = 0;
+    for(int i = 0; i < 256; ++i) {
+        number_of_qvs += composition.qvCharCounts[i];
+        sum_of_qvs += composition.qvCharCounts[i] * i;
+    }
+    const double gc_fraction = total_length == n_count ? 0 : double(composition.gcCount) / (total_length - n_count);
+    const double mean_qv = number_of_qvs == 0 ? 0 : double(sum_of_qvs) / number_of_qvs - qv_base;
+    if(flag_html) {
+        cout << "<tr><th colspan=\"3\" bgcolor=\"#fdfdd4\">Base composition</th></tr>\n";
+        cout << "<tr><td>GC</td><td>" << sep_comma(composition.gcCount) << "</td><td>" << fixed << setprecision(2) << gc_fraction * 100 << "%</td></tr>\n";
+        cout << "<tr><td>N</td><td>" << sep_comma(n_count) << "</td><td></td></tr>\n";
+        if(0 < number_of_qvs) cout << "<tr><td>mean QV</td><td>" << mean_qv << "</td><td></td></tr>\n";
+    } else if(flag_json) {
+        cout << ",\"composition\": {\"gc\": " << composition.gcCount << ",\"n\": " << n_count;
+        if(0 < number_of_qvs) {
+            cout << ",\"mean_qv\": " << mean_qv << ",\"qv_histogram\": {";
+            const char* separator = "";
+            for(int i = 0; i < 256; ++i) {
+                if(composition.qvCharCounts[i] == 0) continue;
+                cout << separator << "\"" << (i - qv_base) << "\": " << composition.qvCharCounts[i];
+                separator = ",";
+            }
+            cout << "}";
+        }
+        cout << "}";
+    } else {
+        cout << "\nBase composition\n";
+        cout << "GC = " << sep_comma(composition.gcCount) << " (" << fixed << setprecision(2) << gc_fraction * 100 << "% of non-N bases)\n";
+        cout << "N = " << sep_comma(n_count) << "\n";
+        if(0 < number_of_qvs) cout << "Mean QV = " << mean_qv << "\n";
     }
+}
+
+void print_stat_report(const LengthHistogram& length_of_scaffolds_wgap,
+                       const LengthHistogram& length_of_scaffolds_wogap,
+                       const LengthHistogram& length_of_contigs,
+                       const bool flag_html, const bool flag_json,
+                       const bool flag_all, const bool flag_scaffold, const bool flag_contig,
+                       const BaseComposition* composition = NULL, const int qv_base = 33)
+{
     if(flag_all || flag_scaffold) {
         if(flag_html) {
             cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
@@ -915,6 +2629,7 @@ void do_stat(int argc, char** argv)
         }
         print_n50(length_of_contigs, flag_html, flag_json, "contig");
     }
+    if(composition != NULL) print_base_composition(*composition, length_of_scaffolds_wgap.total(), length_of_scaffolds_wgap.total() - length_of_scaffolds_wogap.total(), flag_html, flag_json, qv_base);
     if(flag_html) {
         cout << "</table>\n";
     } else if(flag_json) {
@@ -922,6 +2637,181 @@ void do_stat(int argc, char** argv)
     }
 }
 
+void do_stat(int argc, char** argv)
+{
+    bool flag_html = false;
+    bool flag_json = false;
+    bool flag_contig = false;
+    bool flag_scaffold = false;
+    bool flag_all = true;
+    string param_emit_partial;
+    string param_group_by;
+    int param_threads = 1;
+    int param_qv_base = 33;
+    static struct option long_options[] = {
+        {"html", no_argument, 0, 'h'},
+        {"json", no_argument, 0, 'j'},
+        {"contig", no_argument, 0, 'c'},
+        {"scaffold", no_argument, 0, 's'},
+        {"emit-partial", required_argument, 0, 'E'},
+        {"group-by", required_argument, 0, 'G'},
+        {"threads", required_argument, 0, 't'},
+        {"qvbase", required_argument, 0, 'q'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+    	int option_index = 0;
+    	int c = getopt_long(argc, argv, "", long_options, &option_index);
+    	if(c == -1) break;
+    	switch(c) {
+            case 0:
+           // you can see long_options[option_index].name/flag and optarg (null if no argument).
+                break;
+            case 'h':
+                flag_html = true;
+                break;
+            case 'j':
+                flag_json = true;
+                break;
+            case 'c':
+                flag_contig = true;
+                flag_all = false;
+                break;
+            case 's':
+                flag_scaffold = true;
+                flag_all = false;
+                break;
+            case 'E':
+                param_emit_partial = optarg;
+                break;
+            case 'G':
+                param_group_by = optarg;
+                break;
+            case 't':
+                param_threads = atoi(optarg);
+                break;
+            case 'q':
+                param_qv_base = atoi(optarg);
+                break;
+        }
+    }
+    if(flag_html && flag_json) {
+        cerr << "ERROR: You can use either --html or --json\n";
+        return;
+    }
+    if(!param_emit_partial.empty()) {
+        emit_partial_statistics(vector<const char*>(argv + optind + 1, argv + argc), param_emit_partial);
+        return;
+    }
+    if(!param_group_by.empty()) {
+        if(flag_html) {
+            cerr << "ERROR: --group-by outputs TSV or JSON (--json), but not HTML\n";
+            return;
+        }
+        output_grouped_statistics(vector<const char*>(argv + optind + 1, argv + argc), param_group_by, param_threads, flag_json, param_qv_base);
+        return;
+    }
+    LengthHistogram length_of_scaffolds_wgap;
+    LengthHistogram length_of_scaffolds_wogap;
+    LengthHistogram length_of_contigs;
+    int number_of_successfully_processed_files = 0;
+    for(int i = optind + 1; i < argc; ++i) {
+    	if(calculate_n50_statistics(argv[i], length_of_scaffolds_wgap, length_of_scaffolds_wogap, length_of_contigs)) {
+            number_of_successfully_processed_files++;
+        }
+    }
+    if(number_of_successfully_processed_files <= 0) {
+        cerr << "ERROR: All file(s) could not be opened." << endl;
+        return;
+    }
+    if(!(length_of_scaffolds_wgap.size() == length_of_scaffolds_wogap.size())) {
+        cerr << "Assertion failed. Maybe you found a bug! Please report to the author.\n";
+        return;
+    }
+    print_stat_report(length_of_scaffolds_wgap, length_of_scaffolds_wogap, length_of_contigs, flag_html, flag_json, flag_all, flag_scaffold, flag_contig);
+}
+
+void do_merge_stats(int argc, char** argv)
+{
+    bool flag_html = false;
+    bool flag_json = false;
+    bool flag_contig = false;
+    bool flag_scaffold = false;
+    bool flag_all = true;
+    bool flag_count = false;
+    int param_qv_base = 33;
+    static struct option long_options[] = {
+        {"html", no_argument, 0, 'h'},
+        {"json", no_argument, 0, 'j'},
+        {"contig", no_argument, 0, 'c'},
+        {"scaffold", no_argument, 0, 's'},
+        {"count", no_argument, 0, 'C'},
+        {"qvbase", required_argument, 0, 'q'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+    	int option_index = 0;
+    	int c = getopt_long(argc, argv, "", long_options, &option_index);
+    	if(c == -1) break;
+    	switch(c) {
+            case 0:
+           // you can see long_options[option_index].name/flag and optarg (null if no argument).
+                break;
+            case 'h':
+                flag_html = true;
+                break;
+            case 'j':
+                flag_json = true;
+                break;
+            case 'c':
+                flag_contig = true;
+                flag_all = false;
+                break;
+            case 's':
+                flag_scaffold = true;
+                flag_all = false;
+                break;
+            case 'C':
+                flag_count = true;
+                break;
+            case 'q':
+                param_qv_base = atoi(optarg);
+                break;
+        }
+    }
+    if(flag_html && flag_json) {
+        cerr << "ERROR: You can use either --html or --json\n";
+        return;
+    }
+    if(optind + 1 >= argc) {
+        cerr << "ERROR: No input files." << endl;
+        return;
+    }
+    PartialStatistics stats;
+    for(int i = optind + 1; i < argc; ++i) {
+        ifstream ifs(argv[i], ios::binary);
+        if(!ifs) {
+            cerr << "ERROR: Cannot open '" << argv[i] << "'" << endl;
+            return;
+        }
+        if(!stats.read(ifs)) {
+            cerr << "ERROR: '" << argv[i] << "' is not a summary written by --emit-partial, or is truncated." << endl;
+            return;
+        }
+    }
+    if(flag_count) {
+        // The same columns as count, for all the files together.
+        vector<LengthHistogram::LengthAndCount> entries;
+        stats.scaffoldsWithGap.getLengthsInDescendingOrder(entries);
+        const uint64_t number_of_sequences = stats.scaffoldsWithGap.size();
+        cout << "FILE\tNUM_READS\tNUM_NUCLS\tAVG_READ_LEN\tMIN_READ_LEN\tMAX_READ_LEN\n";
+        cout << "TOTAL\t" << number_of_sequences << '\t' << stats.scaffoldsWithGap.total() << '\t' << (double(stats.scaffoldsWithGap.total()) / number_of_sequences);
+        cout << '\t' << (entries.empty() ? size_t(-1) : entries.back().first) << '\t' << (entries.empty() ? 0 : entries.front().first) << '\n';
+        return;
+    }
+    print_stat_report(stats.scaffoldsWithGap, stats.scaffoldsWithoutGap, stats.contigs, flag_html, flag_json, flag_all, flag_scaffold, flag_contig, &stats.composition, param_qv_base);
+}
+
 void do_split(int argc, char** argv)
 {
     bool flag_num = false;
@@ -988,9 +2878,9 @@ void do_split(int argc, char** argv)
     if(flag_max) {
         bases_per_file = param_specified_max;
     } else if(flag_num) {
-        vector<size_t> length_of_scaffolds_wgap;
-        vector<size_t> length_of_scaffolds_wogap;
-        vector<size_t> length_of_contigs;
+        LengthHistogram length_of_scaffolds_wgap;
+        LengthHistogram length_of_scaffolds_wogap;
+        LengthHistogram length_of_contigs;
         for(int i = optind + 1; i < argc; ++i) {
             cerr << "Counting the number of bases ('" << argv[i] << "')\r" << flush;
             calculate_n50_statistics(argv[i], length_of_scaffolds_wgap, length_of_scaffolds_wogap, length_of_contigs);
@@ -1000,10 +2890,8 @@ void do_split(int argc, char** argv)
             cerr << "Assertion failed. Maybe you have found a bug! Please report to the author.\n";
             return;
         }
-        const long long total_bases = flag_exclude_n ?
-            accumulate(length_of_scaffolds_wogap.begin(), length_of_scaffolds_wogap.end(), 0ll):
-            accumulate(length_of_scaffolds_wgap.begin(),  length_of_scaffolds_wgap.end(),  0ll);
-        const long long bases_per_file = (total_bases + param_specified_num - 1) / param_specified_num;
+        const long long total_bases = flag_exclude_n ? length_of_scaffolds_wogap.total() : length_of_scaffolds_wgap.total();
+        bases_per_file = (total_bases + param_specified_num - 1) / param_specified_num;
         cerr << "Total " << total_bases << " bases (" << (flag_exclude_n ? "wo/ gaps" : "w/ gaps") << ") ";
         cerr << bases_per_file << " bases per file\n" << flush;
     } else { /* never come here */ cerr << "ERROR: Please report to the author." << endl; exit(-1); }
@@ -1038,7 +2926,7 @@ void do_split(int argc, char** argv)
                             ost << f.b << "\n";
                             number_of_nucleotides_in_output_file += f.len();
                             if(flag_exclude_n)
-                                number_of_nucleotides_in_output_file -= count_if(f.b, f.b + f.len(), isN);
+                                number_of_nucleotides_in_output_file -= count_n(f.b, f.len());
                         }
                     }
                 } else {
@@ -1063,7 +2951,7 @@ void do_split(int argc, char** argv)
                             const size_t number_of_nucleotides_in_line = f.len();
                             number_of_nucleotides_in_output_file += number_of_nucleotides_in_line;
                             if(flag_exclude_n)
-                                number_of_nucleotides_in_output_file -= count_if(f.b, f.b + f.len(), isN);
+                                number_of_nucleotides_in_output_file -= count_n(f.b, f.len());
                             number_of_nucleotides_in_read += number_of_nucleotides_in_line;
                             ost << f.b << "\n";
                         }
@@ -1116,6 +3004,271 @@ void do_index(int argc, char** argv)
 	}
 }
 
+static void resolve_read_positions_worker(sqdb::ConnectionPool* pool, const vector<const char*>* read_names, vector<long long>* read_positions, vector<long long>* record_ends, size_t begin, size_t end, string* error_message)
+{
+    try {
+        sqdb::PooledConnection connection(*pool);
+        // The end of a record is the start of the next one, or -1 for the last record.
+        sqdb::Statement& stmt = connection.GetStatement(record_ends == NULL ? "select pos from seqpos where name=?" :
+            "select pos, coalesce((select next.pos from seqpos next where next.readindex = seqpos.readindex + 1), -1) from seqpos where name=?");
+        for(size_t i = begin; i < end; ++i) {
+            stmt.Bind(1, (*read_names)[i]);
+            if(stmt.Next()) {
+                (*read_positions)[i] = stmt.GetField(0);
+                if(record_ends != NULL) (*record_ends)[i] = stmt.GetField(1);
+            } else {
+                (*read_positions)[i] = -1;
+            }
+        }
+    } catch (const sqdb::Exception& e) {
+        *error_message = e.GetErrorMsg();
+    }
+}
+
+// Looks up the file positions of read_names with one thread per pooled connection.
+// Names that are not in the index get -1. If record_ends is given, it gets
+// the end of each record (-1 for the end of file). Returns false on a DB error.
+static bool resolve_read_positions(sqdb::ConnectionPool& pool, const vector<const char*>& read_names, vector<long long>& read_positions, vector<long long>* record_ends = NULL)
+{
+    read_positions.assign(read_names.size(), -1ll);
+    if(record_ends != NULL) record_ends->assign(read_names.size(), -1ll);
+    const size_t num_threads = min<size_t>(pool.GetSize(), max<size_t>(read_names.size(), 1u));
+    const size_t names_per_thread = (read_names.size() + num_threads - 1) / num_threads;
+    vector<string> error_messages(num_threads);
+    vector<thread> threads;
+    for(size_t i = 0; i < num_threads; ++i) {
+        const size_t begin = min(read_names.size(), i * names_per_thread);
+        const size_t end = min(read_names.size(), begin + names_per_thread);
+        threads.push_back(thread(resolve_read_positions_worker, &pool, &read_names, &read_positions, record_ends, begin, end, &error_messages[i]));
+    }
+    bool succeeded = true;
+    for(size_t i = 0; i < num_threads; ++i) {
+        threads[i].join();
+        if(!error_messages[i].empty()) {
+            cerr << "ERROR: db error. " << error_messages[i] << endl;
+            succeeded = false;
+        }
+    }
+    return succeeded;
+}
+
+// A record in an index: [begin, end) in the file (end is -1 for the end of file), and its name.
+struct IndexedRecord
+{
+    long long begin;
+    long long end;
+    string name;
+    IndexedRecord(long long begin, long long end, const char* name) : begin(begin), end(end), name(name) {}
+    bool operator<(const IndexedRecord& other) const { return begin < other.begin; }
+};
+
+// Returns the end of the FASTA/FASTQ record at pos in data[0, size), splitting the records
+// as the line-by-line loops do, or -1 if no record starts at pos.
+static long long find_record_end(const char* data, long long size, long long pos)
+{
+    if(pos < 0 || size <= pos || (pos != 0 && data[pos - 1] != '\n')) return -1;
+    auto next_line = [&](long long p) {
+        const char* newline = static_cast<const char*>(memchr(data + p, '\n', size - p));
+        return newline == NULL ? size : newline - data + 1;
+    };
+    auto line_length = [&](long long p, long long next) { return next - p - (data[next - 1] == '\n' ? 1 : 0); };
+    long long p = next_line(pos);
+    if(data[pos] == '>') {
+        while(p < size && data[p] != '>') p = next_line(p);
+        return p;
+    }
+    if(data[pos] != '@') return -1;
+    long long number_of_nucleotides = 0;
+    while(p < size && data[p] != '+') {
+        const long long next = next_line(p);
+        number_of_nucleotides += line_length(p, next);
+        p = next;
+    }
+    if(size <= p) return size;
+    p = next_line(p);
+    long long n = number_of_nucleotides;
+    while(p < size) {
+        const long long next = next_line(p);
+        n -= line_length(p, next);
+        p = next;
+        if(n <= 0) break;
+    }
+    return p;
+}
+
+// Returns true if a record named name is at [begin, end) in data[0, size).
+static bool is_indexed_record_in_data(const char* data, long long size, long long begin, long long end, const string& name)
+{
+    const long long record_end = find_record_end(data, size, begin);
+    if(record_end < 0 || record_end != (end < 0 ? size : end)) return false;
+    if(size - begin < static_cast<long long>(name.size()) + 1 || memcmp(data + begin + 1, name.data(), name.size()) != 0) return false;
+    const long long after_name = begin + 1 + name.size();
+    return after_name == size || data[after_name] == ' ' || data[after_name] == '\n';
+}
+
+// Writes the file to stdout except the excluded records. The records may overlap.
+// The kept parts are written as they are, without parsing them.
+// The index the records came from may not match the file; unless every excluded record
+// is in the file as it is in the index (and validate_whole_file, if any, returns true for
+// the mapped file), nothing is written, and index_matches is false.
+static bool copy_file_excluding_ranges(const char* file_name, vector<IndexedRecord>& excluded_records,
+                                       const std::function<bool(const char*, long long)>& validate_whole_file, bool& index_matches)
+{
+    index_matches = true;
+    const int fd = open(file_name, O_RDONLY);
+    if(fd < 0) {
+        cerr << "Cannot open '" << file_name << "'" << endl;
+        return false;
+    }
+    struct stat s;
+    if(fstat(fd, &s) != 0) {
+        close(fd);
+        return false;
+    }
+    const long long size = s.st_size;
+    if(size == 0) {
+        close(fd);
+        index_matches = excluded_records.empty() && (!validate_whole_file || validate_whole_file("", 0));
+        return index_matches;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        cerr << "ERROR: cannot map '" << file_name << "'" << endl;
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char* data = static_cast<const char*>(mapped);
+    sort(excluded_records.begin(), excluded_records.end());
+    for(size_t i = 0; i < excluded_records.size() && index_matches; ++i) {
+        index_matches = is_indexed_record_in_data(data, size, excluded_records[i].begin, excluded_records[i].end, excluded_records[i].name);
+    }
+    if(index_matches && validate_whole_file) index_matches = validate_whole_file(data, size);
+    if(!index_matches) {
+        munmap(mapped, size);
+        return false;
+    }
+    cout.flush();
+    bool succeeded = true;
+    long long pos = 0;
+    for(size_t i = 0; i < excluded_records.size() && succeeded; ++i) {
+        const long long begin = excluded_records[i].begin;
+        const long long end = excluded_records[i].end < 0 ? size : excluded_records[i].end;
+        if(pos < begin) succeeded = write_fully(STDOUT_FILENO, data + pos, begin - pos);
+        pos = std::max(pos, end);
+    }
+    if(succeeded && pos < size) {
+        succeeded = write_fully(STDOUT_FILENO, data + pos, size - pos);
+        // The line-by-line output always ends with a newline.
+        if(succeeded && data[size - 1] != '\n') succeeded = write_fully(STDOUT_FILENO, "\n", 1);
+    }
+    munmap(mapped, size);
+    if(!succeeded) cerr << "ERROR: cannot write to stdout" << endl;
+    return succeeded;
+}
+
+// --reverse (and --unique) with an index: the records to drop are looked up
+// in the index, and the rest of the file is copied as it is.
+// For --unique, previous_index_file_names has the indexes of the files
+// already output, and the reads whose names are in them are dropped, too;
+// this is a join between the two indexes, so no names are loaded into memory.
+// Names in a single index are unique because the name is its primary key.
+// If the index does not match the file (it is older than the file, or a record in it
+// is not in the file as it is indexed), nothing is output and index_is_stale is set.
+// For --unique, the index of this file gives the names to the following files, so
+// all the records in it are checked against the file.
+static bool extract_complement_by_index(const char* file_name, const ReadNameSet& excluded_names, const vector<string>* previous_index_file_names, int num_threads, bool& index_is_stale)
+{
+    const string index_file_name = get_index_file_name(file_name);
+    index_is_stale = index_older_than_file(file_name, index_file_name);
+    if(index_is_stale) return false;
+    vector<IndexedRecord> excluded_records;
+    try {
+        if(!excluded_names.empty()) {
+            vector<const char*> read_names;
+            excluded_names.getSortedNames(read_names);
+            vector<long long> read_positions;
+            vector<long long> record_ends;
+            sqdb::ConnectionPool pool(index_file_name.c_str(), num_threads);
+            if(!resolve_read_positions(pool, read_names, read_positions, &record_ends)) return false;
+            for(size_t i = 0; i < read_names.size(); ++i) {
+                if(0 <= read_positions[i]) excluded_records.push_back(IndexedRecord(read_positions[i], record_ends[i], read_names[i]));
+            }
+        }
+        if(previous_index_file_names != NULL && !previous_index_file_names->empty()) {
+            sqdb::Db db(index_file_name.c_str(), sqdb::Db::OPEN_READONLY_IMMUTABLE);
+            db.UseQueryProfile();
+            for(size_t i = 0; i < previous_index_file_names->size(); ++i) {
+                db.AttachReadOnly((*previous_index_file_names)[i].c_str(), "previous");
+                {
+                    sqdb::Statement stmt = db.Query("select b.pos, coalesce((select c.pos from main.seqpos c where c.readindex = b.readindex + 1), -1), b.name "
+                                                    "from previous.seqpos a join main.seqpos b on b.name = a.name");
+                    while(stmt.Next()) {
+                        const long long begin = stmt.GetField(0);
+                        const long long end = stmt.GetField(1);
+                        const char* name = stmt.GetField(2);
+                        excluded_records.push_back(IndexedRecord(begin, end, name));
+                    }
+                }
+                db.Do("detach database previous");
+            }
+        }
+    } catch (const sqdb::Exception& e) {
+        cerr << "ERROR: db error. " << e.GetErrorMsg() << endl;
+        return false;
+    }
+    std::function<bool(const char*, long long)> validate_whole_file;
+    string error_message;
+    if(previous_index_file_names != NULL) {
+        validate_whole_file = [&](const char* data, long long size) {
+            try {
+                sqdb::Db db(index_file_name.c_str(), sqdb::Db::OPEN_READONLY_IMMUTABLE);
+                sqdb::Statement stmt = db.Query("select name, pos from seqpos order by readindex");
+                long long expected_pos = 0;
+                while(stmt.Next()) {
+                    const char* name = stmt.GetField(0);
+                    const long long pos = stmt.GetField(1);
+                    const long long end = find_record_end(data, size, pos);
+                    if(pos != expected_pos || !is_indexed_record_in_data(data, size, pos, end, name)) return false;
+                    expected_pos = end;
+                }
+                return expected_pos == size;
+            } catch (const sqdb::Exception& e) {
+                error_message = e.GetErrorMsg();
+                return false;
+            }
+        };
+    }
+    bool index_matches;
+    const bool succeeded = copy_file_excluding_ranges(file_name, excluded_records, validate_whole_file, index_matches);
+    if(!error_message.empty()) {
+        cerr << "ERROR: db error. " << error_message << endl;
+        return false;
+    }
+    index_is_stale = !index_matches;
+    return succeeded;
+}
+
+// Adds the names in the indexes to names.
+static bool load_read_names_from_indexes(const vector<string>& index_file_names, ReadNameSet& names)
+{
+    try {
+        for(size_t i = 0; i < index_file_names.size(); ++i) {
+            sqdb::Db db(index_file_names[i].c_str(), sqdb::Db::OPEN_READONLY_IMMUTABLE);
+            db.UseQueryProfile();
+            sqdb::Statement stmt = db.Query("select name from seqpos");
+            while(stmt.Next()) {
+                const char* name = stmt.GetField(0);
+                names.insert(name, strlen(name));
+            }
+        }
+    } catch (const sqdb::Exception& e) {
+        cerr << "ERROR: db error. " << e.GetErrorMsg() << endl;
+        return false;
+    }
+    return true;
+}
+
 void do_extract(int argc, char** argv)
 {
     bool flag_reverse_condition = false;
@@ -1127,6 +3280,17 @@ void do_extract(int argc, char** argv)
 	long long param_start = -1;
 	long long param_end = -1;
 	long long param_num = -1;
+    int param_threads = 1;
+    long long param_bloom_mib = -1;
+    int param_fingerprint_bits = 0;
+    bool flag_verify_fingerprints = false;
+    long long param_memory_mib = 0;
+    string param_temporary_directory = get_temporary_directory();
+    bool flag_sorted = false;
+    bool flag_paired = false;
+    bool flag_interleaved = false;
+    string param_out1;
+    string param_out2;
 
     static struct option long_options[] = {
         {"reverse", no_argument , 0, 'r'},
@@ -1140,10 +3304,21 @@ void do_extract(int argc, char** argv)
     	{"start", required_argument, 0, 'a'},
     	{"end", required_argument, 0, 'e'},
     	{"num", required_argument, 0, 'q'},
+    	{"threads", required_argument, 0, 't'},
+    	{"bloom", required_argument, 0, 'b'},
+    	{"fingerprint", required_argument, 0, 'p'},
+    	{"verify", no_argument, 0, 'v'},
+    	{"memory", required_argument, 0, 'm'},
+    	{"tmpdir", required_argument, 0, 'T'},
+    	{"sorted", no_argument, 0, 'S'},
+    	{"paired", no_argument, 0, 'P'},
+    	{"interleaved", no_argument, 0, 'I'},
+    	{"out1", required_argument, 0, '1'},
+    	{"out2", required_argument, 0, '2'},
         {0, 0, 0, 0} // end of long options
     };
 
-    set<string> readNamesToTake;
+    ReadNameSet readNamesToTake;
     vector<string> fileInputs;
 
     while(true) {
@@ -1187,8 +3362,45 @@ void do_extract(int argc, char** argv)
 		case 'q':
 			param_num = atoll(optarg);
 			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		case 'b':
+			param_bloom_mib = atoll(optarg);
+			break;
+		case 'p':
+			param_fingerprint_bits = atoi(optarg);
+			break;
+		case 'v':
+			flag_verify_fingerprints = true;
+			break;
+		case 'm':
+			param_memory_mib = atoll(optarg);
+			break;
+		case 'T':
+			param_temporary_directory = optarg;
+			break;
+		case 'S':
+			flag_sorted = true;
+			break;
+		case 'P':
+			flag_paired = true;
+			break;
+		case 'I':
+			flag_interleaved = true;
+			break;
+		case '1':
+			param_out1 = optarg;
+			break;
+		case '2':
+			param_out2 = optarg;
+			break;
 		}
 	}
+	if(param_threads < 1) {
+		cerr << "ERROR: --threads must be positive" << endl;
+		return;
+	}
 	if(flag_index && flag_noindex) {
 		cerr << "ERROR: do not specify --index and --noindex at once" << endl;
 		return;
@@ -1205,6 +3417,41 @@ void do_extract(int argc, char** argv)
             param_end = param_start + param_num;
         }
     }
+    if(param_fingerprint_bits != 0 || flag_verify_fingerprints || param_memory_mib != 0) {
+        if(param_fingerprint_bits != 64 && param_fingerprint_bits != 128) {
+            cerr << "ERROR: --fingerprint takes 64 or 128" << endl;
+            return;
+        }
+        if(!flag_output_unique || flag_reverse_condition || flag_read_from_stdin || !readNamesToTake.empty() || !fileInputs.empty() || param_start != -1) {
+            cerr << "ERROR: --fingerprint can be used only with --unique (and no other conditions)" << endl;
+            return;
+        }
+        if(param_memory_mib < 0) {
+            cerr << "ERROR: --memory takes a size in MiB" << endl;
+            return;
+        }
+        vector<const char*> file_names(argv + optind + 1, argv + argc);
+        extract_unique_by_fingerprint(file_names, param_fingerprint_bits, flag_verify_fingerprints, param_memory_mib, param_temporary_directory);
+        return;
+    }
+    if(flag_sorted) {
+        if(fileInputs.size() + (flag_read_from_stdin ? 1u : 0u) != 1u || !readNamesToTake.empty() || flag_output_unique || param_start != -1) {
+            cerr << "ERROR: --sorted takes the name list from either one --file or --stdin, and no other conditions" << endl;
+            return;
+        }
+        vector<const char*> file_names(argv + optind + 1, argv + argc);
+        if(flag_read_from_stdin) {
+            extract_by_sorted_name_list(cin, "stdin", file_names, flag_reverse_condition);
+        } else {
+            ifstream names(fileInputs[0].c_str());
+            if(!names) {
+                cerr << "ERROR: Cannot open '" << fileInputs[0] << "'" << endl;
+                return;
+            }
+            extract_by_sorted_name_list(names, fileInputs[0], file_names, flag_reverse_condition);
+        }
+        return;
+    }
     if(flag_output_unique) {
         flag_reverse_condition = !flag_reverse_condition;
     }
@@ -1216,29 +3463,90 @@ void do_extract(int argc, char** argv)
     }
     {
         for(int i = 0; i < fileInputs.size(); ++i) {
-            ifstream ist(fileInputs[i].c_str());
-            if(!ist) {
+            if(!load_read_names_from_file(fileInputs[i].c_str(), readNamesToTake)) {
                 cerr << "ERROR: Cannot open '" << fileInputs[i] << "'" << endl;
                 return;
             }
-            string line;
-            while(getline(ist, line)) {
-                readNamesToTake.insert(line);
-            }
         }
     }
     if(!readNamesToTake.empty() && param_start != -1) {
         cerr << "ERROR: you can either select the range or the sequence names, but not both." << endl;
         return;
     }
-    for(int findex = optind + 1; findex < argc; ++findex) {
-        const char* file_name = argv[findex];
-		if(flag_index && !doesIndexExist(file_name)) {
-			create_index(file_name, flag_force);
-		}
-		const bool use_index = (flag_index || (!flag_noindex && doesIndexExist(file_name))) && !flag_reverse_condition;
-        FileLineBufferWithAutoExpansion f;
-        if(!f.open(file_name)) {
+    if(param_bloom_mib != -1) {
+        if(param_bloom_mib < 0) {
+            cerr << "ERROR: --bloom takes a size in MiB" << endl;
+            return;
+        }
+        // The filter is sized for the names given; with --unique, names are added while reading,
+        // and the set is not known in advance.
+        if(readNamesToTake.empty() || flag_output_unique) {
+            cerr << "ERROR: --bloom needs a list of names (--seq, --file or --stdin), and cannot be used with --unique" << endl;
+            return;
+        }
+        // 0 means 16 bits per name, which gives a false positive rate below 0.1%.
+        // Below 8 bits per name (about 3%), most lookups would go to the name set anyway.
+        const size_t MIN_BITS_PER_NAME = 8;
+        const size_t size_in_bytes = param_bloom_mib == 0 ? readNamesToTake.size() * 2u : param_bloom_mib * 1024u * 1024u;
+        if(size_in_bytes * 8u < readNamesToTake.size() * MIN_BITS_PER_NAME) {
+            cerr << "WARNING: --bloom=" << param_bloom_mib << " is too small for " << sep_comma(readNamesToTake.size()) << " names (it needs "
+                 << (readNamesToTake.size() * MIN_BITS_PER_NAME / 8u + 1024u * 1024u - 1u) / (1024u * 1024u) << " MiB or more; --bloom=0 chooses the size); not using it" << endl;
+        } else {
+            readNamesToTake.enablePrefilter(size_in_bytes);
+        }
+    }
+    if(flag_paired || flag_interleaved) {
+        const int number_of_files = argc - optind - 1;
+        if(flag_paired && flag_interleaved) {
+            cerr << "ERROR: do not specify --paired and --interleaved at once" << endl;
+            return;
+        }
+        if(number_of_files != (flag_paired ? 2 : 1)) {
+            cerr << "ERROR: " << (flag_paired ? "--paired takes two files (R1 and R2)" : "--interleaved takes one file") << endl;
+            return;
+        }
+        if(param_out1.empty() != param_out2.empty()) {
+            cerr << "ERROR: specify both --out1 and --out2, or neither of them for interleaved output" << endl;
+            return;
+        }
+        const char* file_name2 = flag_paired ? argv[optind + 2] : NULL;
+        if(param_out1.empty()) {
+            extract_pairs(argv[optind + 1], file_name2, readNamesToTake, flag_reverse_condition, flag_output_unique, param_start, param_end, cout, NULL);
+            return;
+        }
+        ofstream out1(param_out1.c_str(), ios::binary);
+        ofstream out2(param_out2.c_str(), ios::binary);
+        if(!out1 || !out2) {
+            cerr << "ERROR: Cannot open '" << (!out1 ? param_out1 : param_out2) << "'" << endl;
+            return;
+        }
+        extract_pairs(argv[optind + 1], file_name2, readNamesToTake, flag_reverse_condition, flag_output_unique, param_start, param_end, out1, &out2);
+        return;
+    }
+    vector<string> previous_index_file_names; // for --unique
+    for(int findex = optind + 1; findex < argc; ++findex) {
+        const char* file_name = argv[findex];
+		if(flag_index && !doesIndexExist(file_name)) {
+			create_index(file_name, flag_force);
+		}
+		const bool use_index = (flag_index || (!flag_noindex && doesIndexExist(file_name))) && !flag_reverse_condition;
+		if(flag_reverse_condition && param_start == -1 && !flag_noindex && doesIndexExist(file_name)) {
+			bool index_is_stale;
+			if(extract_complement_by_index(file_name, readNamesToTake, flag_output_unique ? &previous_index_file_names : NULL, param_threads, index_is_stale)) {
+				if(flag_output_unique) previous_index_file_names.push_back(get_index_file_name(file_name));
+				continue;
+			}
+			if(!index_is_stale) return;
+			cerr << "Warning: index file " << get_index_file_name(file_name) << " does not match " << file_name << "; reading the file without it" << endl;
+		}
+		if(!previous_index_file_names.empty()) {
+			// The parser below needs the names of the files output through their indexes.
+			if(!load_read_names_from_indexes(previous_index_file_names, readNamesToTake)) return;
+			previous_index_file_names.clear();
+		}
+        FileLineBufferWithAutoExpansion f;
+        if(use_index) f.setRandomAccessMode();
+        if(!f.open(file_name)) {
             cerr << "Cannot open '" << file_name << "'" << endl;
             continue;
         }
@@ -1250,14 +3558,18 @@ void do_extract(int argc, char** argv)
                       " is older than " << file_name << endl;
             }
             try {
-                sqdb::Db db(index_file_name.c_str());
                 if(param_start == -1) {
-                    sqdb::Statement stmt = db.Query("select pos from seqpos where name=?");
-                    for(set<string>::const_iterator it = readNamesToTake.begin(); it != readNamesToTake.end(); ++it) {
-                        const string& read_name = *it;
-                        stmt.Bind(1, read_name);
-                        if(stmt.Next()) {
-                            const long long pos = stmt.GetField(0);
+                    vector<const char*> read_names;
+                    readNamesToTake.getSortedNames(read_names);
+                    vector<long long> read_positions;
+                    {
+                        sqdb::ConnectionPool pool(index_file_name.c_str(), param_threads);
+                        if(!resolve_read_positions(pool, read_names, read_positions)) return;
+                    }
+                    for(size_t i = 0; i < read_names.size(); ++i) {
+                        const char* read_name = read_names[i];
+                        if(0 <= read_positions[i]) {
+                            const long long pos = read_positions[i];
                             f.seekg(pos);
                             if(f.fail() || !f.getline()) {
                                 cerr << "WARNING: " << read_name << " is missing in the file. Maybe the index is old?\n";
@@ -1295,7 +3607,9 @@ void do_extract(int argc, char** argv)
                         }
                     }
                 } else {
-                    sqdb::Statement stmt = db.Query("select pos from seqpos limit 1 offset ?");
+                    sqdb::Db db(index_file_name.c_str(), sqdb::Db::OPEN_READONLY_IMMUTABLE);
+                    db.UseQueryProfile();
+                    sqdb::Statement stmt = db.Query("select pos from seqpos where readindex=?");
                     long long sequence_index = param_start;
                     stmt.Bind(1, param_start);
                     if(stmt.Next()) {
@@ -1363,25 +3677,25 @@ void do_extract(int argc, char** argv)
                 number_of_sequences++;
                 size_t number_of_nucleotides_in_read = 0;
                 if(param_start == -1) {
-                    current_read_has_been_taken = (readNamesToTake.count(get_read_name_from_header(f.b)) != 0) ^ flag_reverse_condition;
+                    current_read_has_been_taken = readNamesToTake.containsNameInHeader(f.b) ^ flag_reverse_condition;
                 } else {
                     current_read_has_been_taken = param_start + 1 <= number_of_sequences && number_of_sequences <= param_end;
                     // NOTE: the latter condition never hold, if I properly implemented.
                 }
                 if(current_read_has_been_taken) cout << f.b << endl;
-                if(flag_output_unique) readNamesToTake.insert(get_read_name_from_header(f.b));
+                if(flag_output_unique) readNamesToTake.insertNameInHeader(f.b);
                 if(!f.looksLikeFASTQHeader()) { 
                     while(f.getline()) {
                         if(f.looksLikeFASTAHeader()) {
                             number_of_sequences++;
                             if(param_start == -1) {
-                                current_read_has_been_taken = (readNamesToTake.count(get_read_name_from_header(f.b)) != 0) ^ flag_reverse_condition;
+                                current_read_has_been_taken = readNamesToTake.containsNameInHeader(f.b) ^ flag_reverse_condition;
                             } else {
                                 current_read_has_been_taken = param_start + 1 <= number_of_sequences && number_of_sequences <= param_end;
                                 // NOTE: the latter condition never hold, if I properly implemented.
                             }
                             if(current_read_has_been_taken) cout << f.b << endl;
-                            if(flag_output_unique) readNamesToTake.insert(get_read_name_from_header(f.b));
+                            if(flag_output_unique) readNamesToTake.insertNameInHeader(f.b);
                             number_of_nucleotides_in_read = 0;
                         } else {
                             if(current_read_has_been_taken) cout << f.b << endl;
@@ -1405,7 +3719,7 @@ void do_extract(int argc, char** argv)
                             f.registerHeaderLine();
                             ++number_of_sequences;
                             if(param_start == -1) {
-                                current_read_has_been_taken = (readNamesToTake.count(get_read_name_from_header(f.b)) != 0) ^ flag_reverse_condition;
+                                current_read_has_been_taken = readNamesToTake.containsNameInHeader(f.b) ^ flag_reverse_condition;
                             } else {
                                 current_read_has_been_taken = param_start + 1 <= number_of_sequences && number_of_sequences <= param_end;
                                 // NOTE: the latter condition never hold, if I properly implemented.
@@ -1413,7 +3727,7 @@ void do_extract(int argc, char** argv)
                             if(param_end < number_of_sequences) // NOTE: param_end is 0-origin, number_of_sequences is 1-origin.
                                 break;
                             if(current_read_has_been_taken) cout << f.b << endl;
-                            if(flag_output_unique) readNamesToTake.insert(get_read_name_from_header(f.b));
+                            if(flag_output_unique) readNamesToTake.insertNameInHeader(f.b);
                         } else {
                             const size_t number_of_nucleotides_in_line = f.len();
                             number_of_nucleotides += number_of_nucleotides_in_line;
@@ -1425,31 +3739,70 @@ void do_extract(int argc, char** argv)
             }
         }
     }
+    readNamesToTake.reportPrefilterStatistics(cerr);
 }
 
-void do_convert_qv_type(int argc, char** argv)
+// A read in the partitions spilled by dedup.
+struct DedupEntry
 {
-    int param_from_base = 64;
-    int param_to_base = 33;
-    int param_out_qv_min = 0;
-    int param_out_qv_max = 40;
-    int param_in_qv_min = -5;
-    int param_in_qv_max = 99;
+    uint64_t hash[2];
+    uint64_t readNumber;
+    double meanQV;
+};
+
+// Sorts the reads with the same content together, the one to keep first.
+struct DedupEntryOrder
+{
+    bool keepBestQV;
+    DedupEntryOrder(bool keepBestQV) : keepBestQV(keepBestQV) {}
+    bool operator()(const DedupEntry& a, const DedupEntry& b) const {
+        if(a.hash[0] != b.hash[0]) return a.hash[0] < b.hash[0];
+        if(a.hash[1] != b.hash[1]) return a.hash[1] < b.hash[1];
+        if(keepBestQV && a.meanQV != b.meanQV) return a.meanQV > b.meanQV;
+        return a.readNumber < b.readNumber;
+    }
+};
+
+// Hashes the content of the reads in the batch on a worker thread.
+// values gets the 128-bit hash and the mean QV (as the bits of a double) of each read.
+static void hash_reads_for_dedup(RecordBatch& batch, bool include_qv, bool compute_mean_qv)
+{
+    batch.values.resize(batch.numberOfRecords * 3u);
+    for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+        const FastxRecord& r = batch.records[i];
+        uint64_t* v = &batch.values[i * 3u];
+        hash_sequence_128(r.sequence.data(), r.sequence.size(), v);
+        if(include_qv) {
+            uint64_t h[2];
+            hash_sequence_128(r.qv.data(), r.qv.size(), h);
+            v[0] = mix64(v[0] ^ h[1]) + h[0];
+            v[1] = mix64(v[1] + h[0]) ^ h[1];
+        }
+        double mean_qv = 0;
+        if(compute_mean_qv && !r.qv.empty()) {
+            // The offset of QVs does not change the order of the means.
+            unsigned long long sum = 0;
+            for(size_t j = 0; j < r.qv.size(); ++j) sum += static_cast<unsigned char>(r.qv[j]);
+            mean_qv = double(sum) / r.qv.size();
+        }
+        memcpy(&v[2], &mean_qv, sizeof(mean_qv));
+    }
+}
+
+void do_dedup(int argc, char** argv)
+{
+    bool flag_include_qv = false;
+    bool flag_keep_best_qv = false;
+    int param_threads = 1;
+    long long param_memory_mib = 0;
+    string param_temporary_directory = get_temporary_directory();
 
     static struct option long_options[] = {
-        {"fromsanger",   no_argument, 0, 's'},
-        {"fromsolexa",   no_argument, 0, 'x'},
-        {"fromillumina", no_argument, 0, 'i'},
-        {"toillumina13", no_argument, 0, '3'},
-        {"toillumina15", no_argument, 0, '5'},
-        {"toillumina18", no_argument, 0, '8'},
-        {"tosanger",     no_argument, 0, 'q'},
-    	{"frombase", required_argument, 0, 'f'},
-    	{"tobase", required_argument, 0, 't'},
-    	{"min", required_argument, 0, 'a'},
-    	{"max", required_argument, 0, 'b'},
-    	{"inmin", required_argument, 0, 'c'},
-    	{"inmax", required_argument, 0, 'd'},
+        {"qv", no_argument, 0, 'q'},
+        {"best", no_argument, 0, 'b'},
+    	{"threads", required_argument, 0, 't'},
+    	{"memory", required_argument, 0, 'm'},
+    	{"tmpdir", required_argument, 0, 'T'},
         {0, 0, 0, 0} // end of long options
     };
 
@@ -1461,120 +3814,2256 @@ void do_convert_qv_type(int argc, char** argv)
 		case 0:
 			// you can see long_options[option_index].name/flag and optarg (null if no argument).
 			break;
-		case 'a':
-            param_out_qv_min = atoi(optarg);
+		case 'q':
+			flag_include_qv = true;
 			break;
-        case 'b':
-            param_out_qv_max = atoi(optarg);
-            break;
-		case 'c':
-            param_in_qv_min = atoi(optarg);
+		case 'b':
+			flag_keep_best_qv = true;
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		case 'm':
+			param_memory_mib = atoll(optarg);
+			break;
+		case 'T':
+			param_temporary_directory = optarg;
 			break;
-        case 'd':
-            param_in_qv_max = atoi(optarg);
-            break;
-        case 'f':
-            param_from_base = atoi(optarg);
-            break;
-        case 't':
-            param_to_base = atoi(optarg);
-            break;
-        case 's':
-            param_from_base = 33;
-            break;
-        case 'i':
-            param_from_base = 64;
-            break;
-        case 'x':
-            param_from_base = 64;
-            param_in_qv_min = -5;
-            param_in_qv_max = 40;
-            break;
-        case '3':
-            param_to_base = 64;
-            param_out_qv_min = 0;
-            param_out_qv_max = 40;
-            break;
-        case '5':
-            param_to_base = 64;
-            param_out_qv_min = 3;
-            param_out_qv_max = 40;
-            break;
-        case '8':
-            param_to_base = 33;
-            param_out_qv_min = 0;
-            param_out_qv_max = 40;
-            break;
-        case 'q':
-            param_to_base = 33;
-            param_out_qv_min = 0;
-            param_out_qv_max = 40;
-            break;
 		}
 	}
-	if(param_in_qv_max < param_in_qv_min) {
-		cerr << "ERROR: Input QV range [" << param_in_qv_min << ", " << param_in_qv_max << ") is empty." << endl;
+	if(param_threads < 1) {
+		cerr << "ERROR: --threads must be positive" << endl;
 		return;
 	}
-	if(param_out_qv_max < param_out_qv_min) {
-		cerr << "ERROR: Output QV range [" << param_out_qv_min << ", " << param_out_qv_max << ") is empty." << endl;
+	if(param_memory_mib < 0) {
+		cerr << "ERROR: --memory takes a size in MiB" << endl;
 		return;
 	}
-    cerr << "QV [" << param_in_qv_min << ", " << param_in_qv_max << "):base" << param_from_base << " ==> "
-            "QV [" << param_out_qv_min << ", " << param_out_qv_max << "):base" << param_to_base << endl;
-    for(int findex = optind + 1; findex < argc; ++findex) {
-        const char* file_name = argv[findex];
-        FileLineBufferWithAutoExpansion f;
-        if(!f.open(file_name)) {
-            cerr << "Cannot open '" << file_name << "'" << endl;
-            continue;
+    const vector<const char*> file_names(argv + optind + 1, argv + argc);
+    ParallelRecordScanner scanner(param_threads);
+    const ParallelRecordScanner::BatchFunction hash_batch = [&](RecordBatch& batch) {
+        hash_reads_for_dedup(batch, flag_include_qv, flag_keep_best_qv);
+    };
+    // Both modes keep an entry per read (per unique read without --best), so
+    // large inputs are spilled in partitions unless a larger budget is given.
+    const long long DEFAULT_MEMORY_MIB = 1024;
+    if(param_memory_mib == 0) param_memory_mib = DEFAULT_MEMORY_MIB;
+    // Assume at least 32 bytes per read, which is on the safe side for FASTQ.
+    // Only regular files have a size to estimate from.
+    unsigned long long total_size = 0;
+    bool all_inputs_are_regular = true;
+    for(size_t i = 0; i < file_names.size(); ++i) {
+        struct stat s;
+        if(stat(file_names[i], &s) == 0 && S_ISREG(s.st_mode)) total_size += s.st_size;
+        else all_inputs_are_regular = false;
+    }
+    size_t number_of_partitions = 1;
+    const double estimated_bytes = total_size / 32.0 * sizeof(DedupEntry) * 1.5;
+    const double budget = param_memory_mib * 1024.0 * 1024.0;
+    if(budget < estimated_bytes) {
+        number_of_partitions = std::min<size_t>(256u, static_cast<size_t>(ceil(estimated_bytes / budget)));
+    }
+    // The spill path reads the input again to copy it, which a pipe cannot do.
+    if(!all_inputs_are_regular) {
+        if(flag_keep_best_qv || 1 < number_of_partitions) {
+            cerr << "ERROR: --best and inputs larger than --memory need regular files, as they are read twice" << endl;
+            exit(1);
         }
-        if(f.getline()) {
-            size_t number_of_nucleotides_in_read = 0;
-            if(!f.looksLikeFASTQHeader()) { 
-                cerr << "ERROR: the input file '" << file_name << "' does not seem to be a FASTQ file at line " << f.getLineCount() << endl;
-                return;
+        cerr << "WARNING: the size of a non-regular input is unknown, so --memory cannot be applied to it" << endl;
+    }
+
+    // Keeping the first occurrence in memory needs only one pass.
+    if(!flag_keep_best_qv && number_of_partitions == 1) {
+        ReadNameFingerprintSet hashes(128, false);
+        uint64_t number_of_reads = 0;
+        scanner.run(file_names, hash_batch, [&](RecordBatch& batch) {
+            for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+                const uint64_t* v = &batch.values[i * 3u];
+                uint64_t fp[2] = { v[0] == 0 ? 1u : v[0], v[1] };
+                if(hashes.insert(fp, NULL, 0, 0)) cout << batch.records[i].text;
             }
-            cout << f.b << "\n";
-            while(f.getline()) {
-                if(f.looksLikeFASTQSeparator()) {
-                    cout << f.b << "\n";
-                    long long n = number_of_nucleotides_in_read;
-                    while(f.getline()) {
-                        const size_t number_of_qvchars_in_line = f.len();
-                        for(unsigned char* p = reinterpret_cast<unsigned char*>(f.b); *p; ++p) {
-                            int qv = *p - param_from_base;
-                            if(qv < param_in_qv_min || param_in_qv_max < qv) {
-                                cerr << "ERROR: the input file '" << file_name << "' contains an invalid QV (" << qv << "; chr = '" << *p << "'; ord = '" << int(*p) << "') at line " << f.getLineCount() << endl;
-                                return;
-                            }
-                            if(param_out_qv_max < qv) qv = param_out_qv_max;
-                            if(qv < param_out_qv_min) qv = param_out_qv_min;
-                            *p = param_to_base + qv;
-                        }
-                        cout << f.b << '\n';
-                        n -= number_of_qvchars_in_line;
-                        if(n <= 0) break;
-                    }
-                    f.expectHeaderOfEOF();
-                    number_of_nucleotides_in_read = 0;
-                    if(!f.getline()) break;
-                    f.registerHeaderLine();
-                    cout << f.b << "\n";
+            number_of_reads += batch.numberOfRecords;
+        });
+        cerr << sep_comma(number_of_reads) << " reads, " << sep_comma(number_of_reads - hashes.size()) << " duplicates removed\n";
+        return;
+    }
+
+    // Otherwise, pass 1 spills (hash, read number, mean QV) into partitions by hash,
+    // pass 2 sorts each partition to find the reads to drop, and pass 3 copies the rest.
+    vector<FILE*> partitions;
+    vector<FILE*> duplicates;
+    bool succeeded = true;
+    for(size_t i = 0; i < number_of_partitions && succeeded; ++i) {
+        partitions.push_back(create_anonymous_temporary_file(param_temporary_directory));
+        duplicates.push_back(create_anonymous_temporary_file(param_temporary_directory));
+        if(partitions.back() == NULL || duplicates.back() == NULL) {
+            cerr << "ERROR: cannot create a temporary file in '" << param_temporary_directory << "'" << endl;
+            succeeded = false;
+        }
+    }
+    if(succeeded) {
+        scanner.run(file_names, hash_batch, [&](RecordBatch& batch) {
+            for(size_t i = 0; i < batch.numberOfRecords && succeeded; ++i) {
+                DedupEntry e;
+                e.hash[0] = batch.values[i * 3u];
+                e.hash[1] = batch.values[i * 3u + 1u];
+                e.readNumber = batch.firstRecordNumber + i;
+                memcpy(&e.meanQV, &batch.values[i * 3u + 2u], sizeof(e.meanQV));
+                const size_t partition = ((e.hash[0] & 0xFFFFFFFFu) * number_of_partitions) >> 32;
+                if(fwrite(&e, sizeof(e), 1u, partitions[partition]) != 1u) {
+                    cerr << "ERROR: cannot write to a temporary file in '" << param_temporary_directory << "'" << endl;
+                    succeeded = false;
+                }
+            }
+        });
+    }
+    uint64_t number_of_duplicates = 0;
+    for(size_t i = 0; i < number_of_partitions && succeeded; ++i) {
+        vector<DedupEntry> entries;
+        FILE* fp = partitions[i];
+        if(fflush(fp) != 0 || fseek(fp, 0, SEEK_END) != 0) {
+            succeeded = false;
+            break;
+        }
+        entries.resize(ftell(fp) / sizeof(DedupEntry));
+        fseek(fp, 0, SEEK_SET);
+        if(!entries.empty() && fread(&entries[0], sizeof(DedupEntry), entries.size(), fp) != entries.size()) {
+            cerr << "ERROR: cannot read a temporary file in '" << param_temporary_directory << "'" << endl;
+            succeeded = false;
+            break;
+        }
+        fclose(fp);
+        partitions[i] = NULL;
+        sort(entries.begin(), entries.end(), DedupEntryOrder(flag_keep_best_qv));
+        vector<uint64_t> drop;
+        for(size_t j = 1; j < entries.size(); ++j) {
+            if(entries[j].hash[0] == entries[j - 1].hash[0] && entries[j].hash[1] == entries[j - 1].hash[1]) drop.push_back(entries[j].readNumber);
+        }
+        sort(drop.begin(), drop.end());
+        number_of_duplicates += drop.size();
+        if(!drop.empty() && fwrite(&drop[0], sizeof(uint64_t), drop.size(), duplicates[i]) != drop.size()) {
+            cerr << "ERROR: cannot write to a temporary file in '" << param_temporary_directory << "'" << endl;
+            succeeded = false;
+        }
+    }
+    uint64_t number_of_reads = 0;
+    if(succeeded && copy_records_skipping_read_numbers(file_names, duplicates, number_of_reads)) {
+        cerr << sep_comma(number_of_reads) << " reads, " << sep_comma(number_of_duplicates) << " duplicates removed";
+        if(1 < number_of_partitions) cerr << " (" << number_of_partitions << " partitions)";
+        cerr << "\n";
+    }
+    for(size_t i = 0; i < number_of_partitions; ++i) {
+        if(i < partitions.size() && partitions[i] != NULL) fclose(partitions[i]);
+        if(i < duplicates.size() && duplicates[i] != NULL) fclose(duplicates[i]);
+    }
+}
+
+char complement_char(char c);
+
+// An Aho-Corasick automaton that finds many nucleotide patterns in a sequence
+// in one pass. The alphabet is A, C, G and T (case-insensitive, U is T); any
+// other character in a sequence matches nothing. IUPAC codes in the patterns
+// are expanded into concrete patterns, and reverse complements can be added
+// to search both strands.
+// While the automaton is at the root, the search jumps to the next byte that
+// can start a pattern, testing 16 bytes at a time with SSE2. This helps only
+// when the patterns start with a few different bytes; otherwise it is off.
+class NucleotideMotifMatcher
+{
+public:
+    struct Match {
+        size_t patternIndex;
+        size_t start;       ///< 0-origin, inclusive, on the given strand
+        size_t end;         ///< exclusive
+        bool reverseStrand; ///< the reverse complement of the pattern matched
+    };
+
+private:
+    static const size_t MAX_EXPANSIONS_PER_PATTERN = 1u << 16;
+    struct Output {
+        int32_t patternIndex;
+        int32_t length;
+        bool reverseStrand;
+        int32_t next; ///< the next output of the same state, or -1
+    };
+    vector<int32_t> transitions; // [state * 4 + code]
+    vector<int32_t> outputHead;  // the first output of the state, or -1
+    vector<int32_t> dictionaryLink; // the nearest state on the failure chain with outputs, or -1
+    vector<Output> outputs;
+    vector<string> patternNames;
+    unsigned char codeOfChar[256]; // 0-3 for ACGT, 4 for the others
+    bool canStartPattern[256];
+    vector<unsigned char> firstBytes;
+    bool usePrefilter;
+
+    static const char* iupacBases(char c) {
+        switch(toupper(c)) {
+            case 'A': return "A";
+            case 'C': return "C";
+            case 'G': return "G";
+            case 'T': case 'U': return "T";
+            case 'R': return "AG";
+            case 'Y': return "CT";
+            case 'S': return "CG";
+            case 'W': return "AT";
+            case 'K': return "GT";
+            case 'M': return "AC";
+            case 'B': return "CGT";
+            case 'D': return "AGT";
+            case 'H': return "ACT";
+            case 'V': return "ACG";
+            case 'N': return "ACGT";
+        }
+        return NULL;
+    }
+    int32_t newState() {
+        transitions.resize(transitions.size() + 4u, -1);
+        outputHead.push_back(-1);
+        dictionaryLink.push_back(-1);
+        return static_cast<int32_t>(outputHead.size() - 1u);
+    }
+    void insert(const string& pattern, size_t patternIndex, bool reverseStrand) {
+        int32_t state = 0;
+        for(size_t i = 0; i < pattern.size(); ++i) {
+            const int c = codeOfChar[static_cast<unsigned char>(pattern[i])];
+            if(transitions[state * 4 + c] < 0) {
+                const int32_t s = newState();
+                transitions[state * 4 + c] = s;
+            }
+            state = transitions[state * 4 + c];
+        }
+        Output o;
+        o.patternIndex = static_cast<int32_t>(patternIndex);
+        o.length = static_cast<int32_t>(pattern.size());
+        o.reverseStrand = reverseStrand;
+        o.next = outputHead[state];
+        outputHead[state] = static_cast<int32_t>(outputs.size());
+        outputs.push_back(o);
+        // Every byte read as the first base can start it (e.g. 't', 'U' and 'u' for 'T');
+        // IUPAC codes are already expanded.
+        const int first = codeOfChar[static_cast<unsigned char>(pattern[0])];
+        for(int c = 0; c < 256; ++c) {
+            if(codeOfChar[c] != first || canStartPattern[c]) continue;
+            canStartPattern[c] = true;
+            firstBytes.push_back(c);
+        }
+    }
+    // Expands IUPAC codes and inserts every concrete pattern.
+    bool insertExpanded(const string& pattern, size_t patternIndex, bool reverseStrand, string& error) {
+        size_t number_of_expansions = 1;
+        for(size_t i = 0; i < pattern.size(); ++i) {
+            number_of_expansions *= strlen(iupacBases(pattern[i]));
+            if(MAX_EXPANSIONS_PER_PATTERN < number_of_expansions) {
+                error = "too many combinations of IUPAC codes in '" + pattern + "'";
+                return false;
+            }
+        }
+        string concrete(pattern.size(), 'A');
+        for(size_t e = 0; e < number_of_expansions; ++e) {
+            size_t rest = e;
+            for(size_t i = 0; i < pattern.size(); ++i) {
+                const char* bases = iupacBases(pattern[i]);
+                const size_t n = strlen(bases);
+                concrete[i] = bases[rest % n];
+                rest /= n;
+            }
+            insert(concrete, patternIndex, reverseStrand);
+        }
+        return true;
+    }
+
+public:
+    NucleotideMotifMatcher() : usePrefilter(false) {
+        for(int c = 0; c < 256; ++c) {
+            codeOfChar[c] = 4;
+            canStartPattern[c] = false;
+        }
+        codeOfChar['A'] = codeOfChar['a'] = 0;
+        codeOfChar['C'] = codeOfChar['c'] = 1;
+        codeOfChar['G'] = codeOfChar['g'] = 2;
+        codeOfChar['T'] = codeOfChar['t'] = 3;
+        codeOfChar['U'] = codeOfChar['u'] = 3;
+        newState();
+    }
+    size_t getNumberOfPatterns() const { return patternNames.size(); }
+    const string& getPatternName(size_t i) const { return patternNames[i]; }
+    size_t getNumberOfStates() const { return outputHead.size(); }
+    // Returns false with a message in error if the pattern is invalid.
+    bool addPattern(const string& name, const string& pattern, bool allowIUPAC, bool bothStrands, string& error) {
+        if(pattern.empty()) {
+            error = "an empty pattern";
+            return false;
+        }
+        for(size_t i = 0; i < pattern.size(); ++i) {
+            const char* bases = iupacBases(pattern[i]);
+            if(bases == NULL || (!allowIUPAC && 1u < strlen(bases))) {
+                error = "invalid character '" + string(1, pattern[i]) + "' in pattern '" + pattern + "'" + (allowIUPAC ? "" : " (give --iupac for IUPAC codes)");
+                return false;
+            }
+        }
+        const size_t patternIndex = patternNames.size();
+        patternNames.push_back(name);
+        if(!insertExpanded(pattern, patternIndex, false, error)) return false;
+        if(bothStrands) {
+            string rc(pattern.rbegin(), pattern.rend());
+            for(size_t i = 0; i < rc.size(); ++i) rc[i] = toupper(complement_char(toupper(rc[i]) == 'U' ? 'T' : toupper(rc[i])));
+            string upper(pattern);
+            for(size_t i = 0; i < upper.size(); ++i) upper[i] = toupper(upper[i]) == 'U' ? 'T' : toupper(upper[i]);
+            // A palindromic pattern would match twice at the same place.
+            if(rc != upper && !insertExpanded(rc, patternIndex, true, error)) return false;
+        }
+        return true;
+    }
+    // Must be called after adding the patterns and before searching.
+    void compile() {
+        // Breadth-first, so that the failure state of a state is done before it.
+        vector<int32_t> failure(outputHead.size(), 0);
+        deque<int32_t> queue;
+        for(int c = 0; c < 4; ++c) {
+            int32_t& t = transitions[c];
+            if(t < 0) {
+                t = 0;
+            } else {
+                failure[t] = 0;
+                queue.push_back(t);
+            }
+        }
+        while(!queue.empty()) {
+            const int32_t state = queue.front();
+            queue.pop_front();
+            const int32_t f = failure[state];
+            dictionaryLink[state] = outputHead[f] != -1 ? f : dictionaryLink[f];
+            for(int c = 0; c < 4; ++c) {
+                int32_t& t = transitions[state * 4 + c];
+                if(t < 0) {
+                    t = transitions[f * 4 + c];
                 } else {
-                    const size_t number_of_nucleotides_in_line = f.len();
-                    number_of_nucleotides_in_read += number_of_nucleotides_in_line;
-                    cout << f.b << "\n";
+                    failure[t] = transitions[f * 4 + c];
+                    queue.push_back(t);
+                }
+            }
+        }
+        usePrefilter = firstBytes.size() < 8u;
+    }
+    // Appends the matches in the sequence to matches, in the order of their ends.
+    // Stops at the first match if firstOnly.
+    void search(const char* seq, size_t length, vector<Match>& matches, bool firstOnly) const {
+        int32_t state = 0;
+        size_t i = 0;
+        while(i < length) {
+            if(state == 0 && usePrefilter) {
+                i = findNextCandidate(seq, i, length);
+                if(length <= i) break;
+            }
+            const unsigned char c = codeOfChar[static_cast<unsigned char>(seq[i])];
+            state = c < 4 ? transitions[state * 4 + c] : 0;
+            ++i;
+            for(int32_t s = outputHead[state] != -1 ? state : dictionaryLink[state]; s != -1; s = dictionaryLink[s]) {
+                for(int32_t o = outputHead[s]; o != -1; o = outputs[o].next) {
+                    Match m;
+                    m.patternIndex = outputs[o].patternIndex;
+                    m.start = i - outputs[o].length;
+                    m.end = i;
+                    m.reverseStrand = outputs[o].reverseStrand;
+                    matches.push_back(m);
+                    if(firstOnly) return;
                 }
             }
         }
     }
+
+private:
+    size_t findNextCandidate(const char* seq, size_t i, size_t length) const {
+#ifdef __SSE2__
+        while(i + 16u <= length) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(seq + i));
+            __m128i hit = _mm_setzero_si128();
+            for(size_t j = 0; j < firstBytes.size(); ++j) {
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8(firstBytes[j])));
+            }
+            const int mask = _mm_movemask_epi8(hit);
+            if(mask != 0) return i + __builtin_ctz(mask);
+            i += 16u;
+        }
+#endif
+        while(i < length && !canStartPattern[static_cast<unsigned char>(seq[i])]) ++i;
+        return i;
+    }
+};
+
+// Reads patterns from a file: one pattern per line, or FASTA (the names are used in the output).
+static bool load_motif_patterns(const char* file_name, vector<pair<string, string> >& patterns)
+{
+    ifstream ist(file_name);
+    if(!ist) return false;
+    string line;
+    string name;
+    bool is_fasta = false;
+    while(getline(ist, line)) {
+        if(!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+        if(!line.empty() && line[0] == '>') {
+            is_fasta = true;
+            name = get_read_name_from_header(line.c_str());
+            patterns.push_back(make_pair(name, string()));
+            continue;
+        }
+        if(line.empty()) continue;
+        if(is_fasta && !patterns.empty()) patterns.back().second += line;
+        else patterns.push_back(make_pair(line, line));
+    }
+    return true;
 }
 
-void do_guess_qv_type(int argc, char** argv)
+void do_search(int argc, char** argv)
 {
-    for(int findex = 2; findex < argc; ++findex) {
-        const char* file_name = argv[findex];
+    bool flag_both_strands = false;
+    bool flag_iupac = false;
+    bool flag_output_coordinates = false;
+    bool flag_invert = false;
+    int param_threads = 1;
+    vector<pair<string, string> > patterns;
+
+    static struct option long_options[] = {
+        {"pattern", required_argument, 0, 'p'},
+        {"patterns", required_argument, 0, 'f'},
+        {"bothstrands", no_argument, 0, 'b'},
+        {"iupac", no_argument, 0, 'i'},
+        {"coords", no_argument, 0, 'c'},
+        {"invert", no_argument, 0, 'v'},
+    	{"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0} // end of long options
+    };
+
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'p':
+			patterns.push_back(make_pair(string(optarg), string(optarg)));
+			break;
+		case 'f':
+			if(!load_motif_patterns(optarg, patterns)) {
+				cerr << "ERROR: Cannot open '" << optarg << "'" << endl;
+				return;
+			}
+			break;
+		case 'b':
+			flag_both_strands = true;
+			break;
+		case 'i':
+			flag_iupac = true;
+			break;
+		case 'c':
+			flag_output_coordinates = true;
+			break;
+		case 'v':
+			flag_invert = true;
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		}
+	}
+	if(param_threads < 1) {
+		cerr << "ERROR: --threads must be positive" << endl;
+		return;
+	}
+	if(patterns.empty()) {
+		cerr << "ERROR: give patterns by --pattern or --patterns" << endl;
+		return;
+	}
+	if(flag_output_coordinates && flag_invert) {
+		cerr << "ERROR: do not specify --coords and --invert at once" << endl;
+		return;
+	}
+    NucleotideMotifMatcher matcher;
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        string error;
+        if(!matcher.addPattern(patterns[i].first, patterns[i].second, flag_iupac, flag_both_strands, error)) {
+            cerr << "ERROR: " << error << endl;
+            return;
+        }
+    }
+    matcher.compile();
+    const vector<const char*> file_names(argv + optind + 1, argv + argc);
+    ParallelRecordScanner scanner(param_threads);
+    scanner.run(file_names, [&](RecordBatch& batch) {
+        vector<NucleotideMotifMatcher::Match> matches;
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            const FastxRecord& r = batch.records[i];
+            matches.clear();
+            matcher.search(r.sequence.data(), r.sequence.size(), matches, !flag_output_coordinates);
+            if(!flag_output_coordinates) {
+                if(matches.empty() == flag_invert) batch.output += r.text;
+                continue;
+            }
+            size_t length;
+            const char* name = r.name(length);
+            for(size_t j = 0; j < matches.size(); ++j) {
+                const NucleotideMotifMatcher::Match& m = matches[j];
+                char buf[64];
+                batch.output.append(name, length);
+                batch.output += '\t';
+                batch.output += matcher.getPatternName(m.patternIndex);
+                snprintf(buf, sizeof(buf), "\t%c\t%zu\t%zu\n", m.reverseStrand ? '-' : '+', m.start, m.end);
+                batch.output += buf;
+            }
+        }
+    }, [&](RecordBatch& batch) {
+        cout << batch.output;
+    });
+}
+
+// Sums the bytes, 16 at a time with SSE2 (PSADBW).
+static unsigned long long sum_of_bytes(const char* p, size_t length)
+{
+    unsigned long long sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 16u <= length; i += 16u) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for(; i < length; ++i) sum += static_cast<unsigned char>(p[i]);
+    return sum;
+}
+
+// What a filter expression looks at for one record. The metrics are
+// computed only if the expression uses them.
+struct FilterContext
+{
+    const FastxRecord* record;
+    double gcFraction;
+    double nFraction;
+    double meanQV;
+};
+
+// A node of a compiled filter expression. A node has one of three types and
+// implements the evaluation for its type.
+class FilterNode
+{
+public:
+    enum Type { NUMBER, STRING, BOOLEAN };
+    typedef pair<const char*, size_t> StringView;
+    Type type;
+    FilterNode(Type type) : type(type) {}
+    virtual ~FilterNode() {}
+    virtual double number(const FilterContext&) const { return 0; }
+    virtual StringView text(const FilterContext&) const { return StringView("", 0); }
+    virtual bool truth(const FilterContext&) const { return false; }
+};
+
+class FilterNumberLiteral : public FilterNode
+{
+    double value;
+public:
+    FilterNumberLiteral(double value) : FilterNode(NUMBER), value(value) {}
+    double number(const FilterContext&) const { return value; }
+};
+
+class FilterStringLiteral : public FilterNode
+{
+    string value;
+public:
+    FilterStringLiteral(const string& value) : FilterNode(STRING), value(value) {}
+    StringView text(const FilterContext&) const { return StringView(value.data(), value.size()); }
+};
+
+class FilterMetric : public FilterNode
+{
+public:
+    enum Metric { LENGTH, GC, N, QV };
+private:
+    Metric metric;
+public:
+    FilterMetric(Metric metric) : FilterNode(NUMBER), metric(metric) {}
+    double number(const FilterContext& ctx) const {
+        switch(metric) {
+            case LENGTH: return static_cast<double>(ctx.record->sequence.size());
+            case GC: return ctx.gcFraction;
+            case N: return ctx.nFraction;
+            case QV: return ctx.meanQV;
+        }
+        return 0;
+    }
+};
+
+// name, desc, field(k) (the k-th space-separated field of desc, 1-origin),
+// and tag("key") (the value of key=value in desc).
+class FilterHeaderPart : public FilterNode
+{
+public:
+    enum Part { NAME, DESCRIPTION, FIELD, TAG };
+private:
+    Part part;
+    size_t fieldIndex;
+    string key;
+public:
+    FilterHeaderPart(Part part, size_t fieldIndex = 0, const string& key = "") : FilterNode(STRING), part(part), fieldIndex(fieldIndex), key(key) {}
+    StringView text(const FilterContext& ctx) const {
+        size_t length;
+        const char* name = ctx.record->name(length);
+        if(part == NAME) return StringView(name, length);
+        const char* header_end = ctx.record->header.data() + ctx.record->header.size();
+        const char* desc = name + length;
+        while(desc < header_end && *desc == ' ') ++desc;
+        if(part == DESCRIPTION) return StringView(desc, header_end - desc);
+        size_t k = 0;
+        const char* p = desc;
+        while(p < header_end) {
+            while(p < header_end && (*p == ' ' || *p == '\t')) ++p;
+            const char* start = p;
+            while(p < header_end && *p != ' ' && *p != '\t') ++p;
+            if(start == p) break;
+            ++k;
+            if(part == FIELD && k == fieldIndex) return StringView(start, p - start);
+            if(part == TAG && key.size() < static_cast<size_t>(p - start) && memcmp(start, key.data(), key.size()) == 0 && start[key.size()] == '=') {
+                return StringView(start + key.size() + 1u, p - start - key.size() - 1u);
+            }
+        }
+        return StringView("", 0);
+    }
+};
+
+class FilterComparison : public FilterNode
+{
+public:
+    enum Operator { EQ, NE, LT, LE, GT, GE };
+private:
+    Operator op;
+    FilterNode* lhs;
+    FilterNode* rhs;
+    template<class T> bool compare(const T& a, const T& b) const {
+        switch(op) {
+            case EQ: return a == b;
+            case NE: return a != b;
+            case LT: return a < b;
+            case LE: return a <= b;
+            case GT: return a > b;
+            case GE: return a >= b;
+        }
+        return false;
+    }
+public:
+    FilterComparison(Operator op, FilterNode* lhs, FilterNode* rhs) : FilterNode(BOOLEAN), op(op), lhs(lhs), rhs(rhs) {}
+    ~FilterComparison() { delete lhs; delete rhs; }
+    bool truth(const FilterContext& ctx) const {
+        if(lhs->type == NUMBER) return compare(lhs->number(ctx), rhs->number(ctx));
+        const StringView a = lhs->text(ctx);
+        const StringView b = rhs->text(ctx);
+        return compare(compare_names(a.first, a.second, b.first, b.second), 0);
+    }
+};
+
+// lhs ~ /regex/ (POSIX extended regular expressions, matching anywhere).
+class FilterRegexMatch : public FilterNode
+{
+    FilterNode* lhs;
+    regex_t re;
+    bool negated;
+    bool compiled;
+public:
+    FilterRegexMatch(FilterNode* lhs, bool negated) : FilterNode(BOOLEAN), lhs(lhs), negated(negated), compiled(false) {}
+    ~FilterRegexMatch() {
+        delete lhs;
+        if(compiled) regfree(&re);
+    }
+    // Returns an error message, or an empty string.
+    string compile(const string& pattern) {
+        const int ret = regcomp(&re, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+        compiled = ret == 0;
+        if(ret == 0) return "";
+        char buf[256];
+        regerror(ret, &re, buf, sizeof(buf));
+        return buf;
+    }
+    bool truth(const FilterContext& ctx) const {
+        const StringView s = lhs->text(ctx);
+        // REG_STARTEND matches a string that is not NUL-terminated.
+        regmatch_t range;
+        range.rm_so = 0;
+        range.rm_eo = s.second;
+        return (regexec(&re, s.first, 1, &range, REG_STARTEND) == 0) != negated;
+    }
+};
+
+class FilterLogical : public FilterNode
+{
+public:
+    enum Operator { AND, OR, NOT };
+private:
+    Operator op;
+    FilterNode* lhs;
+    FilterNode* rhs; // NULL for NOT
+public:
+    FilterLogical(Operator op, FilterNode* lhs, FilterNode* rhs) : FilterNode(BOOLEAN), op(op), lhs(lhs), rhs(rhs) {}
+    ~FilterLogical() { delete lhs; delete rhs; }
+    bool truth(const FilterContext& ctx) const {
+        switch(op) {
+            case AND: return lhs->truth(ctx) && rhs->truth(ctx);
+            case OR: return lhs->truth(ctx) || rhs->truth(ctx);
+            case NOT: return !lhs->truth(ctx);
+        }
+        return false;
+    }
+};
+
+// Compiles a filter expression into a tree of FilterNodes by recursive descent.
+//   expr       := and ('||' and)*
+//   and        := unary ('&&' unary)*
+//   unary      := '!' unary | comparison
+//   comparison := primary (('==' | '!=' | '<' | '<=' | '>' | '>=') primary | ('~' | '!~') (/regex/ | "regex"))?
+//   primary    := number | "string" | '(' expr ')' | len | gc | nfrac | qv | name | desc | field(k) | tag("key")
+class FilterExpressionCompiler
+{
+    const string& src;
+    size_t pos;
+    string error;
+    size_t errorPos;
+    bool usesGC;
+    bool usesN;
+    bool usesQV;
+
+    void skipSpaces() { while(pos < src.size() && isspace(static_cast<unsigned char>(src[pos]))) ++pos; }
+    bool accept(const char* token) {
+        skipSpaces();
+        const size_t n = strlen(token);
+        if(src.compare(pos, n, token) != 0) return false;
+        pos += n;
+        return true;
+    }
+    FilterNode* fail(const string& message, FilterNode* garbage = NULL, FilterNode* garbage2 = NULL) {
+        delete garbage;
+        delete garbage2;
+        if(error.empty()) {
+            error = message;
+            errorPos = pos;
+        }
+        return NULL;
+    }
+    bool readQuoted(char quote, string& value) {
+        // The opening quote has been consumed. A backslash escapes the quote.
+        value.clear();
+        while(pos < src.size() && src[pos] != quote) {
+            if(src[pos] == '\\' && pos + 1u < src.size() && src[pos + 1u] == quote) ++pos;
+            value += src[pos++];
+        }
+        if(pos == src.size()) return false;
+        ++pos;
+        return true;
+    }
+    FilterNode* parseOr() {
+        FilterNode* lhs = parseAnd();
+        while(lhs != NULL && accept("||")) {
+            FilterNode* rhs = parseAnd();
+            if(rhs == NULL) return fail("", lhs);
+            lhs = new FilterLogical(FilterLogical::OR, lhs, rhs);
+        }
+        return lhs;
+    }
+    FilterNode* parseAnd() {
+        FilterNode* lhs = parseUnary();
+        while(lhs != NULL && accept("&&")) {
+            FilterNode* rhs = parseUnary();
+            if(rhs == NULL) return fail("", lhs);
+            lhs = new FilterLogical(FilterLogical::AND, lhs, rhs);
+        }
+        return lhs;
+    }
+    FilterNode* parseUnary() {
+        skipSpaces();
+        if(src.compare(pos, 2, "!=") != 0 && src.compare(pos, 2, "!~") != 0 && accept("!")) {
+            FilterNode* operand = parseUnary();
+            if(operand == NULL) return NULL;
+            if(operand->type != FilterNode::BOOLEAN) return fail("'!' needs a condition", operand);
+            return new FilterLogical(FilterLogical::NOT, operand, NULL);
+        }
+        return parseComparison();
+    }
+    FilterNode* parseComparison() {
+        FilterNode* lhs = parsePrimary();
+        if(lhs == NULL) return NULL;
+        const bool negated_match = accept("!~");
+        if(negated_match || accept("~")) {
+            if(lhs->type != FilterNode::STRING) return fail("'~' needs a string on the left", lhs);
+            skipSpaces();
+            string pattern;
+            if(pos < src.size() && (src[pos] == '/' || src[pos] == '"')) {
+                const char quote = src[pos++];
+                if(!readQuoted(quote, pattern)) return fail("unterminated regular expression", lhs);
+            } else {
+                return fail("'~' needs /regex/ or \"regex\" on the right", lhs);
+            }
+            FilterRegexMatch* node = new FilterRegexMatch(lhs, negated_match);
+            const string message = node->compile(pattern);
+            if(!message.empty()) {
+                delete node;
+                return fail("bad regular expression '" + pattern + "': " + message);
+            }
+            return node;
+        }
+        static const struct { const char* token; FilterComparison::Operator op; } operators[] = {
+            {"==", FilterComparison::EQ}, {"!=", FilterComparison::NE}, {"<=", FilterComparison::LE},
+            {">=", FilterComparison::GE}, {"<", FilterComparison::LT}, {">", FilterComparison::GT}
+        };
+        for(size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i) {
+            if(!accept(operators[i].token)) continue;
+            FilterNode* rhs = parsePrimary();
+            if(rhs == NULL) return fail("", lhs);
+            if(lhs->type == FilterNode::BOOLEAN || lhs->type != rhs->type) return fail("cannot compare a number with a string", lhs, rhs);
+            return new FilterComparison(operators[i].op, lhs, rhs);
+        }
+        return lhs;
+    }
+    FilterNode* parsePrimary() {
+        skipSpaces();
+        if(pos == src.size()) return fail("unexpected end of the expression");
+        const char c = src[pos];
+        if(c == '(') {
+            ++pos;
+            FilterNode* inner = parseOr();
+            if(inner == NULL) return NULL;
+            if(!accept(")")) return fail("')' is expected", inner);
+            return inner;
+        }
+        if(c == '"') {
+            ++pos;
+            string value;
+            if(!readQuoted('"', value)) return fail("unterminated string");
+            return new FilterStringLiteral(value);
+        }
+        if(isdigit(static_cast<unsigned char>(c)) || c == '.' || c == '-') {
+            const char* start = src.c_str() + pos;
+            char* end;
+            const double value = strtod(start, &end);
+            if(end == start) return fail("a number is expected");
+            pos += end - start;
+            return new FilterNumberLiteral(value);
+        }
+        string word;
+        while(pos < src.size() && (isalnum(static_cast<unsigned char>(src[pos])) || src[pos] == '_')) word += src[pos++];
+        if(word == "len") return new FilterMetric(FilterMetric::LENGTH);
+        if(word == "gc") { usesGC = true; return new FilterMetric(FilterMetric::GC); }
+        if(word == "nfrac") { usesN = true; return new FilterMetric(FilterMetric::N); }
+        if(word == "qv") { usesQV = true; return new FilterMetric(FilterMetric::QV); }
+        if(word == "name") return new FilterHeaderPart(FilterHeaderPart::NAME);
+        if(word == "desc") return new FilterHeaderPart(FilterHeaderPart::DESCRIPTION);
+        if(word == "field") {
+            if(!accept("(")) return fail("'(' is expected after field");
+            skipSpaces();
+            const char* start = src.c_str() + pos;
+            char* end;
+            const long k = strtol(start, &end, 10);
+            if(end == start || k < 1) return fail("field() takes a positive number");
+            pos += end - start;
+            if(!accept(")")) return fail("')' is expected");
+            return new FilterHeaderPart(FilterHeaderPart::FIELD, k);
+        }
+        if(word == "tag") {
+            string key;
+            if(!accept("(") || !accept("\"")) return fail("tag() takes a key in double quotes");
+            if(!readQuoted('"', key)) return fail("unterminated string");
+            if(!accept(")")) return fail("')' is expected");
+            return new FilterHeaderPart(FilterHeaderPart::TAG, 0, key);
+        }
+        if(word.empty()) return fail("unexpected character '" + string(1, c) + "'");
+        return fail("unknown name '" + word + "'");
+    }
+
+public:
+    FilterExpressionCompiler(const string& src) : src(src), pos(0), errorPos(0), usesGC(false), usesN(false), usesQV(false) {}
+    // Returns NULL on error; see getError().
+    FilterNode* compile() {
+        FilterNode* root = parseOr();
+        if(root == NULL) return NULL;
+        skipSpaces();
+        if(pos != src.size()) return fail("unexpected '" + src.substr(pos) + "'", root);
+        if(root->type != FilterNode::BOOLEAN) return fail("the expression must be a condition", root);
+        return root;
+    }
+    string getError() const {
+        ostringstream os;
+        os << error << " (at column " << (errorPos + 1) << ")";
+        return os.str();
+    }
+    bool needsGCOrN() const { return usesGC || usesN; }
+    bool needsQV() const { return usesQV; }
+};
+
+void do_filter(int argc, char** argv)
+{
+    string param_expression;
+    int param_qv_base = 33;
+    int param_threads = 1;
+
+    static struct option long_options[] = {
+        {"expr", required_argument, 0, 'e'},
+        {"qvbase", required_argument, 0, 'q'},
+    	{"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0} // end of long options
+    };
+
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'e':
+			param_expression = optarg;
+			break;
+		case 'q':
+			param_qv_base = atoi(optarg);
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		}
+	}
+	if(param_threads < 1) {
+		cerr << "ERROR: --threads must be positive" << endl;
+		return;
+	}
+	if(param_expression.empty()) {
+		cerr << "ERROR: give a condition by --expr" << endl;
+		return;
+	}
+    FilterExpressionCompiler compiler(param_expression);
+    FilterNode* predicate = compiler.compile();
+    if(predicate == NULL) {
+        cerr << "ERROR: " << compiler.getError() << endl;
+        return;
+    }
+    const bool needs_gc_or_n = compiler.needsGCOrN();
+    const bool needs_qv = compiler.needsQV();
+    uint64_t number_of_reads = 0;
+    uint64_t number_of_passed_reads = 0;
+    const vector<const char*> file_names(argv + optind + 1, argv + argc);
+    ParallelRecordScanner scanner(param_threads);
+    scanner.run(file_names, [&](RecordBatch& batch) {
+        FilterContext ctx;
+        batch.values.assign(1, 0);
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            const FastxRecord& r = batch.records[i];
+            ctx.record = &r;
+            ctx.gcFraction = ctx.nFraction = ctx.meanQV = 0;
+            const size_t length = r.sequence.size();
+            if(needs_gc_or_n && 0 < length) {
+                NucleotideClassCounts counts;
+                classify_nucleotides(r.sequence.data(), length, counts);
+                ctx.gcFraction = double(counts.gc()) / length;
+                ctx.nFraction = double(counts.n) / length;
+            }
+            if(needs_qv) {
+                ctx.meanQV = r.qv.empty() ? 0 : double(sum_of_bytes(r.qv.data(), r.qv.size())) / r.qv.size() - param_qv_base;
+            }
+            if(predicate->truth(ctx)) {
+                batch.output += r.text;
+                batch.values[0]++;
+            }
+        }
+    }, [&](RecordBatch& batch) {
+        cout << batch.output;
+        number_of_reads += batch.numberOfRecords;
+        number_of_passed_reads += batch.values[0];
+    });
+    cerr << sep_comma(number_of_passed_reads) << " of " << sep_comma(number_of_reads) << " reads passed the filter\n";
+    delete predicate;
+}
+
+// How stat/count --group-by takes the key of a read from its header:
+//   name:k    the k-th colon-separated field of the read name (Illumina: 4 is the lane, 5 the tile)
+//   field:k   the k-th space-separated field of the description, as field(k) in filter
+//   tag:key   the value of key=value in the description (ONT: runid, barcode, sample_id, ...)
+//   regex:re  the first parenthesized part (or the whole if none) of the first match of re
+//             in the header line without '>' or '@'
+// Reads without the key are grouped under "(none)".
+class ReadGroupKey
+{
+    enum Kind { NAME_FIELD, HEADER_PART, REGEX };
+    Kind kind;
+    size_t fieldIndex;
+    FilterHeaderPart* headerPart;
+    regex_t re;
+    bool compiled;
+
+    ReadGroupKey(const ReadGroupKey&);
+    ReadGroupKey& operator=(const ReadGroupKey&);
+
+public:
+    ReadGroupKey() : kind(NAME_FIELD), fieldIndex(0), headerPart(NULL), compiled(false) {}
+    ~ReadGroupKey() {
+        delete headerPart;
+        if(compiled) regfree(&re);
+    }
+    bool parse(const string& spec, string& error) {
+        const string::size_type colon = spec.find(':');
+        const string type = spec.substr(0, colon);
+        const string arg = colon == string::npos ? "" : spec.substr(colon + 1);
+        if(type == "name" || type == "field") {
+            const long k = atol(arg.c_str());
+            if(k <= 0) {
+                error = "'" + spec + "' needs a field number (1-origin) after ':'";
+                return false;
+            }
+            fieldIndex = k;
+            kind = type == "name" ? NAME_FIELD : HEADER_PART;
+            if(type == "field") headerPart = new FilterHeaderPart(FilterHeaderPart::FIELD, fieldIndex);
+            return true;
+        }
+        if(type == "tag" && !arg.empty()) {
+            kind = HEADER_PART;
+            headerPart = new FilterHeaderPart(FilterHeaderPart::TAG, 0, arg);
+            return true;
+        }
+        if(type == "regex" && !arg.empty()) {
+            kind = REGEX;
+            const int rc = regcomp(&re, arg.c_str(), REG_EXTENDED);
+            if(rc != 0) {
+                char buf[256];
+                regerror(rc, &re, buf, sizeof(buf));
+                error = "bad regular expression '" + arg + "': " + buf;
+                return false;
+            }
+            compiled = true;
+            return true;
+        }
+        error = "'" + spec + "' is not one of name:k, field:k, tag:key and regex:re";
+        return false;
+    }
+    void extract(const FastxRecord& r, string& key) const {
+        key.clear();
+        if(kind == NAME_FIELD) {
+            size_t length;
+            const char* name = r.name(length);
+            const char* const end = name + length;
+            size_t k = 1;
+            for(const char* p = name; p <= end; ++p) {
+                if(p == end || *p == ':') {
+                    if(k == fieldIndex) {
+                        key.assign(name, p);
+                        break;
+                    }
+                    ++k;
+                    name = p + 1;
+                }
+            }
+        } else if(kind == HEADER_PART) {
+            FilterContext ctx;
+            ctx.record = &r;
+            const FilterNode::StringView text = headerPart->text(ctx);
+            key.assign(text.first, text.second);
+        } else {
+            regmatch_t matches[2];
+            const char* header = r.header.empty() ? "" : r.header.c_str() + 1;
+            if(regexec(&re, header, 2, matches, 0) == 0) {
+                const regmatch_t& m = matches[1].rm_so != -1 ? matches[1] : matches[0];
+                key.assign(header + m.rm_so, m.rm_eo - m.rm_so);
+            }
+        }
+        if(key.empty()) key = "(none)";
+    }
+};
+
+// The statistics of the reads in a group.
+struct ReadGroupStatistics
+{
+    LengthHistogram lengths;
+    NucleotideClassCounts composition;
+    long long sumOfQVs; // can be negative with a wrong --qvbase
+    unsigned long long numberOfQVs;
+    unsigned long long numberOfQ30s;
+
+    ReadGroupStatistics() : sumOfQVs(0), numberOfQVs(0), numberOfQ30s(0) {}
+    void add(const FastxRecord& r, int qv_base) {
+        lengths.add(r.sequence.size());
+        classify_nucleotides(r.sequence.data(), r.sequence.size(), composition);
+        if(!r.qv.empty()) {
+            sumOfQVs += static_cast<long long>(sum_of_bytes(r.qv.data(), r.qv.size())) - static_cast<long long>(qv_base) * static_cast<long long>(r.qv.size());
+            numberOfQVs += r.qv.size();
+            for(size_t i = 0; i < r.qv.size(); ++i) {
+                if(qv_base + 30 <= static_cast<unsigned char>(r.qv[i])) numberOfQ30s++;
+            }
+        }
+    }
+    void merge(const ReadGroupStatistics& other) {
+        lengths.merge(other.lengths);
+        composition.a += other.composition.a;
+        composition.c += other.composition.c;
+        composition.g += other.composition.g;
+        composition.t += other.composition.t;
+        composition.n += other.composition.n;
+        composition.other += other.composition.other;
+        composition.lowercase += other.composition.lowercase;
+        sumOfQVs += other.sumOfQVs;
+        numberOfQVs += other.numberOfQVs;
+        numberOfQ30s += other.numberOfQ30s;
+    }
+};
+
+typedef std::unordered_map<string, ReadGroupStatistics> ReadGroupStatisticsMap;
+
+// Keys that are both numbers (lanes, tiles) are compared as numbers, and others as strings.
+static bool compare_group_keys(const string& a, const string& b)
+{
+    const bool a_is_number = !a.empty() && a.size() < 19 && a.find_first_not_of("0123456789") == string::npos;
+    const bool b_is_number = !b.empty() && b.size() < 19 && b.find_first_not_of("0123456789") == string::npos;
+    if(a_is_number && b_is_number) return atoll(a.c_str()) < atoll(b.c_str());
+    if(a_is_number != b_is_number) return a_is_number;
+    return a < b;
+}
+
+// stat/count --group-by: the statistics of each group of reads, as TSV (or JSON), sorted by the key.
+void output_grouped_statistics(const vector<const char*>& file_names, const string& group_by, int threads, bool flag_json, int qv_base)
+{
+    ReadGroupKey group_key;
+    string error;
+    if(!group_key.parse(group_by, error)) {
+        cerr << "ERROR: --group-by: " << error << endl;
+        return;
+    }
+    if(file_names.empty()) {
+        cerr << "ERROR: No input files." << endl;
+        return;
+    }
+    AccumulatorPool<ReadGroupStatisticsMap> maps([]() { return new ReadGroupStatisticsMap(); });
+    ParallelRecordScanner scanner(threads);
+    const bool succeeded = scanner.run(file_names, [&](RecordBatch& batch) {
+        ReadGroupStatisticsMap* groups = maps.take();
+        string key;
+        // Reads in a row often have the same key (tiles, runs), so the last group is remembered.
+        string last_key;
+        ReadGroupStatistics* last_group = NULL;
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            group_key.extract(batch.records[i], key);
+            if(last_group == NULL || key != last_key) {
+                last_group = &(*groups)[key];
+                last_key = key;
+            }
+            last_group->add(batch.records[i], qv_base);
+        }
+        maps.giveBack(groups);
+    }, [&](RecordBatch&) {
+    });
+    if(!succeeded) return;
+    ReadGroupStatisticsMap total;
+    for(size_t i = 0; i < maps.accumulators().size(); ++i) {
+        const ReadGroupStatisticsMap& groups = *maps.accumulators()[i];
+        for(ReadGroupStatisticsMap::const_iterator it = groups.begin(); it != groups.end(); ++it) total[it->first].merge(it->second);
+    }
+    vector<string> keys;
+    for(ReadGroupStatisticsMap::const_iterator it = total.begin(); it != total.end(); ++it) keys.push_back(it->first);
+    sort(keys.begin(), keys.end(), compare_group_keys);
+    if(flag_json) {
+        cout << "[";
+    } else {
+        cout << "GROUP\tNUM_READS\tNUM_NUCLS\tAVG_READ_LEN\tMIN_READ_LEN\tMAX_READ_LEN\tN50\tGC\tN\tMEAN_QV\tQ30\n";
+    }
+    for(size_t i = 0; i < keys.size(); ++i) {
+        const ReadGroupStatistics& g = total[keys[i]];
+        const uint64_t number_of_reads = g.lengths.size();
+        const unsigned long long number_of_bases = g.lengths.total();
+        size_t n50 = 0;
+        uint64_t n50_number;
+        const double half = 0.5;
+        if(0 < number_of_bases) g.lengths.getNx(&half, 1, &n50, &n50_number);
+        const unsigned long long acgt = g.composition.a + g.composition.c + g.composition.g + g.composition.t;
+        const double gc = acgt == 0 ? 0 : double(g.composition.gc()) / acgt;
+        const double n = number_of_bases == 0 ? 0 : double(g.composition.n) / number_of_bases;
+        const double avg = double(number_of_bases) / number_of_reads;
+        if(flag_json) {
+            cout << (i ? "," : "") << "{\"group\": \"" << JSONEscape(keys[i].c_str()) << "\",\"count\": " << number_of_reads << ",\"total_length\": " << number_of_bases;
+            cout << ",\"avg\": " << avg << ",\"min\": " << g.lengths.minLength() << ",\"max\": " << g.lengths.maxLength() << ",\"n50\": " << n50;
+            cout << ",\"gc\": " << gc << ",\"n\": " << n;
+            if(0 < g.numberOfQVs) cout << ",\"mean_qv\": " << double(g.sumOfQVs) / g.numberOfQVs << ",\"q30\": " << double(g.numberOfQ30s) / g.numberOfQVs;
+            cout << "}";
+        } else {
+            cout << keys[i] << '\t' << number_of_reads << '\t' << number_of_bases << '\t' << avg << '\t' << g.lengths.minLength() << '\t' << g.lengths.maxLength() << '\t' << n50;
+            cout << '\t' << gc << '\t' << n;
+            if(0 < g.numberOfQVs) {
+                cout << '\t' << double(g.sumOfQVs) / g.numberOfQVs << '\t' << double(g.numberOfQ30s) / g.numberOfQVs << '\n';
+            } else {
+                cout << "\tNA\tNA\n";
+            }
+        }
+    }
+    if(flag_json) cout << "]\n";
+}
+
+// Gives a path from which a file can be read as plain text: "-" is stdin,
+// and gzip, bzip2, xz and zstd input (told by its magic number, on stdin too) is
+// decompressed by the external command on a pipe, read through /dev/fd.
+class DecompressedInput
+{
+    FILE* pipe;
+    string path;
+    string command;
+
+    DecompressedInput(const DecompressedInput&);
+    DecompressedInput& operator=(const DecompressedInput&);
+
+    static const char* getDecompressor(const unsigned char* magic, size_t n) {
+        if(2 <= n && magic[0] == 0x1f && magic[1] == 0x8b) return "gzip -dc";
+        if(3 <= n && magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h') return "bzip2 -dc";
+        if(6 <= n && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) return "xz -dc";
+        if(4 <= n && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return "zstd -dc";
+        return NULL;
+    }
+    static const char* getDecompressor(const char* file_name) {
+        unsigned char magic[6] = {0, 0, 0, 0, 0, 0};
+        FILE* fp = fopen(file_name, "rb");
+        if(fp == NULL) return NULL;
+        const size_t n = fread(magic, 1, sizeof(magic), fp);
+        fclose(fp);
+        return getDecompressor(magic, n);
+    }
+    static string quoteForShell(const char* s) {
+        string quoted = "'";
+        for(; *s; ++s) {
+            if(*s == '\'') quoted += "'\\''";
+            else quoted += *s;
+        }
+        return quoted + "'";
+    }
+
+    bool openPipe(const string& command_to_run) {
+        command = command_to_run;
+        pipe = popen(command.c_str(), "r");
+        if(pipe == NULL) return false;
+        ostringstream os;
+        os << "/dev/fd/" << fileno(pipe);
+        path = os.str();
+        return true;
+    }
+    // stdin is also decompressed by its magic number, which is read with read(2) so that
+    // nothing else is consumed. If stdin cannot be seeked back (a pipe), the bytes read are
+    // put back in front of the rest by a shell, which inherits stdin.
+    bool openStandardInput() {
+        unsigned char magic[6];
+        size_t n = 0;
+        while(n < sizeof(magic)) {
+            const ssize_t r = read(STDIN_FILENO, magic + n, sizeof(magic) - n);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            n += r;
+        }
+        const char* decompressor = getDecompressor(magic, n);
+        if(n == 0 || lseek(STDIN_FILENO, -static_cast<off_t>(n), SEEK_CUR) != -1) {
+            if(decompressor == NULL) {
+                path = "/dev/stdin";
+                return true;
+            }
+            return openPipe(decompressor);
+        }
+        string command_to_run = "{ printf '";
+        for(size_t i = 0; i < n; ++i) {
+            char octal[8];
+            snprintf(octal, sizeof(octal), "\\%03o", magic[i]);
+            command_to_run += octal;
+        }
+        command_to_run += "'; cat; }";
+        if(decompressor != NULL) command_to_run += string(" | ") + decompressor;
+        return openPipe(command_to_run);
+    }
+
+public:
+    DecompressedInput() : pipe(NULL) {}
+    ~DecompressedInput() { close(); }
+    bool open(const char* file_name) {
+        close();
+        if(strcmp(file_name, "-") == 0) return openStandardInput();
+        const char* decompressor = getDecompressor(file_name);
+        if(decompressor == NULL) {
+            path = file_name;
+            return true;
+        }
+        return openPipe(string(decompressor) + " < " + quoteForShell(file_name));
+    }
+    const char* getPath() const { return path.c_str(); }
+    // Returns false if the decompressor failed. Call after reading everything.
+    bool close() {
+        if(pipe == NULL) return true;
+        const int status = pclose(pipe);
+        pipe = NULL;
+        if(status != 0) {
+            cerr << "ERROR: '" << command << "' failed" << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Random numbers for sample; uniform in (0, 1), never 0, so that log() is finite.
+class SamplingRandom
+{
+    std::mt19937_64 engine;
+public:
+    SamplingRandom(uint64_t seed) : engine(seed) {}
+    double uniform() { return ((engine() >> 11) + 0.5) * (1.0 / 9007199254740992.0); }
+    size_t below(size_t n) { return static_cast<size_t>(uniform() * n); }
+    // The number of records to skip before the next one that is taken with probability p.
+    uint64_t geometricSkip(double p) {
+        if(1.0 <= p) return 0;
+        const double skip = floor(log(uniform()) / log1p(-p));
+        return 1e18 < skip ? static_cast<uint64_t>(1e18) : static_cast<uint64_t>(skip);
+    }
+};
+
+// Decides which records (or pairs) sample takes, in one pass.
+// For --fraction, the gaps between taken records are drawn from the geometric
+// distribution, and for --num, Algorithm L (Li, 1994) computes the index of the
+// next record to enter the reservoir, so neither draws a random number per record.
+class RecordSampler
+{
+    SamplingRandom random;
+    bool isReservoir;
+    double fraction;
+    size_t reservoirSize;
+    double w;
+    uint64_t nextIndex;
+public:
+    RecordSampler(uint64_t seed, bool isReservoir, double fraction, size_t reservoirSize) :
+        random(seed), isReservoir(isReservoir), fraction(fraction), reservoirSize(reservoirSize), w(0), nextIndex(0) {
+        if(isReservoir) {
+            w = exp(log(random.uniform()) / reservoirSize);
+            nextIndex = reservoirSize + static_cast<uint64_t>(floor(log(random.uniform()) / log1p(-w)));
+        } else {
+            nextIndex = fraction <= 0 ? UINT64_MAX : random.geometricSkip(fraction);
+        }
+    }
+    // Returns true if the index-th record (0-origin, called in order) is taken.
+    // For --num, slot is where it goes in the reservoir.
+    bool take(uint64_t index, size_t& slot) {
+        if(isReservoir && index < reservoirSize) {
+            slot = index;
+            return true;
+        }
+        if(index != nextIndex) return false;
+        if(isReservoir) {
+            slot = random.below(reservoirSize);
+            w *= exp(log(random.uniform()) / reservoirSize);
+            nextIndex = index + 1u + static_cast<uint64_t>(floor(log(random.uniform()) / log1p(-w)));
+        } else {
+            nextIndex = index + 1u + random.geometricSkip(fraction);
+        }
+        return true;
+    }
+};
+
+void do_sample(int argc, char** argv)
+{
+    long long param_num = -1;
+    double param_fraction = -1;
+    uint64_t param_seed = 0;
+    bool flag_seed_given = false;
+    bool flag_paired = false;
+    string param_out1;
+    string param_out2;
+
+    static struct option long_options[] = {
+        {"num", required_argument, 0, 'n'},
+        {"fraction", required_argument, 0, 'f'},
+        {"seed", required_argument, 0, 's'},
+        {"paired", no_argument, 0, 'P'},
+    	{"out1", required_argument, 0, '1'},
+    	{"out2", required_argument, 0, '2'},
+        {0, 0, 0, 0} // end of long options
+    };
+
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'n':
+			param_num = atoll(optarg);
+			break;
+		case 'f':
+			param_fraction = atof(optarg);
+			break;
+		case 's':
+			param_seed = strtoull(optarg, NULL, 10);
+			flag_seed_given = true;
+			break;
+		case 'P':
+			flag_paired = true;
+			break;
+		case '1':
+			param_out1 = optarg;
+			break;
+		case '2':
+			param_out2 = optarg;
+			break;
+		}
+	}
+	if((param_num < 0) == (param_fraction < 0)) {
+		cerr << "ERROR: specify either --num or --fraction" << endl;
+		return;
+	}
+	if(0 <= param_fraction && 1 < param_fraction) {
+		cerr << "ERROR: --fraction must be between 0 and 1" << endl;
+		return;
+	}
+    vector<const char*> file_names(argv + optind + 1, argv + argc);
+    if(file_names.empty()) file_names.push_back("-");
+	if(flag_paired && file_names.size() != 2u) {
+		cerr << "ERROR: --paired takes two files (R1 and R2)" << endl;
+		return;
+	}
+	if(param_out1.empty() != param_out2.empty() || (!flag_paired && !param_out1.empty())) {
+		cerr << "ERROR: --out1 and --out2 are for --paired and must be given together" << endl;
+		return;
+	}
+    if(!flag_seed_given) {
+        param_seed = static_cast<uint64_t>(time(NULL)) ^ (static_cast<uint64_t>(getpid()) << 32);
+        cerr << "Seed: " << param_seed << " (give --seed=" << param_seed << " to reproduce)\n";
+    }
+    const bool is_reservoir = 0 <= param_num;
+    if(is_reservoir && param_num == 0) return;
+    RecordSampler sampler(param_seed, is_reservoir, param_fraction, is_reservoir ? param_num : 0);
+    ofstream out1_file;
+    ofstream out2_file;
+    if(!param_out1.empty()) {
+        out1_file.open(param_out1.c_str(), ios::binary);
+        out2_file.open(param_out2.c_str(), ios::binary);
+        if(!out1_file || !out2_file) {
+            cerr << "ERROR: Cannot open '" << (!out1_file ? param_out1 : param_out2) << "'" << endl;
+            return;
+        }
+    }
+    ostream& out1 = param_out1.empty() ? cout : out1_file;
+    ostream& out2 = param_out2.empty() ? cout : out2_file;
+    // The reservoir keeps (index, text of R1, text of R2), and is output in the input order.
+    struct Sampled {
+        uint64_t index;
+        string text1;
+        string text2;
+        bool operator<(const Sampled& b) const { return index < b.index; }
+    };
+    vector<Sampled> reservoir;
+    uint64_t index = 0;
+    if(flag_paired) {
+        DecompressedInput input1, input2;
+        ReadAheadRecordReader reader1, reader2;
+        if(!input1.open(file_names[0]) || !reader1.open(input1.getPath())) {
+            cerr << "Cannot open '" << file_names[0] << "'" << endl;
+            return;
+        }
+        if(!input2.open(file_names[1]) || !reader2.open(input2.getPath())) {
+            cerr << "Cannot open '" << file_names[1] << "'" << endl;
+            return;
+        }
+        while(true) {
+            const FastxRecord* r1 = reader1.next();
+            const FastxRecord* r2 = reader2.next();
+            if(r1 == NULL || r2 == NULL) {
+                if(r1 != r2) cerr << "ERROR: " << file_names[r1 == NULL ? 1 : 0] << " has more reads than " << file_names[r1 == NULL ? 0 : 1] << endl;
+                break;
+            }
+            size_t length1, length2;
+            const char* name1 = r1->name(length1);
+            const char* name2 = r2->name(length2);
+            const size_t pair_name_length = get_pair_name_length(name1, length1);
+            if(pair_name_length != get_pair_name_length(name2, length2) || memcmp(name1, name2, pair_name_length) != 0) {
+                cerr << "ERROR: the mates are out of sync at pair " << index << " ('" << string(name1, length1) << "' and '" << string(name2, length2) << "')" << endl;
+                return;
+            }
+            size_t slot;
+            if(sampler.take(index, slot)) {
+                if(!is_reservoir) {
+                    out1 << r1->text;
+                    out2 << r2->text;
+                } else {
+                    if(reservoir.size() <= slot) reservoir.resize(slot + 1u);
+                    reservoir[slot].index = index;
+                    reservoir[slot].text1 = r1->text;
+                    reservoir[slot].text2 = r2->text;
+                }
+            }
+            index++;
+        }
+        input1.close();
+        input2.close();
+    } else {
+        FastxRecord r;
+        for(size_t i = 0; i < file_names.size(); ++i) {
+            DecompressedInput input;
+            FileLineBufferWithAutoExpansion f;
+            if(!input.open(file_names[i]) || !f.open(input.getPath())) {
+                cerr << "Cannot open '" << file_names[i] << "'" << endl;
+                continue;
+            }
+            FastxRecordReader reader(f);
+            while(reader.next(r)) {
+                size_t slot;
+                if(sampler.take(index, slot)) {
+                    if(!is_reservoir) {
+                        out1 << r.text;
+                    } else {
+                        if(reservoir.size() <= slot) reservoir.resize(slot + 1u);
+                        reservoir[slot].index = index;
+                        reservoir[slot].text1.swap(r.text);
+                    }
+                }
+                index++;
+            }
+            f.close();
+            input.close();
+        }
+    }
+    if(is_reservoir) {
+        if(reservoir.size() < static_cast<size_t>(param_num)) {
+            cerr << "WARNING: there are only " << index << " " << (flag_paired ? "pairs" : "reads") << "; all of them are output.\n";
+        }
+        sort(reservoir.begin(), reservoir.end());
+        for(size_t i = 0; i < reservoir.size(); ++i) {
+            out1 << reservoir[i].text1;
+            if(flag_paired) out2 << reservoir[i].text2;
+        }
+    }
+}
+
+// What qc collects from reads. Each worker thread fills its own, and they are merged
+// at the end, so the result does not depend on which thread processed which batch.
+struct ReadQCAccumulator
+{
+    static const int NUMBER_OF_QV_CHARS = 94; // from '!' (33) to '~' (126)
+    enum { BASE_A, BASE_C, BASE_G, BASE_T, BASE_N, BASE_OTHER, NUMBER_OF_BASE_CLASSES };
+    // The first bases of the first reads are counted to find overrepresented sequences.
+    static const size_t HEAD_LENGTH = 50;
+    static const uint64_t NUMBER_OF_READS_FOR_HEADS = 100000;
+
+    size_t maxCycles;
+    vector<uint64_t> qvCounts;   ///< [cycle * NUMBER_OF_QV_CHARS + QV char - 33]
+    vector<uint64_t> baseCounts; ///< [cycle * NUMBER_OF_BASE_CLASSES + base class]
+    uint64_t gcPercentCounts[101];
+    LengthHistogram lengths;
+    NucleotideClassCounts composition;
+    unsigned long long numberOfQVs;
+    map<string, uint64_t> headCounts;
+
+    ReadQCAccumulator(size_t maxCycles) : maxCycles(maxCycles), numberOfQVs(0) {
+        fill(gcPercentCounts, gcPercentCounts + 101, 0ull);
+    }
+    static int getBaseClass(char c) {
+        struct BaseClassTable {
+            unsigned char classes[256];
+            BaseClassTable() {
+                fill(classes, classes + 256, static_cast<unsigned char>(BASE_OTHER));
+                classes['A'] = classes['a'] = BASE_A;
+                classes['C'] = classes['c'] = BASE_C;
+                classes['G'] = classes['g'] = BASE_G;
+                classes['T'] = classes['t'] = BASE_T;
+                classes['N'] = classes['n'] = BASE_N;
+            }
+        };
+        static const BaseClassTable table;
+        return table.classes[static_cast<unsigned char>(c)];
+    }
+    size_t numberOfCycles() const { return baseCounts.size() / NUMBER_OF_BASE_CLASSES; }
+    void add(const FastxRecord& r, uint64_t record_number) {
+        const string& seq = r.sequence;
+        lengths.add(seq.size());
+        NucleotideClassCounts counts;
+        classify_nucleotides(seq.data(), seq.size(), counts);
+        composition.a += counts.a;
+        composition.c += counts.c;
+        composition.g += counts.g;
+        composition.t += counts.t;
+        composition.n += counts.n;
+        composition.other += counts.other;
+        composition.lowercase += counts.lowercase;
+        const size_t acgt = counts.a + counts.c + counts.g + counts.t;
+        if(0 < acgt) gcPercentCounts[(counts.gc() * 200 + acgt) / (acgt * 2)]++;
+        const size_t cycles = min(seq.size(), maxCycles);
+        if(numberOfCycles() < cycles) {
+            baseCounts.resize(cycles * NUMBER_OF_BASE_CLASSES);
+            qvCounts.resize(cycles * NUMBER_OF_QV_CHARS);
+        }
+        for(size_t i = 0; i < cycles; ++i) {
+            baseCounts[i * NUMBER_OF_BASE_CLASSES + getBaseClass(seq[i])]++;
+        }
+        const size_t qv_cycles = min(r.qv.size(), cycles);
+        for(size_t i = 0; i < qv_cycles; ++i) {
+            const int q = static_cast<unsigned char>(r.qv[i]);
+            qvCounts[i * NUMBER_OF_QV_CHARS + (q < 33 ? 0 : 126 < q ? NUMBER_OF_QV_CHARS - 1 : q - 33)]++;
+        }
+        numberOfQVs += qv_cycles;
+        if(record_number < NUMBER_OF_READS_FOR_HEADS && HEAD_LENGTH <= seq.size()) {
+            headCounts[seq.substr(0, HEAD_LENGTH)]++;
+        }
+    }
+    void merge(const ReadQCAccumulator& other) {
+        if(numberOfCycles() < other.numberOfCycles()) {
+            baseCounts.resize(other.baseCounts.size());
+            qvCounts.resize(other.qvCounts.size());
+        }
+        for(size_t i = 0; i < other.baseCounts.size(); ++i) baseCounts[i] += other.baseCounts[i];
+        for(size_t i = 0; i < other.qvCounts.size(); ++i) qvCounts[i] += other.qvCounts[i];
+        for(int i = 0; i <= 100; ++i) gcPercentCounts[i] += other.gcPercentCounts[i];
+        lengths.merge(other.lengths);
+        composition.a += other.composition.a;
+        composition.c += other.composition.c;
+        composition.g += other.composition.g;
+        composition.t += other.composition.t;
+        composition.n += other.composition.n;
+        composition.other += other.composition.other;
+        composition.lowercase += other.composition.lowercase;
+        numberOfQVs += other.numberOfQVs;
+        for(map<string, uint64_t>::const_iterator it = other.headCounts.begin(); it != other.headCounts.end(); ++it) {
+            headCounts[it->first] += it->second;
+        }
+    }
+};
+
+// The QVs (as indices into a row of qvCounts) at the given fractions of the reads at a cycle,
+// and the mean.
+static void get_qv_quantiles(const uint64_t* counts, const int number_of_fractions, const double* fractions, int* quantiles, double& mean)
+{
+    uint64_t total = 0;
+    unsigned long long sum = 0;
+    for(int q = 0; q < ReadQCAccumulator::NUMBER_OF_QV_CHARS; ++q) {
+        total += counts[q];
+        sum += counts[q] * q;
+    }
+    mean = total == 0 ? 0 : double(sum) / total;
+    for(int i = 0; i < number_of_fractions; ++i) {
+        const double threshold = fractions[i] * total;
+        uint64_t cumulative = 0;
+        int q = 0;
+        for(; q < ReadQCAccumulator::NUMBER_OF_QV_CHARS - 1; ++q) {
+            cumulative += counts[q];
+            if(threshold <= cumulative && 0 < cumulative) break;
+        }
+        quantiles[i] = q;
+    }
+}
+
+void print_qc_report(const ReadQCAccumulator& acc, const bool flag_html, const bool flag_json, const int qv_base, const double min_head_percent)
+{
+    const uint64_t number_of_reads = acc.lengths.size();
+    const bool has_qvs = 0 < acc.numberOfQVs;
+    const size_t number_of_cycles = acc.numberOfCycles();
+    const int number_of_fractions = 5;
+    const double fractions[number_of_fractions] = {0.1, 0.25, 0.5, 0.75, 0.9};
+    const char* const quantile_names[number_of_fractions] = {"p10", "q1", "median", "q3", "p90"};
+    const char* const base_names[ReadQCAccumulator::NUMBER_OF_BASE_CLASSES] = {"A", "C", "G", "T", "N", "other"};
+    const unsigned long long acgt = acc.composition.a + acc.composition.c + acc.composition.g + acc.composition.t;
+    const double gc_percent = acgt == 0 ? 0 : 100.0 * acc.composition.gc() / acgt;
+    const unsigned long long total_length = acc.lengths.total();
+    const double n_percent = total_length == 0 ? 0 : 100.0 * acc.composition.n / total_length;
+
+    vector<LengthHistogram::LengthAndCount> length_counts;
+    acc.lengths.getLengthsInDescendingOrder(length_counts);
+    reverse(length_counts.begin(), length_counts.end());
+    // For text and HTML, many distinct lengths (long reads) are put into at most 50 bins.
+    vector<LengthHistogram::LengthAndCount> length_bins;
+    size_t length_bin_width = 1;
+    if(50 < length_counts.size()) {
+        const size_t min_length = length_counts.front().first;
+        length_bin_width = (length_counts.back().first - min_length) / 50 + 1;
+        for(size_t i = 0; i < length_counts.size(); ++i) {
+            const size_t bin_start = min_length + (length_counts[i].first - min_length) / length_bin_width * length_bin_width;
+            if(length_bins.empty() || length_bins.back().first != bin_start) length_bins.push_back(LengthHistogram::LengthAndCount(bin_start, 0));
+            length_bins.back().second += length_counts[i].second;
+        }
+    } else {
+        length_bins = length_counts;
+    }
+
+    const uint64_t number_of_head_reads = min<uint64_t>(number_of_reads, ReadQCAccumulator::NUMBER_OF_READS_FOR_HEADS);
+    vector<pair<uint64_t, string> > heads;
+    for(map<string, uint64_t>::const_iterator it = acc.headCounts.begin(); it != acc.headCounts.end(); ++it) {
+        if(min_head_percent * number_of_head_reads <= it->second * 100.0) heads.push_back(make_pair(it->second, it->first));
+    }
+    sort(heads.rbegin(), heads.rend());
+
+    if(flag_json) {
+        cout << "{\"reads\": ";
+        print_n50(acc.lengths, false, true, "read");
+        cout << ",\"composition\": {";
+        cout << "\"a\": " << acc.composition.a << ",\"c\": " << acc.composition.c << ",\"g\": " << acc.composition.g << ",\"t\": " << acc.composition.t;
+        cout << ",\"n\": " << acc.composition.n << ",\"other\": " << acc.composition.other << ",\"lowercase\": " << acc.composition.lowercase;
+        cout << ",\"gc_percent\": " << gc_percent << ",\"n_percent\": " << n_percent << "}";
+        cout << ",\"per_cycle\": [";
+        for(size_t cycle = 0; cycle < number_of_cycles; ++cycle) {
+            if(0 < cycle) cout << ",";
+            cout << "{\"cycle\": " << (cycle + 1);
+            const uint64_t* base_counts = &acc.baseCounts[cycle * ReadQCAccumulator::NUMBER_OF_BASE_CLASSES];
+            for(int b = 0; b < ReadQCAccumulator::NUMBER_OF_BASE_CLASSES; ++b) cout << ",\"" << base_names[b] << "\": " << base_counts[b];
+            if(has_qvs) {
+                int quantiles[number_of_fractions];
+                double mean;
+                get_qv_quantiles(&acc.qvCounts[cycle * ReadQCAccumulator::NUMBER_OF_QV_CHARS], number_of_fractions, fractions, quantiles, mean);
+                cout << ",\"mean_qv\": " << (mean + 33 - qv_base);
+                for(int i = 0; i < number_of_fractions; ++i) cout << ",\"" << quantile_names[i] << "\": " << (quantiles[i] + 33 - qv_base);
+            }
+            cout << "}";
+        }
+        cout << "],\"gc_distribution\": [";
+        for(int i = 0; i <= 100; ++i) cout << (i ? "," : "") << acc.gcPercentCounts[i];
+        cout << "],\"length_distribution\": [";
+        for(size_t i = 0; i < length_counts.size(); ++i) cout << (i ? "," : "") << "[" << length_counts[i].first << "," << length_counts[i].second << "]";
+        cout << "],\"overrepresented\": [";
+        for(size_t i = 0; i < heads.size(); ++i) {
+            cout << (i ? "," : "") << "{\"sequence\": \"" << heads[i].second << "\",\"count\": " << heads[i].first;
+            cout << ",\"percent\": " << (100.0 * heads[i].first / number_of_head_reads) << "}";
+        }
+        cout << "]}\n";
+        return;
+    }
+    if(flag_html) {
+        cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
+        cout << "<tr><th colspan=\"3\" bgcolor=\"#fdfdd4\">Read statistics</th></tr>\n";
+        print_n50(acc.lengths, true, false, "read");
+        cout << "<tr><td>GC</td><td>" << fixed << setprecision(2) << gc_percent << "%</td><td></td></tr>\n";
+        cout << "<tr><td>N</td><td>" << sep_comma(acc.composition.n) << "</td><td>" << n_percent << "%</td></tr>\n";
+        cout << "<tr><td>lowercase</td><td>" << sep_comma(acc.composition.lowercase) << "</td><td></td></tr>\n";
+        cout << "</table>\n";
+        cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
+        cout << "<tr><th colspan=\"" << (has_qvs ? 13 : 7) << "\" bgcolor=\"#fdfdd4\">Per-cycle quality and composition (%)</th></tr>\n";
+        cout << "<tr><td>cycle</td>";
+        if(has_qvs) {
+            cout << "<td>mean QV</td>";
+            for(int i = 0; i < number_of_fractions; ++i) cout << "<td>" << quantile_names[i] << "</td>";
+        }
+        for(int b = 0; b < ReadQCAccumulator::NUMBER_OF_BASE_CLASSES; ++b) cout << "<td>" << base_names[b] << "</td>";
+        cout << "</tr>\n";
+    } else {
+        cout << "Read statistics\n";
+        print_n50(acc.lengths, false, false, "read");
+        cout << "GC = " << fixed << setprecision(2) << gc_percent << "%\n";
+        cout << "N = " << sep_comma(acc.composition.n) << " (" << n_percent << "%)\n";
+        cout << "Lowercase = " << sep_comma(acc.composition.lowercase) << "\n";
+        cout << "\nPer-cycle quality and composition (%)\ncycle";
+        if(has_qvs) {
+            cout << "\tmean_QV";
+            for(int i = 0; i < number_of_fractions; ++i) cout << '\t' << quantile_names[i];
+        }
+        for(int b = 0; b < ReadQCAccumulator::NUMBER_OF_BASE_CLASSES; ++b) cout << '\t' << base_names[b];
+        cout << "\n";
+    }
+    const char* const row_start = flag_html ? "<tr><td>" : "";
+    const char* const cell_separator = flag_html ? "</td><td>" : "\t";
+    const char* const row_end = flag_html ? "</td></tr>\n" : "\n";
+    for(size_t cycle = 0; cycle < number_of_cycles; ++cycle) {
+        cout << row_start << (cycle + 1);
+        if(has_qvs) {
+            int quantiles[number_of_fractions];
+            double mean;
+            get_qv_quantiles(&acc.qvCounts[cycle * ReadQCAccumulator::NUMBER_OF_QV_CHARS], number_of_fractions, fractions, quantiles, mean);
+            cout << cell_separator << (mean + 33 - qv_base);
+            for(int i = 0; i < number_of_fractions; ++i) cout << cell_separator << (quantiles[i] + 33 - qv_base);
+        }
+        const uint64_t* base_counts = &acc.baseCounts[cycle * ReadQCAccumulator::NUMBER_OF_BASE_CLASSES];
+        const uint64_t reads_at_cycle = accumulate(base_counts, base_counts + ReadQCAccumulator::NUMBER_OF_BASE_CLASSES, 0ull);
+        for(int b = 0; b < ReadQCAccumulator::NUMBER_OF_BASE_CLASSES; ++b) cout << cell_separator << (100.0 * base_counts[b] / reads_at_cycle);
+        cout << row_end;
+    }
+    if(flag_html) {
+        cout << "</table>\n";
+        cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
+        cout << "<tr><th colspan=\"2\" bgcolor=\"#fdfdd4\">GC content distribution</th></tr>\n";
+        cout << "<tr><td>GC (%)</td><td>reads</td></tr>\n";
+    } else {
+        cout << "\nGC content distribution\nGC%\treads\n";
+    }
+    for(int i = 0; i <= 100; ++i) cout << row_start << i << cell_separator << acc.gcPercentCounts[i] << row_end;
+    if(flag_html) {
+        cout << "</table>\n";
+        cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
+        cout << "<tr><th colspan=\"2\" bgcolor=\"#fdfdd4\">Length distribution</th></tr>\n";
+        cout << "<tr><td>length</td><td>reads</td></tr>\n";
+    } else {
+        cout << "\nLength distribution\nlength\treads\n";
+    }
+    for(size_t i = 0; i < length_bins.size(); ++i) {
+        cout << row_start << length_bins[i].first;
+        if(1 < length_bin_width) cout << "-" << (length_bins[i].first + length_bin_width - 1);
+        cout << cell_separator << length_bins[i].second << row_end;
+    }
+    if(flag_html) {
+        cout << "</table>\n";
+        cout << "<table border=\"2\" bgcolor=\"#ffffff\">\n";
+        cout << "<tr><th colspan=\"3\" bgcolor=\"#fdfdd4\">Overrepresented sequences (the first " << ReadQCAccumulator::HEAD_LENGTH << " bp of the first " << sep_comma(number_of_head_reads) << " reads)</th></tr>\n";
+        cout << "<tr><td>sequence</td><td>count</td><td>%</td></tr>\n";
+    } else {
+        cout << "\nOverrepresented sequences (the first " << ReadQCAccumulator::HEAD_LENGTH << " bp of the first " << sep_comma(number_of_head_reads) << " reads)\nsequence\tcount\t%\n";
+    }
+    for(size_t i = 0; i < heads.size(); ++i) {
+        cout << row_start << heads[i].second << cell_separator << heads[i].first << cell_separator << (100.0 * heads[i].first / number_of_head_reads) << row_end;
+    }
+    if(flag_html) cout << "</table>\n";
+}
+
+void do_qc(int argc, char** argv)
+{
+    bool flag_html = false;
+    bool flag_json = false;
+    int param_threads = 1;
+    int param_qv_base = 33;
+    long long param_max_cycles = 1000;
+    double param_min_percent = 0.1;
+    static struct option long_options[] = {
+        {"html", no_argument, 0, 'h'},
+        {"json", no_argument, 0, 'j'},
+        {"threads", required_argument, 0, 't'},
+        {"qvbase", required_argument, 0, 'q'},
+        {"maxcycle", required_argument, 0, 'm'},
+        {"minpercent", required_argument, 0, 'p'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+    	int option_index = 0;
+    	int c = getopt_long(argc, argv, "", long_options, &option_index);
+    	if(c == -1) break;
+    	switch(c) {
+            case 0:
+           // you can see long_options[option_index].name/flag and optarg (null if no argument).
+                break;
+            case 'h':
+                flag_html = true;
+                break;
+            case 'j':
+                flag_json = true;
+                break;
+            case 't':
+                param_threads = atoi(optarg);
+                break;
+            case 'q':
+                param_qv_base = atoi(optarg);
+                break;
+            case 'm':
+                param_max_cycles = atoll(optarg);
+                break;
+            case 'p':
+                param_min_percent = atof(optarg);
+                break;
+        }
+    }
+    if(flag_html && flag_json) {
+        cerr << "ERROR: You can use either --html or --json\n";
+        return;
+    }
+    if(param_threads < 1 || param_max_cycles < 0) {
+        cerr << "ERROR: --threads must be positive, and --maxcycle must not be negative\n";
+        return;
+    }
+    vector<const char*> file_names(argv + optind + 1, argv + argc);
+    if(file_names.empty()) {
+        cerr << "ERROR: No input files." << endl;
+        return;
+    }
+    AccumulatorPool<ReadQCAccumulator> accumulators([&]() { return new ReadQCAccumulator(param_max_cycles); });
+    ParallelRecordScanner scanner(param_threads);
+    const bool succeeded = scanner.run(file_names, [&](RecordBatch& batch) {
+        ReadQCAccumulator* acc = accumulators.take();
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) acc->add(batch.records[i], batch.firstRecordNumber + i);
+        accumulators.giveBack(acc);
+    }, [&](RecordBatch&) {
+    });
+    ReadQCAccumulator total(param_max_cycles);
+    for(size_t i = 0; i < accumulators.accumulators().size(); ++i) total.merge(*accumulators.accumulators()[i]);
+    if(!succeeded) return;
+    print_qc_report(total, flag_html, flag_json, param_qv_base, param_min_percent);
+}
+
+// The conversion of QV characters for convertqv. table[c] is the converted character of c,
+// or INVALID if c is out of the input range. As a valid character is converted by clamping
+// and then shifting, the SSE2 path does the same 16 bytes at a time with min/max and an add;
+// it is used only if it agrees with the table for every character.
+class QVConverter
+{
+    unsigned char table[256];
+    unsigned char inputLow, inputHigh;     // the valid input characters
+    unsigned char clampLow, clampHigh;     // the input characters of the minimum and maximum output QVs
+    unsigned char shift;                   // added after clamping, modulo 256
+    bool useSIMD;
+
+    static unsigned char clampToChar(int c) { return static_cast<unsigned char>(max(0, min(255, c))); }
+    unsigned char convertLikeSIMD(unsigned char c) const {
+        if(c < inputLow || inputHigh < c) return INVALID;
+        return static_cast<unsigned char>(max(clampLow, min(clampHigh, c)) + shift);
+    }
+
+public:
+    static const unsigned char INVALID = 0;
+
+    QVConverter(int from_base, int to_base, int in_qv_min, int in_qv_max, int out_qv_min, int out_qv_max) {
+        for(int c = 0; c < 256; ++c) {
+            const int qv = c - from_base;
+            table[c] = qv < in_qv_min || in_qv_max < qv ? INVALID : static_cast<unsigned char>(to_base + max(out_qv_min, min(out_qv_max, qv)));
+        }
+        inputLow = clampToChar(from_base + in_qv_min);
+        inputHigh = clampToChar(from_base + in_qv_max);
+        clampLow = clampToChar(from_base + out_qv_min);
+        clampHigh = clampToChar(from_base + out_qv_max);
+        shift = static_cast<unsigned char>(to_base - from_base);
+        useSIMD = true;
+        for(int c = 1; c < 256; ++c) {
+            if(convertLikeSIMD(c) != table[c]) useSIMD = false;
+        }
+    }
+    // Returns true if a valid character is converted into NUL, which cannot be told from INVALID.
+    bool producesNUL(int from_base, int in_qv_min, int in_qv_max) const {
+        for(int c = 1; c < 256; ++c) {
+            const int qv = c - from_base;
+            if(in_qv_min <= qv && qv <= in_qv_max && table[c] == INVALID) return true;
+        }
+        return false;
+    }
+    unsigned char convert(unsigned char c) const { return table[c]; }
+    // Converts p[0, length) in place. Returns false if any of them is invalid; they become INVALID.
+    bool convert(unsigned char* p, size_t length) const {
+        unsigned char invalid = 0;
+        size_t i = 0;
+#ifdef __SSE2__
+        if(useSIMD) {
+            const __m128i input_low = _mm_set1_epi8(static_cast<char>(inputLow));
+            const __m128i input_high = _mm_set1_epi8(static_cast<char>(inputHigh));
+            const __m128i clamp_low = _mm_set1_epi8(static_cast<char>(clampLow));
+            const __m128i clamp_high = _mm_set1_epi8(static_cast<char>(clampHigh));
+            const __m128i shift_vector = _mm_set1_epi8(static_cast<char>(shift));
+            __m128i all_valid = _mm_set1_epi8(-1);
+            for(; i + 16 <= length; i += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                const __m128i valid = _mm_cmpeq_epi8(_mm_max_epu8(_mm_min_epu8(v, input_high), input_low), v);
+                const __m128i converted = _mm_add_epi8(_mm_max_epu8(_mm_min_epu8(v, clamp_high), clamp_low), shift_vector);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_and_si128(converted, valid));
+                all_valid = _mm_and_si128(all_valid, valid);
+            }
+            if(_mm_movemask_epi8(all_valid) != 0xFFFF) invalid = 1;
+        }
+#endif // __SSE2__
+        for(; i < length; ++i) {
+            p[i] = table[p[i]];
+            invalid |= p[i] == INVALID;
+        }
+        return invalid == 0;
+    }
+};
+
+void do_convert_qv_type(int argc, char** argv)
+{
+    int param_from_base = 64;
+    int param_to_base = 33;
+    int param_out_qv_min = 0;
+    int param_out_qv_max = 40;
+    int param_in_qv_min = -5;
+    int param_in_qv_max = 99;
+    int param_threads = 1;
+
+    static struct option long_options[] = {
+        {"fromsanger",   no_argument, 0, 's'},
+        {"fromsolexa",   no_argument, 0, 'x'},
+        {"fromillumina", no_argument, 0, 'i'},
+        {"toillumina13", no_argument, 0, '3'},
+        {"toillumina15", no_argument, 0, '5'},
+        {"toillumina18", no_argument, 0, '8'},
+        {"tosanger",     no_argument, 0, 'q'},
+    	{"frombase", required_argument, 0, 'f'},
+    	{"tobase", required_argument, 0, 't'},
+    	{"min", required_argument, 0, 'a'},
+    	{"max", required_argument, 0, 'b'},
+    	{"inmin", required_argument, 0, 'c'},
+    	{"inmax", required_argument, 0, 'd'},
+        {"threads", required_argument, 0, 'T'},
+        {0, 0, 0, 0} // end of long options
+    };
+
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'a':
+            param_out_qv_min = atoi(optarg);
+			break;
+        case 'b':
+            param_out_qv_max = atoi(optarg);
+            break;
+		case 'c':
+            param_in_qv_min = atoi(optarg);
+			break;
+        case 'd':
+            param_in_qv_max = atoi(optarg);
+            break;
+        case 'T':
+            param_threads = atoi(optarg);
+            break;
+        case 'f':
+            param_from_base = atoi(optarg);
+            break;
+        case 't':
+            param_to_base = atoi(optarg);
+            break;
+        case 's':
+            param_from_base = 33;
+            break;
+        case 'i':
+            param_from_base = 64;
+            break;
+        case 'x':
+            param_from_base = 64;
+            param_in_qv_min = -5;
+            param_in_qv_max = 40;
+            break;
+        case '3':
+            param_to_base = 64;
+            param_out_qv_min = 0;
+            param_out_qv_max = 40;
+            break;
+        case '5':
+            param_to_base = 64;
+            param_out_qv_min = 3;
+            param_out_qv_max = 40;
+            break;
+        case '8':
+            param_to_base = 33;
+            param_out_qv_min = 0;
+            param_out_qv_max = 40;
+            break;
+        case 'q':
+            param_to_base = 33;
+            param_out_qv_min = 0;
+            param_out_qv_max = 40;
+            break;
+		}
+	}
+	if(param_in_qv_max < param_in_qv_min) {
+		cerr << "ERROR: Input QV range [" << param_in_qv_min << ", " << param_in_qv_max << ") is empty." << endl;
+		return;
+	}
+	if(param_out_qv_max < param_out_qv_min) {
+		cerr << "ERROR: Output QV range [" << param_out_qv_min << ", " << param_out_qv_max << ") is empty." << endl;
+		return;
+	}
+    if(param_threads < 1) {
+        cerr << "ERROR: --threads must be positive\n";
+        return;
+    }
+    const QVConverter converter(param_from_base, param_to_base, param_in_qv_min, param_in_qv_max, param_out_qv_min, param_out_qv_max);
+    if(converter.producesNUL(param_from_base, param_in_qv_min, param_in_qv_max)) {
+        cerr << "ERROR: --tobase=" << param_to_base << " makes NUL characters for some QVs." << endl;
+        return;
+    }
+    cerr << "QV [" << param_in_qv_min << ", " << param_in_qv_max << "):base" << param_from_base << " ==> "
+            "QV [" << param_out_qv_min << ", " << param_out_qv_max << "):base" << param_to_base << endl;
+    // Workers convert the QV lines of the records in a copy of their text; the first record
+    // that is not FASTQ or has invalid QVs in a batch is put in values, and the output stops there.
+    vector<const char*> file_names(argv + optind + 1, argv + argc);
+    ParallelRecordScanner scanner(param_threads);
+    bool stopped = false;
+    scanner.run(file_names, [&](RecordBatch& batch) {
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            const FastxRecord& r = batch.records[i];
+            const size_t record_start = batch.output.size();
+            batch.output += r.text;
+            if(r.header.empty() || r.header[0] != '@') {
+                batch.values.push_back(i);
+                break;
+            }
+            // Skips the header, the sequence lines and the separator line.
+            size_t pos = batch.output.find('\n', record_start) + 1;
+            while(pos < batch.output.size() && batch.output[pos] != '+') pos = batch.output.find('\n', pos) + 1;
+            pos = pos < batch.output.size() ? batch.output.find('\n', pos) + 1 : batch.output.size();
+            bool valid = true;
+            while(pos < batch.output.size()) {
+                const size_t end_of_line = batch.output.find('\n', pos);
+                valid &= converter.convert(reinterpret_cast<unsigned char*>(&batch.output[pos]), end_of_line - pos);
+                pos = end_of_line + 1;
+            }
+            if(!valid) {
+                batch.values.push_back(i);
+                break;
+            }
+        }
+    }, [&](RecordBatch& batch) {
+        if(stopped) return;
+        if(batch.values.empty()) {
+            cout << batch.output;
+            return;
+        }
+        // Outputs the records before the bad one, and reports what is wrong with it.
+        const size_t bad_index = batch.values[0];
+        size_t output_length = 0;
+        for(size_t i = 0; i < bad_index; ++i) output_length += batch.records[i].text.size();
+        cout.write(batch.output.data(), output_length);
+        const FastxRecord& r = batch.records[bad_index];
+        const char* file_name = file_names[batch.fileIndex];
+        if(r.header.empty() || r.header[0] != '@') {
+            cerr << "ERROR: the input file '" << file_name << "' does not seem to be a FASTQ file at offset " << r.offset << endl;
+        } else {
+            size_t name_length;
+            const char* name = r.name(name_length);
+            const size_t MAX_REPORTS = 10;
+            size_t number_of_reports = 0;
+            for(size_t i = 0; i < r.qv.size(); ++i) {
+                const unsigned char c = r.qv[i];
+                if(converter.convert(c) != QVConverter::INVALID) continue;
+                if(MAX_REPORTS <= number_of_reports++) continue;
+                cerr << "ERROR: the input file '" << file_name << "' contains an invalid QV (" << int(c) - param_from_base << "; chr = '" << c << "'; ord = '" << int(c) << "') at position "
+                     << i + 1 << " of read '" << string(name, name_length) << "' (the record at offset " << r.offset << ")" << endl;
+            }
+            if(MAX_REPORTS < number_of_reports) cerr << "ERROR: ... and " << number_of_reports - MAX_REPORTS << " more invalid QVs in the read" << endl;
+        }
+        stopped = true;
+        scanner.stop();
+    });
+}
+
+// Decides the type of FASTQ from the histogram of QV characters; returns "type\tmessage".
+static string guess_qv_type_from_histogram(const size_t histogram[256])
+{
+    size_t numBadQVchars = 0;
+    for(int i = 0; i < 32; ++i)    numBadQVchars += histogram[i];
+    for(int i = 127; i < 256; ++i) numBadQVchars += histogram[i];
+    if(0 < numBadQVchars) {
+        ostringstream os;
+        os << "bad\tthe QV strings have " << numBadQVchars << " characters that do not look like QV chars.";
+        return os.str();
+    }
+    size_t numSangerOnlyQVchars = 0;
+    for(int i = 33; i <= 58; ++i)  numSangerOnlyQVchars += histogram[i];
+    if(0 < numSangerOnlyQVchars) return "sanger\tIt must be Sanger FASTQ or Illumina 1.8+.";
+    size_t numSolexaOnlyQVchars = 0;
+    for(int i = 59; i <= 63; ++i)  numSolexaOnlyQVchars += histogram[i];
+    if(0 < numSolexaOnlyQVchars) return "solexa\tIt must be Solexa FASTQ.";
+    if(0 < histogram[64] + histogram[65]) return "illumina13\tIt must be Illumina 1.3+";
+    return "illumina15\tIt looks like Illumina 1.5+";
+}
+
+// Adds the QV characters of up to max_records four-line FASTQ records that start in
+// [offset, end_offset) to histogram. Unless offset is 0, the partial line is skipped, and the
+// records are resynchronized on a line starting with '@' whose third line starts with '+' and
+// whose second and fourth lines are of the same length (a QV line starting with '@' is
+// followed by a header, not '+').
+// Returns false if the records are not in four lines; finding no record in the range is fine.
+static bool sample_fastq_qvs(FileLineBufferWithAutoExpansion& f, off_t offset, off_t end_offset, size_t max_records, size_t histogram[256], size_t& number_of_qvs)
+{
+    const size_t MAX_LINES_TO_RESYNC = 64;
+    f.seekg(offset);
+    // seekg does not reset the line offsets of f, so positions are relative to this.
+    const off_t base = f.get_offset() - offset;
+    if(offset != 0 && !f.getline()) return true;
+    deque<string> lines;
+    off_t first_line_offset = f.get_offset() - base;
+    size_t number_of_records = 0;
+    size_t number_of_skipped_lines = 0;
+    while(number_of_records < max_records) {
+        if(end_offset <= first_line_offset) return true;
+        while(lines.size() < 4) {
+            if(!f.getline()) return true;
+            lines.push_back(f.b);
+        }
+        if(lines[0][0] == '@' && lines[2][0] == '+' && lines[1].size() == lines[3].size()) {
+            for(size_t i = 0; i < lines[3].size(); ++i) histogram[static_cast<unsigned char>(lines[3][i])]++;
+            number_of_qvs += lines[3].size();
+            number_of_records++;
+            lines.clear();
+            first_line_offset = f.get_offset() - base;
+            continue;
+        }
+        if(0 < number_of_records || MAX_LINES_TO_RESYNC < ++number_of_skipped_lines) return false;
+        first_line_offset += lines.front().size() + 1u;
+        lines.pop_front();
+    }
+    return true;
+}
+
+// guessqvtype --sample: reads blocks of records at evenly spaced offsets, and stops as soon as
+// a bad or Sanger-only QV character decides the type (no other character could overturn it
+// but a bad one). If the blocks have none, a Solexa-only character or QV 0/1 of Illumina 1.3
+// decides the type unless a Sanger-only character is in the rest of the file, which is reported
+// as a lower confidence. Each block stops at the offset of the next one, so no record is counted
+// twice in a small file. Returns false when a full scan is needed: the file is not seekable,
+// not in four-line FASTQ, or nothing in the blocks tells Illumina 1.5+ from the others.
+static bool sample_qv_type(const char* file_name, int number_of_blocks, string& verdict)
+{
+    const size_t RECORDS_PER_BLOCK = 1000;
+    struct stat st;
+    if(stat(file_name, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    FileLineBufferWithAutoExpansion f;
+    f.setRandomAccessMode();
+    if(!f.open(file_name)) return false;
+    size_t histogram[256];
+    for(int i = 0; i < 256; ++i) histogram[i] = 0;
+    size_t number_of_qvs = 0;
+    for(int block = 0; block < number_of_blocks; ++block) {
+        const off_t offset = static_cast<off_t>(static_cast<double>(st.st_size) * block / number_of_blocks);
+        const off_t end_offset = static_cast<off_t>(static_cast<double>(st.st_size) * (block + 1) / number_of_blocks);
+        if(!sample_fastq_qvs(f, offset, end_offset, RECORDS_PER_BLOCK, histogram, number_of_qvs)) return false;
+        const string type = guess_qv_type_from_histogram(histogram);
+        if(type.compare(0, 4, "bad\t") == 0 || type.compare(0, 7, "sanger\t") == 0) {
+            ostringstream os;
+            os << type << "\tcertain (sampled " << sep_comma(number_of_qvs) << " QVs in " << block + 1 << " of " << number_of_blocks << " blocks)";
+            verdict = os.str();
+            return true;
+        }
+    }
+    if(number_of_qvs == 0) return false;
+    const string type = guess_qv_type_from_histogram(histogram);
+    if(type.compare(0, 11, "illumina15\t") == 0) return false;
+    ostringstream os;
+    os << type << "\thigh (no Sanger-only QVs in " << sep_comma(number_of_qvs) << " QVs sampled from " << number_of_blocks << " blocks)";
+    verdict = os.str();
+    return true;
+}
+
+void do_guess_qv_type(int argc, char** argv)
+{
+    bool flag_sample = false;
+    int param_blocks = 16;
+    static struct option long_options[] = {
+        {"sample", no_argument, 0, 's'},
+        {"blocks", required_argument, 0, 'b'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 's':
+			flag_sample = true;
+			break;
+		case 'b':
+			param_blocks = atoi(optarg);
+			break;
+		}
+	}
+    if(param_blocks < 1) {
+        cerr << "ERROR: --blocks must be positive\n";
+        return;
+    }
+    for(int findex = optind + 1; findex < argc; ++findex) {
+        const char* file_name = argv[findex];
+        if(flag_sample) {
+            string verdict;
+            if(sample_qv_type(file_name, param_blocks, verdict)) {
+                cout << file_name << '\t' << verdict << '\n';
+                continue;
+            }
+        }
         FileLineBufferWithAutoExpansion f;
         if(!f.open(file_name)) {
             cerr << "Cannot open '" << file_name << "'" << endl;
@@ -1612,36 +6101,9 @@ void do_guess_qv_type(int argc, char** argv)
                 }
             }
         }
-        {
-            size_t numBadQVchars = 0;
-            for(int i = 0; i < 32; ++i)    numBadQVchars += histogram[i];
-            for(int i = 127; i < 256; ++i) numBadQVchars += histogram[i];
-            if(0 < numBadQVchars) {
-                cout << file_name << '\t' << "bad\tthe QV strings have " << numBadQVchars << " characters that do not look like QV chars.\n";
-                continue;
-            }
-        }
-        {
-            size_t numSangerOnlyQVchars = 0;
-            for(int i = 33; i <= 58; ++i)  numSangerOnlyQVchars += histogram[i];
-            if(0 < numSangerOnlyQVchars) {
-                cout << file_name << '\t' << "sanger\tIt must be Sanger FASTQ or Illumina 1.8+.\n";
-                continue;
-            }
-        }
-        {
-            size_t numSolexaOnlyQVchars = 0;
-            for(int i = 59; i <= 63; ++i)  numSolexaOnlyQVchars += histogram[i];
-            if(0 < numSolexaOnlyQVchars) {
-                cout << file_name << '\t' << "solexa\tIt must be Solexa FASTQ.\n";
-                continue;
-            }
-        }
-        if(0 < histogram[64] + histogram[65]) {
-            cout << file_name << '\t' << "illumina13\tIt must be Illumina 1.3+\n";
-            continue;
-        }
-        cout << file_name << '\t' << "illumina15\tIt looks like Illumina 1.5+\n";
+        cout << file_name << '\t' << guess_qv_type_from_histogram(histogram);
+        if(flag_sample) cout << "\tfull scan";
+        cout << '\n';
     }
 }
 
@@ -1890,6 +6352,10 @@ void fastq_to_fasta(const char* file_name)
 
 void clean_nucleotide_line(char* buffer, bool process_n, int char_change_into)
 {
+    // Most lines have nothing to change; they are found by the vectorized classification.
+    NucleotideClassCounts counts;
+    classify_nucleotides(buffer, strlen(buffer), counts);
+    if(counts.other == 0 && (!process_n || counts.n == 0)) return;
     for(char* p = buffer; *p != '\0'; p++) {
         const char c = toupper(*p);
         if(c != 'A' && c != 'C' && c != 'G' && c != 'T') {
@@ -2216,30 +6682,863 @@ void do_clean(int argc, char** argv)
 		case 't':
             flag_change_into_t = true;
 			break;
-		case 'n':
-            flag_change_into_n = true;
+		case 'n':
+            flag_change_into_n = true;
+			break;
+        case 'p':
+            flag_process_n = true;
+            break;
+        case 'r':
+            flag_random_change = true;
+            break;
+		}
+	}
+    const int num_change_flags = int(flag_change_into_a) + int(flag_change_into_c) + int(flag_change_into_g) + int(flag_change_into_t) + int(flag_change_into_n) + int(flag_random_change);
+    if(1 < num_change_flags) {
+        cerr << "ERROR: --a, --c, --g, --t, --n, --random are exclusive." << endl;
+        exit(1);
+    }
+    int char_change_into = -1; // -1 means a random char
+    if(flag_change_into_a) char_change_into = 'A';
+    if(flag_change_into_c) char_change_into = 'C';
+    if(flag_change_into_g) char_change_into = 'G';
+    if(flag_change_into_t) char_change_into = 'T';
+    if(flag_change_into_n) char_change_into = 'N';
+    for(int i = optind + 1; i < argc; ++i) {
+        clean_fastx(argv[i], flag_process_n, char_change_into);
+    }
+}
+
+// 2-bit codes of nucleotides: A=0, C=1, G=2, T=3, and 4 for the others.
+// Lowercase letters are nucleotides only if ignore_case; otherwise (soft-masked) they break k-mers.
+static void make_two_bit_code_table(unsigned char* table, bool ignore_case)
+{
+    fill(table, table + 256, 4);
+    table['A'] = 0; table['C'] = 1; table['G'] = 2; table['T'] = 3;
+    if(ignore_case) {
+        table['a'] = 0; table['c'] = 1; table['g'] = 2; table['t'] = 3;
+    }
+}
+
+static string decode_kmer(uint64_t kmer, int k)
+{
+    string s(k, 'A');
+    for(int i = k - 1; 0 <= i; --i) {
+        s[i] = "ACGT"[kmer & 3];
+        kmer >>= 2;
+    }
+    return s;
+}
+
+// Counts of k-mers (2-bit packed, k <= 31) in an open-addressing hash table,
+// for k too large for a dense array. The empty slot has a key that no k-mer can have.
+class KmerCountTable
+{
+    struct Slot {
+        uint64_t kmer;
+        uint64_t count;
+    };
+    static const uint64_t EMPTY = ~0ull;
+    vector<Slot> slots;
+    size_t mask;
+    size_t numberOfKmers;
+
+    void grow() {
+        vector<Slot> old_slots(slots.size() * 2);
+        old_slots.swap(slots);
+        for(size_t i = 0; i < slots.size(); ++i) slots[i].kmer = EMPTY;
+        mask = slots.size() - 1;
+        for(size_t i = 0; i < old_slots.size(); ++i) {
+            if(old_slots[i].kmer == EMPTY) continue;
+            size_t j = mix64(old_slots[i].kmer) & mask;
+            while(slots[j].kmer != EMPTY) j = (j + 1) & mask;
+            slots[j] = old_slots[i];
+        }
+    }
+
+public:
+    KmerCountTable() : slots(1u << 16), mask((1u << 16) - 1), numberOfKmers(0) {
+        for(size_t i = 0; i < slots.size(); ++i) slots[i].kmer = EMPTY;
+    }
+    void add(uint64_t kmer) {
+        size_t j = mix64(kmer) & mask;
+        while(true) {
+            if(slots[j].kmer == kmer) {
+                slots[j].count++;
+                return;
+            }
+            if(slots[j].kmer == EMPTY) break;
+            j = (j + 1) & mask;
+        }
+        slots[j].kmer = kmer;
+        slots[j].count = 1;
+        if(slots.size() * 7 < ++numberOfKmers * 10) grow();
+    }
+    size_t size() const { return numberOfKmers; }
+    template<class Function> void forEach(Function f) const {
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(slots[i].kmer != EMPTY) f(slots[i].kmer, slots[i].count);
+        }
+    }
+    // The k-mers that appeared, in ascending order.
+    void getSorted(vector<pair<uint64_t, uint64_t> >& kmers) const {
+        kmers.clear();
+        kmers.reserve(numberOfKmers);
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(slots[i].kmer != EMPTY) kmers.push_back(make_pair(slots[i].kmer, slots[i].count));
+        }
+        sort(kmers.begin(), kmers.end());
+    }
+};
+
+// composition --kmer=k: the counts of the k-mers (only those that appear) in one pass,
+// with the 1-mer stats from the same pass. K-mers do not span non-ACGT characters or reads.
+// k <= 12 counts into a dense array of 4^k, and larger k into a hash table.
+void count_kmers_in_file(const char* file_name, int k, bool canonical, bool ignore_case)
+{
+    FileLineBufferWithAutoExpansion f;
+    if(!f.open(file_name)) {
+        cerr << "Cannot open '" << file_name << "'" << endl;
+        return;
+    }
+    unsigned char codes[256];
+    make_two_bit_code_table(codes, ignore_case);
+    unsigned char folded[256];
+    for(int c = 0; c < 256; ++c) folded[c] = ignore_case ? toupper(c) : c;
+    const uint64_t kmer_mask = (1ull << (2 * k)) - 1;
+    const int reverse_shift = 2 * (k - 1);
+    const bool dense = k <= 12;
+    vector<uint64_t> dense_counts(dense ? size_t(1) << (2 * k) : 0);
+    KmerCountTable table;
+    size_t freq_1_mer[256];
+    fill(freq_1_mer, freq_1_mer + 256, 0);
+    unsigned long long total_kmers = 0;
+    FastxRecordReader reader(f);
+    FastxRecord r;
+    while(reader.next(r)) {
+        const string& seq = r.sequence;
+        uint64_t forward = 0;
+        uint64_t reverse = 0;
+        int valid = 0;
+        for(size_t i = 0; i < seq.size(); ++i) {
+            const unsigned char c = seq[i];
+            freq_1_mer[folded[c]]++;
+            const unsigned int code = codes[c];
+            if(code == 4) {
+                valid = 0;
+                continue;
+            }
+            forward = ((forward << 2) | code) & kmer_mask;
+            reverse = (reverse >> 2) | (static_cast<uint64_t>(3 - code) << reverse_shift);
+            if(++valid < k) continue;
+            const uint64_t kmer = canonical && reverse < forward ? reverse : forward;
+            if(dense) dense_counts[kmer]++;
+            else table.add(kmer);
+            total_kmers++;
+        }
+    }
+    const size_t total_n_nmers = accumulate(freq_1_mer, freq_1_mer + 256, 0llu);
+    cout << "Total # n-mers\n\t" << total_n_nmers << "\n";
+    cout.setf(ios_base::fixed, ios_base::floatfield);
+    cout << "1-mer stats\n";
+    for(size_t i = 0; i < 256; ++i) {
+        if(freq_1_mer[i] != 0) cout << "\t" << char(i) << "\t" << freq_1_mer[i] << "\t" << (double(freq_1_mer[i]) / total_n_nmers) << "\n";
+    }
+    cout << "Total # " << k << "-mers\n\t" << total_kmers << "\n";
+    cout << k << "-mer stats" << (canonical ? " (canonical)" : "") << "\n";
+    if(dense) {
+        for(size_t i = 0; i < dense_counts.size(); ++i) {
+            if(dense_counts[i] != 0) cout << "\t" << decode_kmer(i, k) << "\t" << dense_counts[i] << "\t" << (double(dense_counts[i]) / total_kmers) << "\n";
+        }
+    } else {
+        vector<pair<uint64_t, uint64_t> > kmers;
+        table.getSorted(kmers);
+        for(size_t i = 0; i < kmers.size(); ++i) {
+            cout << "\t" << decode_kmer(kmers[i].first, k) << "\t" << kmers[i].second << "\t" << (double(kmers[i].second) / total_kmers) << "\n";
+        }
+    }
+}
+
+// kmercount counts k-mers of data larger than memory in two passes.
+// In the first pass, worker threads split the reads into super-k-mers, maximal runs of
+// consecutive k-mers that share the same minimizer (of the canonical m-mers in a k-mer,
+// the one with the smallest hash), and append each to the bin (a temporary file) of its
+// minimizer, 2-bit packed after its length in LEB128. A k-mer and its reverse complement
+// have the same minimizer, so all the occurrences of a (canonical) k-mer are in one bin.
+// In the second pass, each thread counts one bin at a time in a KmerCountTable.
+class SuperKmerSplitter
+{
+    int k;
+    int m;
+    unsigned char codes[256];
+    vector<uint64_t> mmerHashes;
+
+public:
+    SuperKmerSplitter(int k, int m, bool ignore_case) : k(k), m(m) {
+        make_two_bit_code_table(codes, ignore_case);
+    }
+    unsigned int code(char c) const { return codes[static_cast<unsigned char>(c)]; }
+    // Calls emit(start, length, minimizer hash) for each super-k-mer in seq[0, length).
+    template<class Emit> void split(const char* seq, size_t length, Emit emit) {
+        const uint64_t mmer_mask = (1ull << (2 * m)) - 1;
+        const int reverse_shift = 2 * (m - 1);
+        const size_t window = k - m + 1;
+        size_t run_start = 0;
+        while(run_start < length) {
+            // Super-k-mers are in runs of ACGT.
+            while(run_start < length && code(seq[run_start]) == 4) ++run_start;
+            size_t run_end = run_start;
+            while(run_end < length && code(seq[run_end]) != 4) ++run_end;
+            if(static_cast<size_t>(k) <= run_end - run_start) {
+                mmerHashes.clear();
+                uint64_t forward = 0, reverse = 0;
+                for(size_t i = run_start; i < run_end; ++i) {
+                    const unsigned int c = code(seq[i]);
+                    forward = ((forward << 2) | c) & mmer_mask;
+                    reverse = (reverse >> 2) | (static_cast<uint64_t>(3 - c) << reverse_shift);
+                    if(static_cast<size_t>(m) <= i - run_start + 1) mmerHashes.push_back(mix64(min(forward, reverse)));
+                }
+                const size_t number_of_kmers = run_end - run_start - k + 1;
+                size_t min_position = 0;
+                size_t super_kmer_start = 0;
+                uint64_t current_minimizer = 0;
+                for(size_t i = 0; i < number_of_kmers; ++i) {
+                    if(i == 0 || min_position < i) {
+                        // The minimum has gone out of the window; scan the window again.
+                        min_position = i;
+                        for(size_t j = i + 1; j < i + window; ++j) {
+                            if(mmerHashes[j] < mmerHashes[min_position]) min_position = j;
+                        }
+                    } else if(mmerHashes[i + window - 1] < mmerHashes[min_position]) {
+                        min_position = i + window - 1;
+                    }
+                    const uint64_t minimizer = mmerHashes[min_position];
+                    if(i == 0) {
+                        current_minimizer = minimizer;
+                    } else if(minimizer != current_minimizer) {
+                        emit(run_start + super_kmer_start, i - super_kmer_start + k - 1, current_minimizer);
+                        super_kmer_start = i;
+                        current_minimizer = minimizer;
+                    }
+                }
+                emit(run_start + super_kmer_start, number_of_kmers - super_kmer_start + k - 1, current_minimizer);
+            }
+            run_start = run_end;
+        }
+    }
+};
+
+// The per-thread buffers of the bins; a buffer is appended to its bin file when it gets full.
+struct SuperKmerBinBuffers
+{
+    vector<string> buffers;
+    SuperKmerBinBuffers(size_t number_of_bins) : buffers(number_of_bins) {}
+};
+
+// The header of the database written by kmercount --db: "FATTKMR1", k and whether
+// the k-mers are canonical (uint32 each), and the number of k-mers (uint64), followed by
+// that many (k-mer (uint64, 2 bits per base, the first base in the highest bits), count
+// (uint32, saturated)) in ascending order of k-mers, all in the byte order of the machine.
+static const char KMER_DATABASE_MAGIC[8] = {'F', 'A', 'T', 'T', 'K', 'M', 'R', '1'};
+
+static bool write_kmer_entry(FILE* fp, uint64_t kmer, uint64_t count)
+{
+    const uint32_t saturated_count = count < 0xFFFFFFFFull ? static_cast<uint32_t>(count) : 0xFFFFFFFFu;
+    return fwrite(&kmer, sizeof(kmer), 1, fp) == 1 && fwrite(&saturated_count, sizeof(saturated_count), 1, fp) == 1;
+}
+
+static bool read_kmer_entry(FILE* fp, uint64_t& kmer, uint32_t& count)
+{
+    return fread(&kmer, sizeof(kmer), 1, fp) == 1 && fread(&count, sizeof(count), 1, fp) == 1;
+}
+
+// kmercount --dump: prints a database as text.
+static void dump_kmer_database(const char* file_name)
+{
+    FILE* fp = fopen(file_name, "rb");
+    if(fp == NULL) {
+        cerr << "ERROR: Cannot open '" << file_name << "'" << endl;
+        return;
+    }
+    char magic[8];
+    uint32_t k, canonical;
+    uint64_t number_of_kmers;
+    if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, KMER_DATABASE_MAGIC, 8) != 0 ||
+       fread(&k, sizeof(k), 1, fp) != 1 || fread(&canonical, sizeof(canonical), 1, fp) != 1 ||
+       fread(&number_of_kmers, sizeof(number_of_kmers), 1, fp) != 1 || k < 1 || 31 < k) {
+        cerr << "ERROR: '" << file_name << "' is not a k-mer database written by kmercount --db" << endl;
+        fclose(fp);
+        return;
+    }
+    uint64_t kmer;
+    uint32_t count;
+    for(uint64_t i = 0; i < number_of_kmers && read_kmer_entry(fp, kmer, count); ++i) {
+        cout << decode_kmer(kmer, k) << '\t' << count << '\n';
+    }
+    fclose(fp);
+}
+
+// Counts the k-mers in a bin file into table.
+static void count_kmers_in_bin(FILE* bin, int k, bool canonical, KmerCountTable& table)
+{
+    const uint64_t kmer_mask = (1ull << (2 * k)) - 1;
+    const int reverse_shift = 2 * (k - 1);
+    vector<unsigned char> packed;
+    while(true) {
+        uint64_t length = 0;
+        int c;
+        for(int shift = 0; (c = getc(bin)) != EOF; shift += 7) {
+            length |= static_cast<uint64_t>(c & 0x7f) << shift;
+            if((c & 0x80) == 0) break;
+        }
+        if(c == EOF) break;
+        packed.resize((length + 3) / 4);
+        if(fread(&packed[0], 1, packed.size(), bin) != packed.size()) break;
+        uint64_t forward = 0, reverse = 0;
+        for(uint64_t i = 0; i < length; ++i) {
+            const unsigned int code = (packed[i / 4] >> (6 - 2 * (i % 4))) & 3;
+            forward = ((forward << 2) | code) & kmer_mask;
+            reverse = (reverse >> 2) | (static_cast<uint64_t>(3 - code) << reverse_shift);
+            if(i + 1 < static_cast<uint64_t>(k)) continue;
+            table.add(canonical && reverse < forward ? reverse : forward);
+        }
+    }
+}
+
+void do_kmercount(int argc, char** argv)
+{
+    int param_k = 21;
+    int param_m = 11;
+    bool flag_canonical = false;
+    bool flag_ignore_case = false;
+    int param_threads = 1;
+    long long param_memory_mib = 1024;
+    long long param_max_count = 10000;
+    string param_tmpdir;
+    string param_db;
+    bool flag_dump = false;
+    static struct option long_options[] = {
+        {"kmer", required_argument, 0, 'k'},
+        {"minimizer", required_argument, 0, 'm'},
+        {"canonical", no_argument, 0, 'c'},
+        {"ignorecase", no_argument, 0, 'i'},
+        {"threads", required_argument, 0, 't'},
+        {"memory", required_argument, 0, 'M'},
+        {"maxcount", required_argument, 0, 'x'},
+        {"tmpdir", required_argument, 0, 'T'},
+        {"db", required_argument, 0, 'd'},
+        {"dump", no_argument, 0, 'D'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'k':
+			param_k = atoi(optarg);
+			break;
+		case 'm':
+			param_m = atoi(optarg);
+			break;
+		case 'c':
+			flag_canonical = true;
+			break;
+		case 'i':
+			flag_ignore_case = true;
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		case 'M':
+			param_memory_mib = atoll(optarg);
+			break;
+		case 'x':
+			param_max_count = atoll(optarg);
+			break;
+		case 'T':
+			param_tmpdir = optarg;
+			break;
+		case 'd':
+			param_db = optarg;
+			break;
+		case 'D':
+			flag_dump = true;
+			break;
+		}
+	}
+    if(flag_dump) {
+        for(int i = optind + 1; i < argc; ++i) dump_kmer_database(argv[i]);
+        return;
+    }
+    if(param_k < 1 || 31 < param_k) {
+        cerr << "ERROR: --kmer must be between 1 and 31\n";
+        return;
+    }
+    param_m = min(param_m, param_k);
+    if(param_m < 1 || param_threads < 1 || param_memory_mib < 1 || param_max_count < 1) {
+        cerr << "ERROR: --minimizer, --threads, --memory and --maxcount must be positive\n";
+        return;
+    }
+    vector<const char*> file_names(argv + optind + 1, argv + argc);
+    if(file_names.empty()) {
+        cerr << "ERROR: No input files." << endl;
+        return;
+    }
+    // The number of bins is chosen so that the table of a bin, about 32 bytes per distinct
+    // k-mer at worst, fits in the memory of a thread, taking every base as a distinct k-mer.
+    unsigned long long input_size = 0;
+    for(size_t i = 0; i < file_names.size(); ++i) {
+        struct stat st;
+        if(stat(file_names[i], &st) == 0 && S_ISREG(st.st_mode)) input_size += st.st_size;
+    }
+    const unsigned long long memory_per_thread = (static_cast<unsigned long long>(param_memory_mib) << 20) / param_threads;
+    const size_t MAX_BINS = 512;
+    size_t number_of_bins = max<size_t>(16u, (input_size * 32 + memory_per_thread - 1) / memory_per_thread);
+    if(MAX_BINS < number_of_bins) {
+        cerr << "WARNING: " << MAX_BINS << " bins may not fit in --memory=" << param_memory_mib << "; counting may use more memory.\n";
+        number_of_bins = MAX_BINS;
+    }
+    const string temporary_directory = param_tmpdir.empty() ? get_temporary_directory() : param_tmpdir;
+    vector<FILE*> bins(number_of_bins);
+    for(size_t i = 0; i < number_of_bins; ++i) {
+        bins[i] = create_anonymous_temporary_file(temporary_directory);
+        if(bins[i] == NULL) {
+            cerr << "ERROR: Cannot create a temporary file in '" << temporary_directory << "'" << endl;
+            for(size_t j = 0; j < i; ++j) fclose(bins[j]);
+            return;
+        }
+    }
+    vector<std::mutex> bin_mutexes(number_of_bins);
+    std::atomic<bool> write_error(false);
+    const size_t BUFFER_SIZE_TO_FLUSH = 16u * 1024u;
+    auto flush_buffer = [&](size_t bin, string& buffer) {
+        std::lock_guard<std::mutex> lock(bin_mutexes[bin]);
+        if(fwrite(buffer.data(), 1, buffer.size(), bins[bin]) != buffer.size()) write_error = true;
+        buffer.clear();
+    };
+
+    // The first pass: reads -> super-k-mers in bins.
+    AccumulatorPool<SuperKmerSplitter> splitters([&]() { return new SuperKmerSplitter(param_k, param_m, flag_ignore_case); });
+    AccumulatorPool<SuperKmerBinBuffers> buffers([&]() { return new SuperKmerBinBuffers(number_of_bins); });
+    ParallelRecordScanner scanner(param_threads);
+    const bool succeeded = scanner.run(file_names, [&](RecordBatch& batch) {
+        SuperKmerSplitter* splitter = splitters.take();
+        SuperKmerBinBuffers* bin_buffers = buffers.take();
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            const string& seq = batch.records[i].sequence;
+            splitter->split(seq.data(), seq.size(), [&](size_t start, size_t length, uint64_t minimizer) {
+                // Minimizers are the smallest hashes in their windows; hash them again to spread them evenly.
+                const size_t bin = static_cast<size_t>(((mix64(minimizer) >> 32) * number_of_bins) >> 32);
+                string& buffer = bin_buffers->buffers[bin];
+                uint64_t n = length;
+                while(0x80 <= n) {
+                    buffer += static_cast<char>((n & 0x7f) | 0x80);
+                    n >>= 7;
+                }
+                buffer += static_cast<char>(n);
+                unsigned char packed = 0;
+                for(size_t j = 0; j < length; ++j) {
+                    packed = (packed << 2) | splitter->code(seq[start + j]);
+                    if(j % 4 == 3) {
+                        buffer += static_cast<char>(packed);
+                        packed = 0;
+                    }
+                }
+                if(length % 4 != 0) buffer += static_cast<char>(packed << (2 * (4 - length % 4)));
+                if(BUFFER_SIZE_TO_FLUSH <= buffer.size()) flush_buffer(bin, buffer);
+            });
+        }
+        buffers.giveBack(bin_buffers);
+        splitters.giveBack(splitter);
+    }, [&](RecordBatch&) {
+    });
+    for(size_t i = 0; i < buffers.accumulators().size(); ++i) {
+        for(size_t bin = 0; bin < number_of_bins; ++bin) flush_buffer(bin, buffers.accumulators()[i]->buffers[bin]);
+    }
+    if(!succeeded || write_error) {
+        if(write_error) cerr << "ERROR: Cannot write to a temporary file in '" << temporary_directory << "'" << endl;
+        for(size_t i = 0; i < number_of_bins; ++i) fclose(bins[i]);
+        return;
+    }
+
+    // The second pass: each thread counts a bin at a time. With --db, the k-mers of each bin
+    // are sorted into a run (a temporary file), and the runs are merged at the end.
+    std::atomic<size_t> next_bin(0);
+    vector<vector<uint64_t> > histograms(param_threads, vector<uint64_t>(param_max_count + 1, 0));
+    vector<FILE*> runs(number_of_bins, static_cast<FILE*>(NULL));
+    vector<uint64_t> number_of_kmers_in_runs(number_of_bins, 0);
+    auto count_bins = [&](int thread_index) {
+        vector<uint64_t>& histogram = histograms[thread_index];
+        vector<pair<uint64_t, uint64_t> > sorted_kmers;
+        for(size_t bin; (bin = next_bin++) < number_of_bins; ) {
+            KmerCountTable table;
+            if(fflush(bins[bin]) != 0 || fseek(bins[bin], 0, SEEK_SET) != 0) {
+                write_error = true;
+                continue;
+            }
+            count_kmers_in_bin(bins[bin], param_k, flag_canonical, table);
+            fclose(bins[bin]);
+            bins[bin] = NULL;
+            table.forEach([&](uint64_t, uint64_t count) {
+                histogram[min<uint64_t>(count, param_max_count)]++;
+            });
+            if(param_db.empty()) continue;
+            table.getSorted(sorted_kmers);
+            runs[bin] = create_anonymous_temporary_file(temporary_directory);
+            if(runs[bin] == NULL) {
+                write_error = true;
+                continue;
+            }
+            for(size_t i = 0; i < sorted_kmers.size(); ++i) {
+                if(!write_kmer_entry(runs[bin], sorted_kmers[i].first, sorted_kmers[i].second)) write_error = true;
+            }
+            number_of_kmers_in_runs[bin] = sorted_kmers.size();
+        }
+    };
+    vector<std::thread> threads;
+    for(int i = 1; i < param_threads; ++i) threads.push_back(std::thread(count_bins, i));
+    count_bins(0);
+    for(size_t i = 0; i < threads.size(); ++i) threads[i].join();
+    for(size_t i = 1; i < histograms.size(); ++i) {
+        for(size_t j = 0; j < histograms[i].size(); ++j) histograms[0][j] += histograms[i][j];
+    }
+    const vector<uint64_t>& histogram = histograms[0];
+
+    if(!param_db.empty() && !write_error) {
+        FILE* db = fopen(param_db.c_str(), "wb");
+        if(db == NULL) {
+            cerr << "ERROR: Cannot open '" << param_db << "'" << endl;
+        } else {
+            const uint32_t k = param_k;
+            const uint32_t canonical = flag_canonical ? 1 : 0;
+            const uint64_t number_of_kmers = accumulate(number_of_kmers_in_runs.begin(), number_of_kmers_in_runs.end(), 0ull);
+            fwrite(KMER_DATABASE_MAGIC, 1, 8, db);
+            fwrite(&k, sizeof(k), 1, db);
+            fwrite(&canonical, sizeof(canonical), 1, db);
+            fwrite(&number_of_kmers, sizeof(number_of_kmers), 1, db);
+            typedef pair<uint64_t, pair<uint32_t, size_t> > KmerCountAndRun;
+            priority_queue<KmerCountAndRun, vector<KmerCountAndRun>, greater<KmerCountAndRun> > heads;
+            for(size_t i = 0; i < number_of_bins; ++i) {
+                uint64_t kmer;
+                uint32_t count;
+                if(runs[i] == NULL || fflush(runs[i]) != 0 || fseek(runs[i], 0, SEEK_SET) != 0) continue;
+                if(read_kmer_entry(runs[i], kmer, count)) heads.push(make_pair(kmer, make_pair(count, i)));
+            }
+            while(!heads.empty()) {
+                const KmerCountAndRun head = heads.top();
+                heads.pop();
+                if(!write_kmer_entry(db, head.first, head.second.first)) write_error = true;
+                uint64_t kmer;
+                uint32_t count;
+                if(read_kmer_entry(runs[head.second.second], kmer, count)) heads.push(make_pair(kmer, make_pair(count, head.second.second)));
+            }
+            if(fclose(db) != 0) write_error = true;
+        }
+    }
+    for(size_t i = 0; i < number_of_bins; ++i) {
+        if(bins[i] != NULL) fclose(bins[i]);
+        if(runs[i] != NULL) fclose(runs[i]);
+    }
+    if(write_error) {
+        cerr << "ERROR: Cannot write a temporary file (or the database); the output is not complete." << endl;
+        return;
+    }
+    // The histogram, as "count\tthe number of distinct k-mers with that count"; the last line includes larger counts.
+    unsigned long long number_of_kmers = 0;
+    unsigned long long number_of_distinct_kmers = 0;
+    for(size_t count = 1; count < histogram.size(); ++count) {
+        if(histogram[count] == 0) continue;
+        cout << count << '\t' << histogram[count] << '\n';
+        number_of_distinct_kmers += histogram[count];
+        number_of_kmers += histogram[count] * count;
+    }
+    cerr << sep_comma(number_of_distinct_kmers) << " distinct " << param_k << "-mers (" << sep_comma(histogram[1]) << " unique) in " << number_of_bins << " bins";
+    if(histogram.back() == 0) cerr << ", " << sep_comma(number_of_kmers) << " in total";
+    cerr << "\n";
+}
+
+// A MinHash sketch of the canonical k-mers of a file, for sketch and compare-sketches.
+// The hash of a k-mer is mix64 of its canonical 2-bit code; soft-masked bases are
+// not distinguished. A bottom-k sketch keeps the smallest `size` hashes; a FracMinHash
+// sketch (scaled != 0) keeps every hash below 2^64 / scaled, so it grows with the genome.
+// In a sketch file, each sketch is "FATTSKH1" followed by unsigned LEB128 numbers:
+// k, size, scaled, the number of k-mers seen, the length of the name and its bytes,
+// the number of hashes and the hashes in ascending order, each coded as the difference
+// from the previous one. A file may hold any number of sketches.
+struct MinHashSketch
+{
+    uint64_t k;
+    uint64_t size;
+    uint64_t scaled;
+    uint64_t numberOfKmers;
+    string name;
+    vector<uint64_t> hashes; // sorted, no duplicates
+    uint64_t threshold;      // hashes not below threshold are not kept
+    vector<uint64_t> pending;
+
+    MinHashSketch(uint64_t k = 0, uint64_t size = 0, uint64_t scaled = 0)
+        : k(k), size(size), scaled(scaled), numberOfKmers(0), threshold(scaled == 0 ? ~0ull : ~0ull / scaled) {}
+    void add(uint64_t hash) {
+        if(threshold <= hash) return;
+        pending.push_back(hash);
+        if(max<size_t>(size, 4096u) <= pending.size()) flush();
+    }
+    void flush() {
+        if(pending.empty()) return;
+        sort(pending.begin(), pending.end());
+        pending.erase(unique(pending.begin(), pending.end()), pending.end());
+        const size_t middle = hashes.size();
+        hashes.insert(hashes.end(), pending.begin(), pending.end());
+        inplace_merge(hashes.begin(), hashes.begin() + middle, hashes.end());
+        hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+        pending.clear();
+        if(scaled == 0 && size <= hashes.size()) {
+            hashes.resize(size);
+            threshold = hashes.back();
+        }
+    }
+    void merge(MinHashSketch& other) {
+        other.flush();
+        numberOfKmers += other.numberOfKmers;
+        for(size_t i = 0; i < other.hashes.size(); ++i) add(other.hashes[i]);
+        flush();
+    }
+    bool write(ostream& os) const {
+        string buffer = "FATTSKH1";
+        PartialStatistics::writeNumber(buffer, k);
+        PartialStatistics::writeNumber(buffer, size);
+        PartialStatistics::writeNumber(buffer, scaled);
+        PartialStatistics::writeNumber(buffer, numberOfKmers);
+        PartialStatistics::writeNumber(buffer, name.size());
+        buffer += name;
+        PartialStatistics::writeNumber(buffer, hashes.size());
+        uint64_t previous_hash = 0;
+        for(size_t i = 0; i < hashes.size(); ++i) {
+            PartialStatistics::writeNumber(buffer, hashes[i] - previous_hash);
+            previous_hash = hashes[i];
+        }
+        os.write(buffer.data(), buffer.size());
+        return !os.fail();
+    }
+    bool read(istream& is) {
+        char magic[8];
+        if(!is.read(magic, sizeof(magic)) || memcmp(magic, "FATTSKH1", sizeof(magic)) != 0) return false;
+        uint64_t name_length, number_of_hashes;
+        if(!PartialStatistics::readNumber(is, k) || !PartialStatistics::readNumber(is, size) ||
+           !PartialStatistics::readNumber(is, scaled) || !PartialStatistics::readNumber(is, numberOfKmers) ||
+           !PartialStatistics::readNumber(is, name_length) || name_length > (1u << 20)) return false;
+        name.resize(name_length);
+        if(name_length != 0 && !is.read(&name[0], name_length)) return false;
+        if(!PartialStatistics::readNumber(is, number_of_hashes)) return false;
+        hashes.clear();
+        uint64_t hash = 0;
+        for(uint64_t i = 0; i < number_of_hashes; ++i) {
+            uint64_t delta;
+            if(!PartialStatistics::readNumber(is, delta)) return false;
+            hash += delta;
+            hashes.push_back(hash);
+        }
+        threshold = scaled == 0 ? ~0ull : ~0ull / scaled;
+        return true;
+    }
+};
+
+// Sketches the canonical k-mers of a file into sketch on the given number of threads.
+static bool sketch_file(const char* file_name, MinHashSketch& sketch, int threads)
+{
+    const int k = sketch.k;
+    unsigned char codes[256];
+    make_two_bit_code_table(codes, true);
+    const uint64_t kmer_mask = (1ull << (2 * k)) - 1;
+    const int reverse_shift = 2 * (k - 1);
+    AccumulatorPool<MinHashSketch> sketches([&]() { return new MinHashSketch(sketch.k, sketch.size, sketch.scaled); });
+    ParallelRecordScanner scanner(threads);
+    const bool succeeded = scanner.run(vector<const char*>(1, file_name), [&](RecordBatch& batch) {
+        MinHashSketch* s = sketches.take();
+        for(size_t i = 0; i < batch.numberOfRecords; ++i) {
+            const string& seq = batch.records[i].sequence;
+            uint64_t forward = 0;
+            uint64_t reverse = 0;
+            int valid = 0;
+            for(size_t j = 0; j < seq.size(); ++j) {
+                const unsigned int code = codes[static_cast<unsigned char>(seq[j])];
+                if(code == 4) {
+                    valid = 0;
+                    continue;
+                }
+                forward = ((forward << 2) | code) & kmer_mask;
+                reverse = (reverse >> 2) | (static_cast<uint64_t>(3 - code) << reverse_shift);
+                if(++valid < k) continue;
+                s->numberOfKmers++;
+                s->add(mix64(min(forward, reverse)));
+            }
+        }
+        sketches.giveBack(s);
+    }, [&](RecordBatch&) {
+    });
+    for(size_t i = 0; i < sketches.accumulators().size(); ++i) sketch.merge(*sketches.accumulators()[i]);
+    sketch.flush();
+    return succeeded;
+}
+
+void do_sketch(int argc, char** argv)
+{
+    int param_k = 21;
+    long long param_size = 1000;
+    long long param_scaled = 0;
+    int param_threads = 1;
+    string param_output;
+    static struct option long_options[] = {
+        {"kmer", required_argument, 0, 'k'},
+        {"size", required_argument, 0, 's'},
+        {"scaled", required_argument, 0, 'S'},
+        {"threads", required_argument, 0, 't'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'k':
+			param_k = atoi(optarg);
+			break;
+		case 's':
+			param_size = atoll(optarg);
+			break;
+		case 'S':
+			param_scaled = atoll(optarg);
+			break;
+		case 't':
+			param_threads = atoi(optarg);
+			break;
+		case 'o':
+			param_output = optarg;
+			break;
+		}
+	}
+    if(param_k < 1 || 31 < param_k) {
+        cerr << "ERROR: --kmer must be between 1 and 31\n";
+        return;
+    }
+    if(param_size < 1 || param_scaled < 0 || param_threads < 1) {
+        cerr << "ERROR: --size and --threads must be positive, and --scaled must not be negative\n";
+        return;
+    }
+    if(optind + 1 >= argc) {
+        cerr << "ERROR: No input files." << endl;
+        return;
+    }
+    // All the sketches go to --output if given, or else to <input>.sketch each.
+    ofstream output;
+    if(!param_output.empty()) {
+        output.open(param_output.c_str(), ios::binary);
+        if(!output) {
+            cerr << "ERROR: Cannot open '" << param_output << "'" << endl;
+            return;
+        }
+    }
+    for(int i = optind + 1; i < argc; ++i) {
+        MinHashSketch sketch(param_k, param_scaled == 0 ? param_size : 0, param_scaled);
+        sketch.name = argv[i];
+        if(!sketch_file(argv[i], sketch, param_threads)) {
+            cerr << "ERROR: Cannot read '" << argv[i] << "'" << endl;
+            continue;
+        }
+        const string output_file_name = param_output.empty() ? string(argv[i]) + ".sketch" : param_output;
+        ofstream individual_output;
+        if(param_output.empty()) individual_output.open(output_file_name.c_str(), ios::binary);
+        ostream& os = param_output.empty() ? static_cast<ostream&>(individual_output) : output;
+        if(!os || !sketch.write(os)) {
+            cerr << "ERROR: Cannot write '" << output_file_name << "'" << endl;
+            return;
+        }
+    }
+}
+
+// Estimates the Jaccard index of the k-mer sets of two sketches; shared and total are
+// the numbers of the hashes in both and in either, among those compared.
+// Two FracMinHash sketches are compared on the hashes below both thresholds. Otherwise,
+// as in Mash, the smallest s hashes of the union are compared, s being the smaller size.
+static double estimate_jaccard(const MinHashSketch& a, const MinHashSketch& b, size_t& shared, size_t& total)
+{
+    const bool bottom_k = a.scaled == 0 || b.scaled == 0;
+    const uint64_t threshold = min(a.threshold, b.threshold);
+    const size_t s = bottom_k ? min(a.scaled == 0 ? a.size : a.hashes.size(), b.scaled == 0 ? b.size : b.hashes.size()) : ~size_t(0);
+    shared = total = 0;
+    size_t i = 0, j = 0;
+    while(total < s && (i < a.hashes.size() || j < b.hashes.size())) {
+        const uint64_t next = j == b.hashes.size() || (i < a.hashes.size() && a.hashes[i] < b.hashes[j]) ? a.hashes[i] : b.hashes[j];
+        if(!bottom_k && threshold <= next) break;
+        const bool in_a = i < a.hashes.size() && a.hashes[i] == next;
+        const bool in_b = j < b.hashes.size() && b.hashes[j] == next;
+        if(in_a && in_b) shared++;
+        if(in_a) i++;
+        if(in_b) j++;
+        total++;
+    }
+    return total == 0 ? 0 : double(shared) / total;
+}
+
+void do_compare_sketches(int argc, char** argv)
+{
+    double param_min_ani = 0;
+    static struct option long_options[] = {
+        {"min-ani", required_argument, 0, 'a'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 'a':
+			param_min_ani = atof(optarg);
 			break;
-        case 'p':
-            flag_process_n = true;
-            break;
-        case 'r':
-            flag_random_change = true;
-            break;
 		}
 	}
-    const int num_change_flags = int(flag_change_into_a) + int(flag_change_into_c) + int(flag_change_into_g) + int(flag_change_into_t) + int(flag_change_into_n) + int(flag_random_change);
-    if(1 < num_change_flags) {
-        cerr << "ERROR: --a, --c, --g, --t, --n, --random are exclusive." << endl;
-        exit(1);
-    }
-    int char_change_into = -1; // -1 means a random char
-    if(flag_change_into_a) char_change_into = 'A';
-    if(flag_change_into_c) char_change_into = 'C';
-    if(flag_change_into_g) char_change_into = 'G';
-    if(flag_change_into_t) char_change_into = 'T';
-    if(flag_change_into_n) char_change_into = 'N';
+    vector<MinHashSketch> sketches;
     for(int i = optind + 1; i < argc; ++i) {
-        clean_fastx(argv[i], flag_process_n, char_change_into);
+        ifstream ifs(argv[i], ios::binary);
+        if(!ifs) {
+            cerr << "ERROR: Cannot open '" << argv[i] << "'" << endl;
+            return;
+        }
+        while(ifs.peek() != EOF) {
+            sketches.push_back(MinHashSketch());
+            if(!sketches.back().read(ifs)) {
+                cerr << "ERROR: '" << argv[i] << "' is not a sketch file written by sketch" << endl;
+                return;
+            }
+        }
+    }
+    for(size_t i = 1; i < sketches.size(); ++i) {
+        if(sketches[i].k != sketches[0].k) {
+            cerr << "ERROR: '" << sketches[i].name << "' is sketched with k = " << sketches[i].k << ", while '" << sketches[0].name << "' with k = " << sketches[0].k << endl;
+            return;
+        }
+    }
+    // For each pair: names, Jaccard index, ANI (1 - Mash distance), shared hashes/compared hashes.
+    cout.setf(ios_base::fixed, ios_base::floatfield);
+    for(size_t i = 0; i < sketches.size(); ++i) {
+        for(size_t j = i + 1; j < sketches.size(); ++j) {
+            size_t shared, total;
+            const double jaccard = estimate_jaccard(sketches[i], sketches[j], shared, total);
+            const double ani = jaccard == 0 ? 0 : pow(2 * jaccard / (1 + jaccard), 1.0 / sketches[i].k);
+            if(ani < param_min_ani) continue;
+            cout << sketches[i].name << '\t' << sketches[j].name << '\t' << setprecision(6) << jaccard << '\t' << ani << '\t' << shared << '/' << total << '\n';
+        }
     }
 }
 
@@ -2251,6 +7550,8 @@ void do_composition(int argc, char** argv)
     bool flag_only_trimer  = false;
     bool flag_dapi_check   = false;
     bool flag_count_ends   = false;
+    bool flag_canonical    = false;
+    int param_kmer = 0;
     static struct option long_options[] = {
         {"ignorecase", no_argument, 0, 'i'},
         {"monomer", no_argument, 0, '1'},
@@ -2258,6 +7559,8 @@ void do_composition(int argc, char** argv)
         {"trimer", no_argument, 0, '3'},
         {"dapicheck", no_argument, 0, 'd'},
         {"countends", no_argument, 0, 'c'},
+        {"kmer", required_argument, 0, 'k'},
+        {"canonical", no_argument, 0, 'C'},
         {0, 0, 0, 0} // end of long options
     };
     while(true) {
@@ -2286,7 +7589,23 @@ void do_composition(int argc, char** argv)
         case 'c':
             flag_count_ends = true;
             break;
+        case 'k':
+            param_kmer = atoi(optarg);
+            break;
+        case 'C':
+            flag_canonical = true;
+            break;
+        }
+    }
+    if(param_kmer != 0 || flag_canonical) {
+        if(param_kmer < 1 || 31 < param_kmer) {
+            cerr << "ERROR: --kmer must be between 1 and 31\n";
+            return;
+        }
+        for(int i = optind + 1; i < argc; ++i) {
+            count_kmers_in_file(argv[i], param_kmer, flag_canonical, flag_ignore_case);
         }
+        return;
     }
     for(int i = optind + 1; i < argc; ++i) {
         investigate_composition(argv[i], flag_ignore_case, flag_only_monomer, flag_only_bimer, flag_only_trimer, flag_dapi_check, flag_count_ends);
@@ -2548,6 +7867,7 @@ public:
             cerr << "You have to create the index of '" << sequence_file_name << "' first.\n"; return false;
         }
         FileLineBufferWithAutoExpansion f;
+        f.setRandomAccessMode();
         if(!f.open(sequence_file_name.c_str())) {
             cerr << "Could not open file '" << sequence_file_name << "'" << endl; return false;
         }
@@ -2563,7 +7883,8 @@ public:
         if(is_verbose) { cerr << "MODE: " << (is_fastq ? "fastq" : "fasta") << endl; }
         const string index_file_name = get_index_file_name(sequence_file_name.c_str());
         try {
-            sqdb::Db db(index_file_name.c_str());
+            sqdb::Db db(index_file_name.c_str(), sqdb::Db::OPEN_READONLY_IMMUTABLE);
+            db.UseQueryProfile();
             sqdb::Statement stmt = db.Query("select pos from seqpos where name=?");
             stmt.Bind(1, sequence_name);
             if(stmt.Next()) {
@@ -2998,6 +8319,492 @@ void do_edit(int argc, char** argv)
     GenomeEditScript ges(argv, optind + 1, argc, flag_verbose);
 }
 
+// Server mode. A request and a response are both a frame, which is a 4-byte
+// payload length in network byte order followed by the payload.
+// A request payload is a command and its arguments separated by tabs.
+// A response payload starts with a status byte ('O' for success, 'E' for
+// failure) followed by the result or an error message.
+// Requests are small, so a large length means a broken client. Responses can be
+// chromosome-scale records and are limited only by the 4-byte length.
+static const size_t SERVER_MAX_REQUEST_SIZE = 64 * 1024u * 1024u;
+static const size_t SERVER_MAX_RESPONSE_SIZE = 0xFFFFFFFFu;
+
+static bool read_frame(int fd, string& payload, size_t max_size)
+{
+    uint32_t size_in_network_order;
+    if(!read_fully(fd, reinterpret_cast<char*>(&size_in_network_order), sizeof(size_in_network_order))) return false;
+    const size_t size = ntohl(size_in_network_order);
+    if(max_size < size) {
+        cerr << "ERROR: a frame of " << size << " bytes is larger than the limit (" << max_size << " bytes)" << endl;
+        return false;
+    }
+    payload.resize(size);
+    return size == 0 || read_fully(fd, &payload[0], size);
+}
+
+static bool write_frame(int fd, const string& payload)
+{
+    if(SERVER_MAX_RESPONSE_SIZE < payload.size()) {
+        cerr << "ERROR: a frame of " << payload.size() << " bytes does not fit in the 4-byte length" << endl;
+        return false;
+    }
+    const uint32_t size_in_network_order = htonl(static_cast<uint32_t>(payload.size()));
+    if(!write_fully(fd, reinterpret_cast<const char*>(&size_in_network_order), sizeof(size_in_network_order))) return false;
+    return write_fully(fd, payload.data(), payload.size());
+}
+
+static vector<string> split_by_tab(const string& s)
+{
+    vector<string> retval;
+    string::size_type i = 0;
+    while(true) {
+        const string::size_type j = s.find('\t', i);
+        if(j == string::npos) {
+            retval.push_back(s.substr(i));
+            break;
+        }
+        retval.push_back(s.substr(i, j - i));
+        i = j + 1;
+    }
+    return retval;
+}
+
+// A FASTA/FASTQ file mapped into memory together with its index.
+// It follows the same record boundary rules as FileLineBufferWithAutoExpansion.
+class ResidentSequenceFile
+{
+    string fileName;
+    string indexFileName;
+    struct stat fileStat;  ///< when loaded
+    struct stat indexStat;
+    bool isFASTQ;
+    const char* data;
+    size_t size;
+    long long numberOfSequences;
+    sqdb::ConnectionPool* pool;
+
+    size_t nextLine(size_t pos) const {
+        const size_t eol = find_end_of_line(data, size, pos);
+        return eol < size ? eol + 1 : size;
+    }
+    size_t lineLength(size_t pos) const {
+        size_t eol = find_end_of_line(data, size, pos);
+        if(pos < eol && data[eol - 1] == '\r') eol--;
+        return eol - pos;
+    }
+    static bool isSameFile(const struct stat& a, const struct stat& b) {
+        return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+            && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+    }
+
+    // The lines of the sequence or the QVs of a record. If all the lines but
+    // the last have the same width and terminator, the offset of the i-th
+    // character is computed without walking the lines.
+    struct LineGrid {
+        size_t start;
+        size_t width;
+        size_t stride; ///< width plus the line terminator
+        size_t total;  ///< the number of characters in all the lines
+        size_t numberOfLines;
+        bool uniform;
+        bool closed;   ///< a shorter line has been seen, which must be the last
+        LineGrid(size_t start = 0) : start(start), width(0), stride(0), total(0), numberOfLines(0), uniform(true), closed(false) {}
+        void add(size_t length, size_t line_stride) {
+            if(numberOfLines == 0) {
+                width = length;
+                stride = line_stride;
+            } else if(closed || width < length) {
+                uniform = false;
+            } else if(length < width || line_stride != stride) {
+                closed = true;
+            }
+            total += length;
+            numberOfLines++;
+        }
+    };
+    struct RecordLayout {
+        size_t end; ///< just past the record
+        LineGrid sequence;
+        LineGrid qv;
+    };
+    // Layouts of records larger than this are kept, so that queries on
+    // chromosome-scale records do not walk all the lines every time.
+    static const size_t MIN_CACHED_RECORD_SIZE = 1024u * 1024u;
+    mutable std::mutex layoutMutex;
+    mutable map<size_t, RecordLayout> layouts;
+
+    // Follows the same record boundary rules as FileLineBufferWithAutoExpansion.
+    RecordLayout computeLayout(size_t pos) const {
+        RecordLayout layout;
+        size_t cursor = nextLine(pos);
+        layout.sequence = LineGrid(cursor);
+        while(cursor < size && data[cursor] != (isFASTQ ? '+' : '>')) {
+            const size_t next = nextLine(cursor);
+            layout.sequence.add(lineLength(cursor), next - cursor);
+            cursor = next;
+        }
+        if(isFASTQ && cursor < size) {
+            cursor = nextLine(cursor);
+            layout.qv = LineGrid(cursor);
+            do {
+                const size_t next = nextLine(cursor);
+                layout.qv.add(lineLength(cursor), next - cursor);
+                cursor = next;
+            } while(cursor < size && layout.qv.total < layout.sequence.total);
+        }
+        layout.end = cursor;
+        return layout;
+    }
+    RecordLayout getLayout(size_t pos) const {
+        {
+            std::lock_guard<std::mutex> lock(layoutMutex);
+            const map<size_t, RecordLayout>::const_iterator cit = layouts.find(pos);
+            if(cit != layouts.end()) return cit->second;
+        }
+        const RecordLayout layout = computeLayout(pos);
+        if(MIN_CACHED_RECORD_SIZE <= layout.end - pos) {
+            std::lock_guard<std::mutex> lock(layoutMutex);
+            layouts[pos] = layout;
+        }
+        return layout;
+    }
+    // Appends the characters [from, to) of the lines without line terminators.
+    void appendSpan(string& out, const LineGrid& grid, size_t from, size_t to) const {
+        if(grid.uniform) {
+            while(from < to) {
+                const size_t column = from % grid.width;
+                const size_t n = std::min(grid.width - column, to - from);
+                out.append(data + grid.start + from / grid.width * grid.stride + column, n);
+                from += n;
+            }
+            return;
+        }
+        size_t offset = 0;
+        for(size_t cursor = grid.start, i = 0; i < grid.numberOfLines && offset < to; ++i) {
+            const size_t length = lineLength(cursor);
+            if(from < offset + length) {
+                const size_t begin = std::max(from, offset);
+                out.append(data + cursor + (begin - offset), std::min(to, offset + length) - begin);
+            }
+            offset += length;
+            cursor = nextLine(cursor);
+        }
+    }
+
+public:
+    ResidentSequenceFile() : isFASTQ(false), data(NULL), size(0), numberOfSequences(0), pool(NULL) {
+        memset(&fileStat, 0, sizeof(fileStat));
+        memset(&indexStat, 0, sizeof(indexStat));
+    }
+    ~ResidentSequenceFile() {
+        delete pool;
+        if(data != NULL) munmap(const_cast<char*>(data), size);
+    }
+    bool open(const char* file_name, int number_of_connections) {
+        fileName = file_name;
+        if(!doesIndexExist(file_name)) create_index(file_name, false);
+        if(!doesIndexExist(file_name)) return false;
+        indexFileName = get_index_file_name(file_name);
+        // Offsets in a stale index would point into the middle of records for as long as the server runs.
+        if(index_older_than_file(file_name, indexFileName)) {
+            cerr << "ERROR: index file " << indexFileName << " is older than " << file_name << ". Run 'fatt index' again." << endl;
+            return false;
+        }
+        isFASTQ = is_file_fastq(file_name);
+        const int fd = ::open(file_name, O_RDONLY);
+        if(fd < 0) {
+            cerr << "Cannot open '" << file_name << "'" << endl;
+            return false;
+        }
+        struct stat s;
+        if(fstat(fd, &s) != 0 || stat(indexFileName.c_str(), &indexStat) != 0) { ::close(fd); return false; }
+        fileStat = s;
+        size = s.st_size;
+        if(0 < size) {
+            void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if(p == MAP_FAILED) {
+                cerr << "Cannot map '" << file_name << "' into memory" << endl;
+                ::close(fd);
+                size = 0;
+                return false;
+            }
+            madvise(p, size, MADV_WILLNEED);
+            data = static_cast<const char*>(p);
+        }
+        ::close(fd);
+        try {
+            pool = new sqdb::ConnectionPool(indexFileName.c_str(), number_of_connections);
+            sqdb::PooledConnection connection(*pool);
+            sqdb::Statement& stmt = connection.GetStatement("select count(*) from seqpos");
+            if(stmt.Next()) numberOfSequences = stmt.GetField(0);
+        } catch (const sqdb::Exception& e) {
+            cerr << "ERROR: db error. " << e.GetErrorMsg() << endl;
+            return false;
+        }
+        return true;
+    }
+    const string& getFileName() const { return fileName; }
+    long long getNumberOfSequences() const { return numberOfSequences; }
+    // Returns false if the file or its index has been replaced or modified since it was loaded.
+    bool isUnchanged() const {
+        struct stat s;
+        return stat(fileName.c_str(), &s) == 0 && isSameFile(s, fileStat)
+            && stat(indexFileName.c_str(), &s) == 0 && isSameFile(s, indexStat);
+    }
+    // Returns -1 if the name is not in the index.
+    long long findRecord(const string& read_name) {
+        sqdb::PooledConnection connection(*pool);
+        sqdb::Statement& stmt = connection.GetStatement("select pos from seqpos where name=?");
+        stmt.Bind(1, read_name);
+        if(!stmt.Next()) return -1;
+        const long long pos = stmt.GetField(0);
+        return pos < static_cast<long long>(size) ? pos : -1;
+    }
+    void appendRecord(string& out, size_t pos) const {
+        out.append(data + pos, getLayout(pos).end - pos);
+    }
+    // Appends [start, end) (0-origin) of the record at pos. Returns false if out of range.
+    bool appendRegion(string& out, const string& read_name, size_t pos, long long start, long long end) const {
+        const RecordLayout layout = getLayout(pos);
+        if(start < 0 || end < start || static_cast<long long>(layout.sequence.total) < end) return false;
+        if(isFASTQ && static_cast<long long>(layout.qv.total) < end) return false;
+        char buf[64];
+        sprintf(buf, " %lld:%lld\n", start + 1, end);
+        out += isFASTQ ? '@' : '>';
+        out += read_name;
+        out += buf;
+        appendSpan(out, layout.sequence, start, end);
+        out += '\n';
+        if(isFASTQ) {
+            out += "+\n";
+            appendSpan(out, layout.qv, start, end);
+            out += '\n';
+        }
+        return true;
+    }
+};
+
+class FattServer
+{
+    typedef map<string, ResidentSequenceFile*> FileMap;
+    FileMap files;
+
+    ResidentSequenceFile* findFile(const string& file_name, string& response) {
+        const FileMap::const_iterator cit = files.find(file_name);
+        if(cit == files.end()) {
+            response = "E'" + file_name + "' is not served\n";
+            return NULL;
+        }
+        if(!cit->second->isUnchanged()) {
+            response = "E'" + file_name + "' or its index has changed since the server loaded it. Restart the server.\n";
+            return NULL;
+        }
+        return cit->second;
+    }
+
+public:
+    ~FattServer() {
+        for(FileMap::iterator it = files.begin(); it != files.end(); ++it) delete it->second;
+    }
+    bool load(const char* file_name, int number_of_connections) {
+        ResidentSequenceFile* file = new ResidentSequenceFile();
+        if(!file->open(file_name, number_of_connections)) {
+            delete file;
+            return false;
+        }
+        delete files[file_name];
+        files[file_name] = file;
+        cerr << "Loaded '" << file_name << "' (" << file->getNumberOfSequences() << " sequences)" << endl;
+        return true;
+    }
+    void processRequest(const string& request, string& response) {
+        const vector<string> args = split_by_tab(request);
+        const string& cmd = args.front();
+        if(cmd == "extract") {
+            if(args.size() < 3) { response = "Eusage: extract <file> <name>...\n"; return; }
+            ResidentSequenceFile* file = findFile(args[1], response);
+            if(file == NULL) return;
+            response = "O";
+            for(size_t i = 2; i < args.size(); ++i) {
+                const long long pos = file->findRecord(args[i]);
+                if(pos < 0) { response = "E'" + args[i] + "' was not found\n"; return; }
+                file->appendRecord(response, pos);
+            }
+        } else if(cmd == "region") {
+            if(args.size() != 5) { response = "Eusage: region <file> <name> <start (0-origin, inclusive)> <end (0-origin, exclusive)>\n"; return; }
+            ResidentSequenceFile* file = findFile(args[1], response);
+            if(file == NULL) return;
+            const long long pos = file->findRecord(args[2]);
+            if(pos < 0) { response = "E'" + args[2] + "' was not found\n"; return; }
+            response = "O";
+            if(!file->appendRegion(response, args[2], pos, atoll(args[3].c_str()), atoll(args[4].c_str()))) {
+                response = "Ethe region is out of range\n";
+            }
+        } else if(cmd == "count") {
+            if(args.size() != 2) { response = "Eusage: count <file>\n"; return; }
+            ResidentSequenceFile* file = findFile(args[1], response);
+            if(file == NULL) return;
+            char buf[32];
+            sprintf(buf, "%lld\n", file->getNumberOfSequences());
+            response = string("O") + buf;
+        } else {
+            response = "Eunknown command '" + cmd + "'\n";
+        }
+    }
+    static void handleConnection(FattServer* server, int fd) {
+        string request, response;
+        while(read_frame(fd, request, SERVER_MAX_REQUEST_SIZE)) {
+            server->processRequest(request, response);
+            if(SERVER_MAX_RESPONSE_SIZE < response.size()) {
+                char buf[64];
+                sprintf(buf, "Ethe response (%zu bytes) is larger than 4 GB\n", response.size());
+                response = buf;
+            }
+            if(!write_frame(fd, response)) break;
+        }
+        ::close(fd);
+    }
+};
+
+static string server_socket_path;
+
+static void remove_server_socket_and_exit(int)
+{
+    unlink(server_socket_path.c_str());
+    _exit(0);
+}
+
+void do_server(int argc, char** argv)
+{
+    bool flag_force = false;
+    int param_threads = 4;
+    static struct option long_options[] = {
+        {"socket", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"force", no_argument, 0, 'f'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 's':
+            server_socket_path = optarg;
+			break;
+		case 't':
+            param_threads = atoi(optarg);
+			break;
+		case 'f':
+            flag_force = true;
+			break;
+        }
+    }
+    if(server_socket_path.empty()) {
+        cerr << "ERROR: --socket is required" << endl;
+        return;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(sizeof(addr.sun_path) <= server_socket_path.size()) {
+        cerr << "ERROR: the socket path is too long" << endl;
+        return;
+    }
+    strcpy(addr.sun_path, server_socket_path.c_str());
+    FattServer server;
+    for(int i = optind + 1; i < argc; ++i) {
+        if(!server.load(argv[i], param_threads)) {
+            cerr << "ERROR: could not load '" << argv[i] << "'" << endl;
+            return;
+        }
+    }
+    if(access(server_socket_path.c_str(), F_OK) == 0) {
+        if(!flag_force) {
+            cerr << "ERROR: '" << server_socket_path << "' already exists. Give --force to remove it." << endl;
+            return;
+        }
+        unlink(server_socket_path.c_str());
+    }
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+        cerr << "ERROR: cannot listen on '" << server_socket_path << "'. " << strerror(errno) << endl;
+        return;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, remove_server_socket_and_exit);
+    signal(SIGTERM, remove_server_socket_and_exit);
+    cerr << "Listening on '" << server_socket_path << "'" << endl;
+    while(true) {
+        const int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            cerr << "ERROR: accept failed. " << strerror(errno) << endl;
+            break;
+        }
+        thread(FattServer::handleConnection, &server, fd).detach();
+    }
+    unlink(server_socket_path.c_str());
+}
+
+void do_client(int argc, char** argv)
+{
+    string socket_path;
+    static struct option long_options[] = {
+        {"socket", required_argument, 0, 's'},
+        {0, 0, 0, 0} // end of long options
+    };
+    while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1) break;
+		switch(c) {
+		case 0:
+			// you can see long_options[option_index].name/flag and optarg (null if no argument).
+			break;
+		case 's':
+            socket_path = optarg;
+			break;
+        }
+    }
+    if(socket_path.empty() || argc <= optind + 1) {
+        cerr << "ERROR: usage: fatt client --socket=path <command> [args...]" << endl;
+        exit(1);
+    }
+    string request;
+    for(int i = optind + 1; i < argc; ++i) {
+        if(optind + 1 < i) request += '\t';
+        request += argv[i];
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        cerr << "ERROR: cannot connect to '" << socket_path << "'. " << strerror(errno) << endl;
+        exit(1);
+    }
+    string response;
+    if(SERVER_MAX_REQUEST_SIZE < request.size()) {
+        cerr << "ERROR: the request is larger than " << SERVER_MAX_REQUEST_SIZE << " bytes" << endl;
+        exit(1);
+    }
+    if(!write_frame(fd, request) || !read_frame(fd, response, SERVER_MAX_RESPONSE_SIZE) || response.empty()) {
+        cerr << "ERROR: the server closed the connection" << endl;
+        exit(1);
+    }
+    ::close(fd);
+    if(response[0] != 'O') {
+        cerr << "ERROR: " << response.substr(1) << flush;
+        exit(1);
+    }
+    cout.write(response.data() + 1, response.size() - 1);
+}
+
 void show_usage()
 {
     cerr << "Usage: fatt <command> [options...]" << endl;
@@ -3008,7 +8815,11 @@ void show_help(const char* subcommand)
 	const string subcmd = subcommand;
 	if(subcmd == "count") {
         cerr << "Usage: fatt count [options...] <FAST(A|Q) files>\n\n";
-        cerr << "Currently, no options available.\n\n";
+        cerr << "--emit-partial=file\tWrite a summary of all the files for merge-stats into file ('-' for stdout) instead.\n";
+        cerr << "--group-by=key\tOutput the statistics of each group of reads with the same key instead (see stat).\n";
+        cerr << "--json\tOutput the groups in JSON format.\n";
+        cerr << "--threads=n\tRead the files with n threads for --group-by (1 by default).\n";
+        cerr << "--qvbase=n\tThe QV base for --group-by (33 by default).\n\n";
         cerr << "It counts the number of the sequences in each given file.\n";
         return;
 	}
@@ -3035,9 +8846,87 @@ void show_help(const char* subcommand)
         cerr << "--start\tSpecify the start index of reads to be output. 0-based, inclusive.\n";
         cerr << "--end\tSpecify the end index of reads to be output. 0-based, exclusive.\n";
         cerr << "--num\tSpecify the number of reads to be output.\n";
+        cerr << "--threads\tLook up read names in the index with this many threads (1 by default).\n";
+        cerr << "--bloom=n\tPut a Bloom filter of n MiB in front of the name list (0 chooses the size from the number of names).\n";
+        cerr << "\t\tIt needs 1 MiB per 1M names at least, and cannot be used with --unique.\n";
+        cerr << "\tIt speeds up huge name lists where most reads are not in the list (e.g., with --reverse).\n";
+        cerr << "--fingerprint=n\tWith --unique, remember n-bit (64 or 128) hashes of the read names instead of the names.\n";
+        cerr << "\tIt takes about 12 or 25 bytes per read. Reads whose names have the same hash are taken as duplicates.\n";
+        cerr << "--verify\tWith --fingerprint, confirm that the names are really the same by reading them back from the file.\n";
+        cerr << "--memory=n\tWith --fingerprint, if the fingerprints may not fit in n MiB, spill them to disk in partitions.\n";
+        cerr << "--tmpdir=dir\tThe directory for the spilled fingerprints ($TMPDIR or /tmp by default).\n";
+        cerr << "--paired\tTake R1 and R2 files and output a pair only if both mates are selected together.\n";
+        cerr << "\tA pair is selected if either mate name or the name without /1 or /2 is selected. --start and --end count pairs.\n";
+        cerr << "--interleaved\tLike --paired, but the mates are consecutive reads in one file.\n";
+        cerr << "--out1=file, --out2=file\tWrite R1 and R2 of the pairs to separate files (interleaved to stdout by default).\n";
+        cerr << "--sorted\tThe reads and the name list (--file or --stdin) are both sorted by name ('LC_ALL=C sort' order).\n";
+        cerr << "\tThey are walked in lockstep without holding the names in memory. It stops if either is not sorted.\n";
         cerr << "--force\tForce on error.\n";
         return;
     }
+    if(subcmd == "dedup") {
+        cerr << "Usage: fatt dedup [options...] <FAST(A|Q) files>\n\n";
+        cerr << "--qv\tReads are duplicates only if their QVs are also the same.\n";
+        cerr << "--best\tKeep the read with the highest mean QV instead of the first one.\n";
+        cerr << "--threads=n\tHash reads with n threads (1 by default).\n";
+        cerr << "--memory=n\tIf the reads may not fit in n MiB, spill them to disk in partitions.\n";
+        cerr << "\tIt is 1024 MiB if not given. Every unique read takes 32 bytes, or every read with --best.\n";
+        cerr << "\tSpilling and --best read the input twice, so they need regular files, not pipes.\n";
+        cerr << "--tmpdir=dir\tThe directory for the spilled reads ($TMPDIR or /tmp by default).\n\n";
+        cerr << "It outputs the reads whose sequences have not appeared before, in the input order.\n";
+        cerr << "Sequences are compared by 128-bit hashes. Names are not looked at.\n";
+        return;
+    }
+    if(subcmd == "filter") {
+        cerr << "Usage: fatt filter --expr=condition [options...] <FAST(A|Q) files>\n\n";
+        cerr << "--expr=condition\tOutput the reads that satisfy the condition.\n";
+        cerr << "--qvbase=n\tThe QV base for qv (33 by default).\n";
+        cerr << "--threads=n\tEvaluate the condition with n threads (1 by default).\n\n";
+        cerr << "Values: len, gc (fraction of G/C), nfrac (fraction of N), qv (mean QV),\n";
+        cerr << "        name, desc (the header after the name), field(k) (the k-th field of desc), tag(\"key\") (the value of key=value in desc),\n";
+        cerr << "        numbers, and \"strings\".\n";
+        cerr << "Operators: == != < <= > >= (numbers or strings), ~ !~ (regular expression, /regex/ or \"regex\"), ! && || and ( ).\n";
+        cerr << "ex) fatt filter --expr='len >= 100 && qv >= 20 && field(1) ~ /:N:0:ACGTAC$/' foo.fastq\n";
+        return;
+    }
+    if(subcmd == "search") {
+        cerr << "Usage: fatt search [options...] <FAST(A|Q) files>\n\n";
+        cerr << "--pattern=seq\tSearch for this sequence. You can specify this option as many times as you wish.\n";
+        cerr << "--patterns=file\tRead patterns from a file, one per line, or in FASTA (the names are used in the output).\n";
+        cerr << "--bothstrands\tSearch for the reverse complements of the patterns, too.\n";
+        cerr << "--iupac\tAllow IUPAC codes (R, Y, N, ...) in the patterns.\n";
+        cerr << "--coords\tOutput the matches (read name, pattern, strand, start, end) instead of the reads.\n";
+        cerr << "\tStart is 0-origin and inclusive, and end is exclusive, on the forward strand of the read.\n";
+        cerr << "--invert\tOutput the reads that match none of the patterns.\n";
+        cerr << "--threads=n\tSearch with n threads (1 by default).\n\n";
+        cerr << "It outputs the reads that match any of the patterns. Case is ignored.\n";
+        return;
+    }
+    if(subcmd == "qc") {
+        cerr << "Usage: fatt qc [options...] <FAST(A|Q) files>\n\n";
+        cerr << "--html\tOutput in HTML format.\n";
+        cerr << "--json\tOutput in JSON format.\n";
+        cerr << "--threads=n\tRead the files with n threads (1 by default).\n";
+        cerr << "--qvbase=n\tThe QV base (33 by default).\n";
+        cerr << "--maxcycle=n\tCollect per-cycle statistics for the first n cycles (1000 by default).\n";
+        cerr << "--minpercent=p\tReport the sequences that start p% or more of the reads (0.1 by default).\n\n";
+        cerr << "It reads the files once and reports the length statistics, GC and N content, per-cycle QV quantiles\n";
+        cerr << "and base composition, the distributions of GC and lengths, and overrepresented sequences\n";
+        cerr << "(the first 50 bp of the first 100,000 reads).\n";
+        return;
+    }
+    if(subcmd == "sample") {
+        cerr << "Usage: fatt sample (--num=k|--fraction=p) [options...] [<FAST(A|Q) files>]\n\n";
+        cerr << "--num=k\tOutput exactly k reads chosen uniformly at random (or all if there are fewer).\n";
+        cerr << "--fraction=p\tOutput each read with probability p.\n";
+        cerr << "--seed=n\tThe random seed. The same seed gives the same sample. Without it, the seed is shown.\n";
+        cerr << "--paired\tSample pairs from two files (R1 and R2). Mates must be in the same order.\n";
+        cerr << "--out1=file\tWrite the sampled R1 reads here (with --paired).\n";
+        cerr << "--out2=file\tWrite the sampled R2 reads here (with --paired). Without --out1/--out2, pairs are interleaved on stdout.\n\n";
+        cerr << "The input is read once. '-' or no file reads stdin. gzip, bzip2, xz and zstd files are decompressed.\n";
+        cerr << "The reads are output in the input order.\n";
+        return;
+    }
     if(subcmd == "len") {
         cerr << "Usage: fatt len [options...] <FAST(A|Q) files>\n\n";
         cerr << "--name\tAdd the name of the sequences in the second column.\n\n";
@@ -3050,9 +8939,29 @@ void show_help(const char* subcommand)
         cerr << "--json\tOutput in JSON format.\n";
         cerr << "--contig\tOutput contig statistics.\n";
         cerr << "--scaffold\tOutput statistics of scaffold with gaps.\n";
+        cerr << "--emit-partial=file\tWrite a summary of all the files for merge-stats into file ('-' for stdout) instead.\n";
+        cerr << "--group-by=key\tOutput the read count, bases, lengths, GC, N and QVs of each group of reads with the same key\n";
+        cerr << "\t\tas TSV (or JSON with --json), sorted by the key. The key is one of\n";
+        cerr << "\t\tname:k (the k-th colon-separated field of the read name; 4 is the lane and 5 the tile in Illumina),\n";
+        cerr << "\t\tfield:k (the k-th field after the name), tag:key (key=value after the name, as in ONT),\n";
+        cerr << "\t\tand regex:re (the first parenthesized part of the match in the header line).\n";
+        cerr << "--threads=n\tRead the files with n threads for --group-by (1 by default).\n";
+        cerr << "--qvbase=n\tThe QV base for --group-by (33 by default).\n";
         cerr << "If neither of --contig nor --scaffold is specified, statistics of scaffold with gaps, scaffold without gaps, and contigs are reported.\n";
         return;
     }
+    if(subcmd == "merge-stats") {
+        cerr << "Usage: fatt merge-stats [options...] <summary files>\n\n";
+        cerr << "--html\tOutput in HTML format.\n";
+        cerr << "--json\tOutput in JSON format.\n";
+        cerr << "--contig\tOutput contig statistics.\n";
+        cerr << "--scaffold\tOutput statistics of scaffold with gaps.\n";
+        cerr << "--count\tOutput the total in the format of count instead.\n";
+        cerr << "--qvbase=n\tThe QV base for the mean QV (33 by default).\n\n";
+        cerr << "It reports the statistics of the files summarized by stat --emit-partial or count --emit-partial,\n";
+        cerr << "as if stat were run on all of them at once, with the GC content, N and QVs.\n";
+        return;
+    }
     if(subcmd == "index") {
         cerr << "Usage: fatt index [options...] <FAST(A|Q) files>\n\n";
         cerr << "--force\tRemove an existing index if any.\n\n";
@@ -3063,7 +8972,9 @@ void show_help(const char* subcommand)
     }
     if(subcmd == "guessqvtype") {
         cerr << "Usage: fatt guessqvtype [options...] <FAST(A|Q) files>\n\n";
-        cerr << "Currently, no options available.\n\n";
+        cerr << "--sample\tRead blocks of 1000 reads at several offsets instead of the whole file, and stop as soon as the type is certain.\n";
+        cerr << "\t\tThe confidence is shown in the fourth column; the whole file is read when the blocks are not enough.\n";
+        cerr << "--blocks=n\tThe number of blocks for --sample (16 by default)\n";
         return;
     }
     if(subcmd == "convertqv") {
@@ -3076,6 +8987,7 @@ void show_help(const char* subcommand)
         cerr << "\t--toillumina15\tOutput is Illumina 1.5\n";
         cerr << "\t--toillumina18\tOutput is Illumina 1.8\n";
         cerr << "\t--tosanger\tOutput is Sanger FASTQ (default)\n";
+        cerr << "\t--threads=n\tUse n threads\n";
         cerr << "\nCustom options:\n";
         cerr << "\t--frombase\tSet the base of input (the ord of the character that corresponds to QV = 0)\n";
         cerr << "\t--tobase\tSet the base of output (the ord of the character that corresponds to QV = 0)\n";
@@ -3124,6 +9036,41 @@ void show_help(const char* subcommand)
         cerr << "--bimer\tShow only bimers\n";
         cerr << "--trimer\tShow only trimers\n";
         cerr << "--dapicheck\tShow DAPI-staining related stats\n";
+        cerr << "--kmer=k\tCount k-mers of ACGT (k <= 31) instead, with 1-mer stats. Only the k-mers that appear are shown.\n";
+        cerr << "\t\tWithout --ignorecase, lowercase (soft-masked) bases are not in k-mers.\n";
+        cerr << "--canonical\tWith --kmer, count a k-mer and its reverse complement together (as the smaller one).\n";
+        return;
+    }
+    if(subcmd == "kmercount") {
+        cerr << "Usage: fatt kmercount [options...] <FAST(A|Q) files>\n\n";
+        cerr << "Counts k-mers of ACGT on disk in two passes, and prints the histogram of the counts (count, number of k-mers).\n";
+        cerr << "--kmer=k\tThe length of k-mers (1 <= k <= 31, 21 by default)\n";
+        cerr << "--canonical\tCount a k-mer and its reverse complement together (as the smaller one)\n";
+        cerr << "--ignorecase\tCount lowercase (soft-masked) bases, too\n";
+        cerr << "--minimizer=m\tThe length of minimizers to bin k-mers (11 by default)\n";
+        cerr << "--threads=n\tUse n threads\n";
+        cerr << "--memory=MiB\tThe memory for the hash tables of all threads (1024 by default), which decides the number of bins\n";
+        cerr << "--tmpdir=dir\tPut the bins in dir ($TMPDIR or /tmp by default); they need about (the number of bases) / 4 bytes\n";
+        cerr << "--maxcount=n\tThe last line of the histogram (n) includes larger counts (10000 by default)\n";
+        cerr << "--db=file\tWrite the k-mers and their counts in ascending order of k-mers into a binary file\n";
+        cerr << "--dump\t\tPrint the databases written by --db (given instead of FAST(A|Q) files) as text\n";
+        return;
+    }
+    if(subcmd == "sketch") {
+        cerr << "Usage: fatt sketch [options...] <FAST(A|Q) files>\n\n";
+        cerr << "Writes a MinHash sketch of the canonical k-mers (ignoring case) of each file into <file>.sketch.\n";
+        cerr << "--kmer=k\tThe length of k-mers (1 <= k <= 31, 21 by default)\n";
+        cerr << "--size=n\tKeep the n smallest hashes (bottom-k sketch, 1000 by default)\n";
+        cerr << "--scaled=n\tKeep the hashes below 2^64/n instead (FracMinHash), about one in n distinct k-mers\n";
+        cerr << "--threads=n\tUse n threads\n";
+        cerr << "--output=file\tWrite all the sketches into a file instead\n";
+        return;
+    }
+    if(subcmd == "compare-sketches") {
+        cerr << "Usage: fatt compare-sketches [options...] <sketch files>\n\n";
+        cerr << "Estimates the Jaccard index and the ANI for each pair of the sketches written by sketch.\n";
+        cerr << "Outputs name1, name2, Jaccard index, ANI and the shared/compared hashes in a line.\n";
+        cerr << "--min-ani=x\tShow only the pairs whose ANI is x or larger\n";
         return;
     }
     if(subcmd == "edit") {
@@ -3169,6 +9116,23 @@ void show_help(const char* subcommand)
         cerr << "You can specify the prefix for output files by giving --prefix option.\n";
         return;
     }
+    if(subcmd == "server") {
+        cerr << "Usage: fatt server --socket=path [options...] <FAST(A|Q) files>\n\n";
+        cerr << "--socket=path\tListen on this Unix domain socket.\n";
+        cerr << "--threads=n\tOpen n index connections per file (4 by default).\n";
+        cerr << "--force\tRemove an existing socket file if any.\n\n";
+        cerr << "It keeps the given files and their indexes resident in memory and answers queries over the socket.\n";
+        cerr << "An index is created first if a file does not have one.\n";
+        cerr << "Queries: extract <file> <name>..., region <file> <name> <start> <end>, count <file>\n";
+        cerr << "See the manual for the protocol.\n";
+        return;
+    }
+    if(subcmd == "client") {
+        cerr << "Usage: fatt client --socket=path <query> [args...]\n\n";
+        cerr << "It sends a single query to 'fatt server' and outputs the result.\n";
+        cerr << "ex) fatt client --socket=/tmp/fatt.sock extract foo.fastq read1 read2\n";
+        return;
+    }
     if(subcmd == "help") {
         cerr << "Uh? No detailed help for help.\n";
         cerr << "Read the manual, or ask the author.\n";
@@ -3180,9 +9144,18 @@ void show_help(const char* subcommand)
 	cerr << "\tname\toutput the names of reads\n";
     cerr << "\tchksamename\toutput the names of reads if the read name is duplicated\n";
     cerr << "\tcomposition\tcalculate the 1-, 2-, 3-mer composition.\n";
+    cerr << "\tkmercount\tcount k-mers of large data with temporary files.\n";
+    cerr << "\tsketch\tmake MinHash sketches of files.\n";
+    cerr << "\tcompare-sketches\testimate the similarity (Jaccard, ANI) of sketched files.\n";
 	cerr << "\textract\textract a set of reads with condition\n";
+    cerr << "\tdedup\tremove reads with the same sequence\n";
+    cerr << "\tfilter\toutput reads that satisfy a condition on their names, lengths, GC, QVs, ...\n";
+    cerr << "\tsearch\tsearch sequences for many motifs (adapters, barcodes, primers, ...) at once\n";
+    cerr << "\tsample\trandomly sample a given number or fraction of reads\n";
+    cerr << "\tqc\treport per-cycle QVs and composition, GC and length distributions, and overrepresented sequences\n";
 	cerr << "\tlen\toutput the lengths of reads\n";
     cerr << "\tstat\tshow the statistics of input sequences\n";
+    cerr << "\tmerge-stats\tshow the statistics of many partial summaries (stat --emit-partial) together\n";
     cerr << "\tindex\tcreate an index on read names\n";
     cerr << "\tclean\tconvert non-ACGT(N) characters to ACGT\n";
     cerr << "\tguessqvtype\tguess the type of FASTQ (Sanger/Illumina1.3/Illumina1.5/...)\n";
@@ -3193,6 +9166,8 @@ void show_help(const char* subcommand)
     cerr << "\ttofasta\tconvert a FASTQ file into a FASTA file\n";
     cerr << "\tedit\tedit sequences by DSL (domain-specific language)\n";
     cerr << "\tsplit\tsplit sequences into multiple files\n";
+    cerr << "\tserver\tserve queries on indexed files over a Unix domain socket\n";
+    cerr << "\tclient\tsend a query to fatt server\n";
     cerr << "\thelp\tshow help message\n";
     cerr << "\nType 'fatt help <command>' to show the detail of the command.\n";
 }
@@ -3203,6 +9178,7 @@ void dispatchByCommand(const string& commandString, int argc, char** argv)
         show_version();
         return;
     }
+    if(getenv("FATT_HUGE_PAGES") != NULL) BufferPool::instance().setUseHugePages(true);
     CoutBuffering cb;
 	if(commandString == "count") {
 		do_count(argc, argv);
@@ -3220,6 +9196,26 @@ void dispatchByCommand(const string& commandString, int argc, char** argv)
 		do_extract(argc, argv);
         return;
 	}
+    if(commandString == "dedup") {
+        do_dedup(argc, argv);
+        return;
+    }
+    if(commandString == "search") {
+        do_search(argc, argv);
+        return;
+    }
+    if(commandString == "filter") {
+        do_filter(argc, argv);
+        return;
+    }
+    if(commandString == "sample") {
+        do_sample(argc, argv);
+        return;
+    }
+    if(commandString == "qc") {
+        do_qc(argc, argv);
+        return;
+    }
     if(commandString == "len") {
         do_len(argc, argv);
         return;
@@ -3228,6 +9224,10 @@ void dispatchByCommand(const string& commandString, int argc, char** argv)
         do_stat(argc, argv);
         return;
     }
+    if(commandString == "merge-stats") {
+        do_merge_stats(argc, argv);
+        return;
+    }
     if(commandString == "index") {
         do_index(argc, argv);
         return;
@@ -3264,6 +9264,18 @@ void dispatchByCommand(const string& commandString, int argc, char** argv)
         do_composition(argc, argv);
         return;
     }
+    if(commandString == "kmercount") {
+        do_kmercount(argc, argv);
+        return;
+    }
+    if(commandString == "sketch") {
+        do_sketch(argc, argv);
+        return;
+    }
+    if(commandString == "compare-sketches") {
+        do_compare_sketches(argc, argv);
+        return;
+    }
     if(commandString == "edit") {
         do_edit(argc, argv);
         return;
@@ -3272,6 +9284,14 @@ void dispatchByCommand(const string& commandString, int argc, char** argv)
         do_split(argc, argv);
         return; // NOTE: do_split never returns.
     }
+    if(commandString == "server") {
+        do_server(argc, argv);
+        return;
+    }
+    if(commandString == "client") {
+        do_client(argc, argv);
+        return;
+    }
     // Help or error.
     if(commandString != "help") {
         cerr << "ERROR: Unknown command '" << commandString << "'" << endl;
@@ -422,6 +422,55 @@ Db::Db(const SQDB_CHAR* fileName)
   IncRef();
 }
 
+#ifdef SQDB_UTF8
+static std::string MakeImmutableUri(const char* fileName)
+{
+  // Characters that have a special meaning in a URI must be escaped.
+  std::string uri = "file:";
+  for(const char* p = fileName; *p; ++p) {
+    const char c = *p;
+    if(c == '%' || c == '?' || c == '#') {
+      char buf[4];
+      sprintf(buf, "%%%02X", (unsigned char)c);
+      uri += buf;
+    } else {
+      uri += c;
+    }
+  }
+  uri += "?immutable=1";
+  return uri;
+}
+#endif
+
+Db::Db(const SQDB_CHAR* fileName, OpenMode mode)
+: RefCount()
+{
+  if ( mode == OPEN_READWRITE )
+  {
+#ifdef SQDB_UTF8
+    const int ret = sqlite3_open(fileName, &m_db);
+#else
+    const int ret = sqlite3_open16(fileName, &m_db);
+#endif
+    CHECK(m_db, ret);
+  }
+  else
+  {
+#ifdef SQDB_UTF8
+    const std::string uri = MakeImmutableUri(fileName);
+    const int ret = sqlite3_open_v2(uri.c_str(), &m_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+    CHECK(m_db, ret);
+#else
+    // There is no UTF-16 variant of sqlite3_open_v2().
+    const int ret = sqlite3_open16(fileName, &m_db);
+    CHECK(m_db, ret);
+    Query(SQDB_MAKE_TEXT("PRAGMA query_only = 1")).Next();
+#endif
+  }
+
+  IncRef();
+}
+
 void Db::BeginTransaction()
 {
   Query(SQDB_MAKE_TEXT("BEGIN;")).Next();
@@ -473,6 +522,37 @@ void Db::MakeItFasterAndDangerous()
   Do("PRAGMA journal_mode = MEMORY");
 }
 
+void Db::UseBuildProfile(int pageSize, int cacheSizeKiB)
+{
+  QueryStr str;
+  Do(str.Format(SQDB_MAKE_TEXT("PRAGMA page_size = %d"), pageSize));
+  // A negative value is interpreted as KiB rather than the number of pages.
+  Do(str.Format(SQDB_MAKE_TEXT("PRAGMA cache_size = %d"), -cacheSizeKiB));
+  Do("PRAGMA locking_mode = EXCLUSIVE");
+  Do("PRAGMA temp_store = MEMORY");
+  MakeItFasterAndDangerous();
+}
+
+void Db::UseQueryProfile(long long mmapSize, int cacheSizeKiB)
+{
+  QueryStr str;
+  Do(str.Format(SQDB_MAKE_TEXT("PRAGMA mmap_size = %lld"), mmapSize));
+  Do(str.Format(SQDB_MAKE_TEXT("PRAGMA cache_size = %d"), -cacheSizeKiB));
+}
+
+void Db::AttachReadOnly(const SQDB_CHAR* fileName, const SQDB_CHAR* schemaName)
+{
+  QueryStr str;
+  Statement stmt = Query(str.Format(SQDB_MAKE_TEXT("ATTACH DATABASE ? AS %s"), schemaName));
+#ifdef SQDB_UTF8
+  // The main database is opened with SQLITE_OPEN_URI only in read-only mode.
+  stmt.Bind(1, MakeImmutableUri(fileName));
+#else
+  stmt.Bind(1, fileName);
+#endif
+  stmt.Next();
+}
+
 Db::Db(const Db& x)
 : RefCount(x),
   m_db(x.m_db)
@@ -500,3 +580,85 @@ Db::~Db()
   }
 }
 
+ConnectionPool::ConnectionPool(const SQDB_CHAR* fileName, int size)
+{
+  if ( size < 1 )
+    size = 1;
+  m_dbs.reserve(size);
+  for ( int i = 0; i < size; ++i )
+  {
+    m_dbs.push_back(Db(fileName, Db::OPEN_READONLY_IMMUTABLE));
+    m_dbs.back().UseQueryProfile();
+  }
+  m_statements.resize(size);
+  // Hand out slot 0 first.
+  for ( int i = size - 1; 0 <= i; --i )
+    m_freeSlots.push_back(i);
+}
+
+int ConnectionPool::GetSize() const
+{
+  return m_dbs.size();
+}
+
+int ConnectionPool::Acquire()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while ( m_freeSlots.empty() )
+    m_slotReleased.wait(lock);
+  const int slot = m_freeSlots.back();
+  m_freeSlots.pop_back();
+  return slot;
+}
+
+void ConnectionPool::Release(int slot)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_freeSlots.push_back(slot);
+  }
+  m_slotReleased.notify_one();
+}
+
+Db& ConnectionPool::GetDb(int slot)
+{
+  assert(0 <= slot && slot < (int)m_dbs.size());
+  return m_dbs[slot];
+}
+
+Statement& ConnectionPool::GetStatement(int slot, const SQDB_CHAR* queryStr)
+{
+  assert(0 <= slot && slot < (int)m_dbs.size());
+  StatementMap& statements = m_statements[slot];
+  StatementMap::iterator it = statements.find(queryStr);
+  if ( it == statements.end() )
+  {
+    it = statements.insert(StatementMap::value_type(queryStr, m_dbs[slot].Query(queryStr))).first;
+  }
+  return it->second;
+}
+
+ConnectionPool::~ConnectionPool()
+{
+  m_statements.clear();
+}
+
+PooledConnection::PooledConnection(ConnectionPool& pool)
+: m_pool(pool), m_slot(pool.Acquire())
+{
+}
+
+Db& PooledConnection::GetDb()
+{
+  return m_pool.GetDb(m_slot);
+}
+
+Statement& PooledConnection::GetStatement(const SQDB_CHAR* queryStr)
+{
+  return m_pool.GetStatement(m_slot, queryStr);
+}
+
+PooledConnection::~PooledConnection()
+{
+  m_pool.Release(m_slot);
+}
@@ -12,6 +12,10 @@
 #define SQDB_SQDB_H
 
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 #include "sqlite3.h"
 
@@ -194,7 +198,16 @@ private:
 class Db : public RefCount
 {
 public:
+  enum OpenMode
+  {
+    OPEN_READWRITE,
+    // Read-only, and the file is promised never to change while it is open
+    // (URI parameter immutable=1), so SQLite skips locking entirely.
+    OPEN_READONLY_IMMUTABLE
+  };
+
   Db(const SQDB_CHAR* fileName);
+  Db(const SQDB_CHAR* fileName, OpenMode mode);
 
   void BeginTransaction();
   void CommitTransaction();
@@ -206,6 +219,15 @@ public:
   long long LastId();
   void MakeItFasterAndDangerous();
 
+  // Bulk loading profile. Call right after opening an empty database,
+  // because page_size cannot be changed once a table exists.
+  void UseBuildProfile(int pageSize = 16384, int cacheSizeKiB = 256 * 1024);
+  // Lookup profile for a database opened with OPEN_READONLY_IMMUTABLE.
+  void UseQueryProfile(long long mmapSize = 2147418112LL, int cacheSizeKiB = 16 * 1024);
+  // Attaches another database file read-only and immutable, as with
+  // OPEN_READONLY_IMMUTABLE, under schemaName.
+  void AttachReadOnly(const SQDB_CHAR* fileName, const SQDB_CHAR* schemaName);
+
   Db(const Db& x);
   Db& operator=(const Db& x);
 
@@ -215,6 +237,60 @@ private:
   sqlite3* m_db;
 };
 
+// A fixed number of read-only connections to one database file for
+// concurrent lookups. Each slot owns its connection and the statements
+// prepared on it, so a slot must be used by at most one thread at a time;
+// Acquire() hands out free slots and blocks while all of them are in use.
+class ConnectionPool
+{
+public:
+  ConnectionPool(const SQDB_CHAR* fileName, int size);
+
+  int GetSize() const;
+
+  int Acquire();
+  void Release(int slot);
+
+  Db& GetDb(int slot);
+  // Prepares queryStr on the slot's connection once and reuses it afterwards.
+  Statement& GetStatement(int slot, const SQDB_CHAR* queryStr);
+
+  ~ConnectionPool();
+
+private:
+  ConnectionPool(const ConnectionPool& x);
+  ConnectionPool& operator=(const ConnectionPool& x);
+
+  typedef std::map<SQDB_STD_STRING, Statement> StatementMap;
+
+  // Statements must be finalized before their connections are closed,
+  // so m_statements is declared (and thus destroyed) after m_dbs.
+  std::vector<Db> m_dbs;
+  std::vector<StatementMap> m_statements;
+  std::vector<int> m_freeSlots;
+  std::mutex m_mutex;
+  std::condition_variable m_slotReleased;
+};
+
+// Holds a slot of a ConnectionPool for the lifetime of the object.
+class PooledConnection
+{
+public:
+  PooledConnection(ConnectionPool& pool);
+
+  Db& GetDb();
+  Statement& GetStatement(const SQDB_CHAR* queryStr);
+
+  ~PooledConnection();
+
+private:
+  PooledConnection(const PooledConnection& x);
+  PooledConnection& operator=(const PooledConnection& x);
+
+  ConnectionPool& m_pool;
+  int m_slot;
+};
+
 }
 
 #endif